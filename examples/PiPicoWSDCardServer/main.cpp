@@ -12,9 +12,12 @@ SdFs sd;
 
 WiFiServer server(80);
 
-// Needs to be large enough to hold a current file path and
-// a multipart/form-data part's headers at the same time.
-// Experiment depending on your particular use case.
+// Buffer used when streaming files and directory listings
+// to clients. Responses are collected here and sent in as few
+// writes as possible, so it must at least hold a response's
+// headers (a few hundred bytes). It's shared by all connections,
+// so a larger buffer speeds up downloads without costing memory
+// per client.
 std::array<char, 512> workingBuffer;
 
 // Buffer used when streaming uploaded files to the SD card.
@@ -22,6 +25,27 @@ std::array<char, 512> workingBuffer;
 // of increased memory usage.
 std::array<char, 64> uploadStreamingBuffer;
 
+// Optional buffer that collects uploaded data into whole SD
+// card sectors before writing it. Any multiple of 512 bytes
+// works, larger buffers mean fewer, larger writes.
+std::array<char, 4096> uploadWriteBuffer;
+
+// Optional buffer that keeps rendered directory listings, so
+// refreshing a page doesn't re-read the directory from the card.
+// Directories whose listing doesn't fit are read every time.
+std::array<char, 8192> listingCache;
+
+// Optional buffer that keeps small, frequently downloaded files
+// (and the start of larger ones), so they're sent from RAM
+// instead of being read from the card every time.
+std::array<char, 8192> fileCache;
+
+// Optional buffer that lets one download or upload read or
+// write the card while earlier blocks are still being sent or
+// received. Build with SDSERVER_STORAGE_ON_SECOND_CORE=1 and
+// uncomment loop1() below to do the card side on the second core.
+std::array<char, 4096> pipelineBuffer;
+
 SDServer sdServer;
 
 void halt() {
@@ -84,8 +108,16 @@ void setup() {
     uploadStreamingBuffer.begin(),
     uploadStreamingBuffer.size()
   );
+  sdServer.setUploadWriteBuffer(uploadWriteBuffer.begin(), uploadWriteBuffer.size());
+  sdServer.setListingCache(listingCache.begin(), listingCache.size());
+  sdServer.setFileCache(fileCache.begin(), fileCache.size());
+  sdServer.setPipelineBuffer(pipelineBuffer.begin(), pipelineBuffer.size());
 }
 
 void loop() {
   sdServer.handleClient();
-}
\ No newline at end of file
+}
+
+// void loop1() {
+//   sdServer.serviceStorage();
+// }
\ No newline at end of file
@@ -0,0 +1,90 @@
+/* MIT License
+
+Copyright (c) 2023 Kenny Riddile
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#include "Arduino.h"
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+HostSerial Serial;
+
+static std::chrono::steady_clock::time_point startTime() {
+    static const auto start = std::chrono::steady_clock::now();
+    return start;
+}
+
+unsigned long long host::nowMicros() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime()).count();
+}
+
+unsigned long micros() { return static_cast<unsigned long>(host::nowMicros()); }
+unsigned long millis() { return static_cast<unsigned long>(host::nowMicros() / 1000); }
+void delay(unsigned long ms) { std::this_thread::sleep_for(std::chrono::milliseconds(ms)); }
+void yield() { std::this_thread::yield(); }
+
+void host::spinFor(unsigned long long micros) {
+    if (!micros) return;
+    unsigned long long until = nowMicros() + micros;
+    while (nowMicros() < until) {}
+}
+
+size_t Print::write(const uint8_t* buffer, size_t size) {
+    size_t n = 0;
+    while (n < size && write(buffer[n])) ++n;
+    return n;
+}
+
+size_t Print::print(unsigned long long number, int base) {
+    char buffer[66];
+    char* p = buffer + sizeof(buffer) - 1;
+    *p = '\0';
+    if (base < 2) base = 10;
+    do {
+        int digit = number % base;
+        *--p = digit < 10 ? '0' + digit : 'A' + digit - 10;
+        number /= base;
+    } while (number);
+    return write(p);
+}
+
+size_t Print::print(long number, int base) {
+    if (number < 0 && base == DEC) {
+        size_t n = print('-');
+        return n + print(static_cast<unsigned long long>(-number), base);
+    }
+    return print(static_cast<unsigned long long>(number), base);
+}
+
+size_t Print::printf(const char* format, ...) {
+    char buffer[512];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    if (length < 0) return 0;
+    return write(buffer, std::min(static_cast<size_t>(length), sizeof(buffer) - 1));
+}
+
+size_t HostSerial::write(uint8_t c) { return fwrite(&c, 1, 1, stderr); }
+size_t HostSerial::write(const uint8_t* buffer, size_t size) { return fwrite(buffer, 1, size, stderr); }
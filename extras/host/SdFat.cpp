@@ -0,0 +1,428 @@
+/* MIT License
+
+Copyright (c) 2023 Kenny Riddile
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#include "SdFat.h"
+
+#include <algorithm>
+#include <ctime>
+
+static const uint32_t SECTOR_SIZE = 512;
+
+SdFs::SdFs() : _root(std::make_shared<host::Node>()) {
+    _root->directory = true;
+}
+
+void SdFs::charge(size_t bytes) {
+    unsigned long long cost = _profile.callLatencyMicros;
+    if (_profile.bytesPerSecond) cost += bytes * 1000000ULL / _profile.bytesPerSecond;
+    host::spinFor(cost);
+}
+
+std::shared_ptr<host::Node> SdFs::share(host::Node* node) {
+    if (!node || !node->parent) return _root;
+    for (auto& child : node->parent->children) {
+        if (child.get() == node) return child;
+    }
+    return nullptr;
+}
+
+static bool sameName(const std::string& a, const char* b, size_t length) {
+    if (a.size() != length) return false;
+    for (size_t i = 0; i < length; ++i) {
+        if (tolower(static_cast<unsigned char>(a[i])) != tolower(static_cast<unsigned char>(b[i]))) return false;
+    }
+    return true;
+}
+
+std::shared_ptr<host::Node> SdFs::lookupFrom(std::shared_ptr<host::Node> dir, const char* path, std::shared_ptr<host::Node>* parent, const char** leaf) {
+    std::shared_ptr<host::Node> node = dir;
+    while (*path == '/') ++path;
+    if (parent) *parent = nullptr;
+    if (leaf) *leaf = path;
+    while (*path) {
+        const char* end = strchr(path, '/');
+        size_t length = end ? end - path : strlen(path);
+        const char* next = path + length;
+        while (*next == '/') ++next;
+        if (!node || !node->directory) return nullptr;
+        std::shared_ptr<host::Node> child;
+        for (auto& candidate : node->children) {
+            if (sameName(candidate->name, path, length)) {
+                child = candidate;
+                break;
+            }
+        }
+        if (!*next) {
+            if (parent) *parent = node;
+            if (leaf) *leaf = path;
+        }
+        if (!child) return nullptr;
+        node = child;
+        path = next;
+    }
+    return node;
+}
+
+std::shared_ptr<host::Node> SdFs::lookup(const char* path, std::shared_ptr<host::Node>* parent, const char** leaf) {
+    return lookupFrom(_root, path, parent, leaf);
+}
+
+void SdFs::allocateSectors(host::Node* node, uint64_t length) {
+    uint64_t sectors = (length + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    uint64_t have = (node->allocated + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    if (sectors <= have) return;
+    auto shared = share(node);
+    if (have && node->firstSector + have == _nextSector) {
+        // Last file on the card: grow in place.
+    } else {
+        if (have) node->fragmented = true;
+        node->firstSector = _nextSector;
+        have = 0;
+    }
+    for (uint64_t i = have; i < sectors; ++i) _sectorOwners.push_back(shared);
+    _nextSector = node->firstSector + sectors;
+    if (_sectorOwners.size() < _nextSector) _sectorOwners.resize(_nextSector);
+    for (uint64_t i = 0; i < sectors; ++i) _sectorOwners[node->firstSector + i] = shared;
+    node->allocated = sectors * SECTOR_SIZE;
+}
+
+bool SdFs::openAt(FsFile& file, std::shared_ptr<host::Node> dir, const char* path, oflag_t oflag) {
+    file.close();
+    ++_stats.opens;
+    std::shared_ptr<host::Node> parent;
+    const char* leaf = nullptr;
+    auto node = lookupFrom(dir, path, &parent, &leaf);
+    if (node && (oflag & O_CREAT) && (oflag & O_EXCL)) return false;
+    if (!node) {
+        if (!(oflag & O_CREAT) || !parent || !parent->directory || !leaf || !*leaf) return false;
+        if (strchr(leaf, '/')) return false;
+        node = std::make_shared<host::Node>();
+        node->name = leaf;
+        node->parent = parent.get();
+        parent->children.push_back(node);
+        file._node = node.get();
+        file.touch();
+    }
+    if (node->directory && (oflag & O_ACCMODE) != O_RDONLY) return false;
+    file._fs = this;
+    file._node = node.get();
+    file._keepAlive = node;
+    file._flags = oflag;
+    file._position = 0;
+    if (!node->directory && (oflag & O_TRUNC)) file.truncate(0);
+    if (!node->directory && (oflag & O_AT_END)) file._position = node->data.size();
+    return true;
+}
+
+FsFile SdFs::open(const char* path, oflag_t oflag) {
+    FsFile file;
+    openAt(file, _root, path, oflag);
+    return file;
+}
+
+bool SdFs::exists(const char* path) { return lookup(path) != nullptr; }
+
+bool SdFs::mkdir(const char* path, bool pFlag) {
+    std::string partial;
+    const char* p = path;
+    while (*p == '/') ++p;
+    std::shared_ptr<host::Node> dir = _root;
+    while (*p) {
+        const char* end = strchr(p, '/');
+        size_t length = end ? end - p : strlen(p);
+        const char* next = p + length;
+        while (*next == '/') ++next;
+        std::shared_ptr<host::Node> child;
+        for (auto& candidate : dir->children) {
+            if (sameName(candidate->name, p, length)) child = candidate;
+        }
+        if (child) {
+            if (!child->directory) return false;
+            if (!*next) return false; // already exists
+        } else {
+            if (*next && !pFlag) return false;
+            child = std::make_shared<host::Node>();
+            child->name.assign(p, length);
+            child->directory = true;
+            child->parent = dir.get();
+            dir->children.push_back(child);
+        }
+        dir = child;
+        p = next;
+    }
+    return true;
+}
+
+static bool detach(std::shared_ptr<host::Node> node) {
+    if (!node || !node->parent) return false;
+    auto& siblings = node->parent->children;
+    siblings.erase(std::remove(siblings.begin(), siblings.end(), node), siblings.end());
+    node->parent = nullptr;
+    return true;
+}
+
+bool SdFs::remove(const char* path) {
+    auto node = lookup(path);
+    if (!node || node->directory) return false;
+    node->removed = true;
+    return detach(node);
+}
+
+bool SdFs::rmdir(const char* path) {
+    auto node = lookup(path);
+    if (!node || !node->directory || !node->children.empty()) return false;
+    return detach(node);
+}
+
+bool SdFs::rename(const char* oldPath, const char* newPath) {
+    auto node = lookup(oldPath);
+    if (!node || !node->parent || lookup(newPath)) return false;
+    std::shared_ptr<host::Node> parent;
+    const char* leaf = nullptr;
+    lookup(newPath, &parent, &leaf);
+    if (!parent || !parent->directory || !leaf || !*leaf || strchr(leaf, '/')) return false;
+    detach(node);
+    node->name = leaf;
+    node->parent = parent.get();
+    parent->children.push_back(node);
+    return true;
+}
+
+bool SdFs::addFile(const char* path, const void* data, size_t size, bool fragmented) {
+    std::string directory(path);
+    size_t slash = directory.find_last_of('/');
+    if (slash != std::string::npos && slash > 0) {
+        directory.resize(slash);
+        if (!lookup(directory.c_str())) mkdir(directory.c_str(), true);
+    }
+    FsFile file = open(path, O_RDWR | O_CREAT | O_TRUNC);
+    if (!file) return false;
+    host::StorageProfile saved = _profile;
+    _profile = {};
+    file.preAllocate(size);
+    file.write(data, size);
+    _profile = saved;
+    file._node->fragmented = fragmented;
+    file.close();
+    return true;
+}
+
+std::string SdFs::fileData(const char* path) {
+    auto node = lookup(path);
+    if (!node || node->directory) return std::string();
+    return std::string(node->data.begin(), node->data.end());
+}
+
+bool SdCard::readSectors(uint32_t sector, uint8_t* dst, size_t count) {
+    _fs->charge(count * SECTOR_SIZE);
+    ++_fs->_stats.readCalls;
+    _fs->_stats.sectorReads += count;
+    _fs->_stats.bytesRead += count * SECTOR_SIZE;
+    for (size_t i = 0; i < count; ++i, ++sector, dst += SECTOR_SIZE) {
+        memset(dst, 0, SECTOR_SIZE);
+        if (sector >= _fs->_sectorOwners.size() || !_fs->_sectorOwners[sector]) continue;
+        host::Node* node = _fs->_sectorOwners[sector].get();
+        if (node->fragmented || sector < node->firstSector) continue;
+        uint64_t offset = uint64_t(sector - node->firstSector) * SECTOR_SIZE;
+        if (offset < node->data.size()) {
+            size_t n = std::min<uint64_t>(SECTOR_SIZE, node->data.size() - offset);
+            memcpy(dst, node->data.data() + offset, n);
+        }
+    }
+    return true;
+}
+
+bool FsFile::open(const char* path, oflag_t oflag) {
+    return _fs && _fs->openAt(*this, _fs->_root, path, oflag);
+}
+
+bool FsFile::open(FsFile* dir, const char* path, oflag_t oflag) {
+    if (!dir || !dir->isDirectory()) return false;
+    SdFs* fs = dir->_fs;
+    return fs->openAt(*this, fs->share(dir->_node), path, oflag);
+}
+
+bool FsFile::close() {
+    bool wasOpen = isOpen();
+    _node = nullptr;
+    _keepAlive.reset();
+    _position = 0;
+    return wasOpen;
+}
+
+bool FsFile::sync() {
+    if (!isOpen()) return false;
+    ++_fs->_stats.syncCalls;
+    _fs->charge(SECTOR_SIZE * 2); // directory entry and FAT update
+    return true;
+}
+
+int FsFile::available() const {
+    uint64_t n = available64();
+    return n > 0x7FFFFFFF ? 0x7FFFFFFF : static_cast<int>(n);
+}
+
+int FsFile::read() {
+    uint8_t c;
+    return read(&c, 1) == 1 ? c : -1;
+}
+
+int FsFile::read(void* buffer, size_t size) {
+    if (!isFile()) return -1;
+    size_t n = std::min<uint64_t>(size, available64());
+    _fs->charge(n);
+    ++_fs->_stats.readCalls;
+    _fs->_stats.bytesRead += n;
+    memcpy(buffer, _node->data.data() + _position, n);
+    _position += n;
+    return static_cast<int>(n);
+}
+
+void FsFile::touch() {
+    time_t now = time(nullptr);
+    struct tm parts;
+    gmtime_r(&now, &parts);
+    _node->modifyDate = FAT_DATE(parts.tm_year + 1900, parts.tm_mon + 1, parts.tm_mday);
+    _node->modifyTime = FAT_TIME(parts.tm_hour, parts.tm_min, parts.tm_sec);
+}
+
+size_t FsFile::write(const void* buffer, size_t size) {
+    if (!isFile() || !isWritable()) return 0;
+    if (_flags & O_APPEND) _position = _node->data.size();
+    _fs->charge(size);
+    ++_fs->_stats.writeCalls;
+    _fs->_stats.bytesWritten += size;
+    if (_position + size > _node->data.size()) {
+        _fs->allocateSectors(_node, _position + size);
+        _node->data.resize(_position + size);
+    }
+    memcpy(_node->data.data() + _position, buffer, size);
+    _position += size;
+    touch();
+    return size;
+}
+
+bool FsFile::seekSet(uint64_t position) {
+    if (!isOpen()) return false;
+    if (isFile() && position > fileSize()) return false;
+    _position = position;
+    return true;
+}
+
+bool FsFile::truncate(uint64_t length) {
+    if (!isFile() || !isWritable() || length > fileSize()) return false;
+    _node->data.resize(length);
+    if (_position > length) _position = length;
+    touch();
+    return true;
+}
+
+bool FsFile::preAllocate(uint64_t length) {
+    if (!isFile() || !isWritable() || fileSize() != 0) return false;
+    _fs->allocateSectors(_node, length);
+    _node->data.resize(length); // like SdFat, the file size becomes the preallocated length
+    _node->fragmented = false;
+    return true;
+}
+
+bool FsFile::contiguousRange(uint32_t* bgnSector, uint32_t* endSector) {
+    if (!isFile() || _node->fragmented) return false;
+    if (bgnSector) *bgnSector = _node->firstSector;
+    if (endSector) {
+        uint64_t sectors = (fileSize() + SECTOR_SIZE - 1) / SECTOR_SIZE;
+        *endSector = _node->firstSector + (sectors ? sectors - 1 : 0);
+    }
+    return true;
+}
+
+FsFile FsFile::openNextFile(oflag_t oflag) {
+    FsFile file;
+    if (!isDirectory()) return file;
+    // Like SdFat, a directory's position counts 32-byte directory entries
+    while (_position / 32 < _node->children.size()) {
+        size_t index = _position / 32;
+        auto child = _node->children[index];
+        _position = (index + 1) * 32;
+        file._fs = _fs;
+        file._node = child.get();
+        file._keepAlive = child;
+        file._flags = oflag;
+        file._dirIndex = static_cast<uint32_t>(index);
+        ++_fs->_stats.opens;
+        _fs->charge(32); // one directory entry
+        return file;
+    }
+    return file;
+}
+
+size_t FsFile::getName(char* name, size_t size) {
+    if (!isOpen() || !size) return 0;
+    const std::string& n = _node->parent ? _node->name : std::string("/");
+    if (n.size() >= size) {
+        name[0] = '\0';
+        return 0;
+    }
+    memcpy(name, n.c_str(), n.size() + 1);
+    return n.size();
+}
+
+bool FsFile::getModifyDateTime(uint16_t* pdate, uint16_t* ptime) {
+    if (!isOpen()) return false;
+    *pdate = _node->modifyDate;
+    *ptime = _node->modifyTime;
+    return true;
+}
+
+bool FsFile::timestamp(uint8_t, uint16_t year, uint8_t month, uint8_t day, uint8_t hour, uint8_t minute, uint8_t second) {
+    if (!isOpen()) return false;
+    _node->modifyDate = FAT_DATE(year, month, day);
+    _node->modifyTime = FAT_TIME(hour, minute, second);
+    return true;
+}
+
+bool FsFile::mkdir(FsFile* dir, const char* path, bool pFlag) {
+    if (!dir || !dir->isDirectory()) return false;
+    SdFs* fs = dir->_fs;
+    std::string full;
+    // Build an absolute path by walking up from dir.
+    for (host::Node* n = dir->_node; n && n->parent; n = n->parent) full = "/" + n->name + full;
+    full += "/";
+    full += path;
+    if (!fs->mkdir(full.c_str(), pFlag)) return false;
+    return open(dir, path, O_RDONLY);
+}
+
+bool FsFile::rename(const char* newPath) {
+    if (!isOpen()) return false;
+    std::string old;
+    for (host::Node* n = _node; n && n->parent; n = n->parent) old = "/" + n->name + old;
+    return _fs->rename(old.c_str(), newPath);
+}
+
+bool FsFile::remove() {
+    if (!isFile() || !isWritable()) return false;
+    _node->removed = true;
+    detach(_fs->share(_node));
+    close();
+    return true;
+}
@@ -0,0 +1,134 @@
+/* MIT License
+
+Copyright (c) 2023 Kenny Riddile
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#include "WiFi.h"
+
+#include <algorithm>
+
+namespace host {
+
+size_t Pipe::write(const uint8_t* data, size_t size) {
+    if (_closed || !size) return 0;
+    unsigned long long now = nowMicros();
+    unsigned long long start = std::max(now, _linkFreeAt);
+    unsigned long long transmit = _profile.bytesPerSecond ? size * 1000000ULL / _profile.bytesPerSecond : 0;
+    _linkFreeAt = start + transmit;
+    _inFlight.push_back({_linkFreeAt + _profile.latencyMicros, std::vector<uint8_t>(data, data + size)});
+    _totalBytes += size;
+    return size;
+}
+
+void Pipe::deliver() {
+    unsigned long long now = nowMicros();
+    while (!_inFlight.empty() && _inFlight.front().readyAt <= now) {
+        auto& bytes = _inFlight.front().bytes;
+        _readable.insert(_readable.end(), bytes.begin(), bytes.end());
+        _inFlight.pop_front();
+    }
+}
+
+size_t Pipe::available() {
+    deliver();
+    return _readable.size();
+}
+
+size_t Pipe::read(uint8_t* data, size_t size) {
+    deliver();
+    size_t n = std::min(size, _readable.size());
+    std::copy(_readable.begin(), _readable.begin() + n, data);
+    _readable.erase(_readable.begin(), _readable.begin() + n);
+    return n;
+}
+
+int Pipe::peek() {
+    deliver();
+    return _readable.empty() ? -1 : _readable.front();
+}
+
+size_t Pipe::writable() {
+    deliver();
+    size_t queued = _readable.size();
+    for (auto& segment : _inFlight) queued += segment.bytes.size();
+    return queued >= _profile.sendWindow ? 0 : _profile.sendWindow - queued;
+}
+
+}
+
+uint8_t WiFiClient::connected() {
+    if (!_channel || _channel->serverStopped) return 0;
+    return !_channel->toServer.closed() || _channel->toServer.available() > 0;
+}
+
+int WiFiClient::available() {
+    if (!_channel || _channel->serverStopped) return 0;
+    return static_cast<int>(_channel->toServer.available());
+}
+
+int WiFiClient::read() {
+    uint8_t c;
+    return read(&c, 1) == 1 ? c : -1;
+}
+
+int WiFiClient::read(uint8_t* buffer, size_t size) {
+    if (!_channel || _channel->serverStopped) return -1;
+    return static_cast<int>(_channel->toServer.read(buffer, size));
+}
+
+int WiFiClient::peek() {
+    if (!_channel || _channel->serverStopped) return -1;
+    return _channel->toServer.peek();
+}
+
+// Like lwIP, only takes what fits in the send window, so a write can be short
+size_t WiFiClient::write(const uint8_t* buffer, size_t size) {
+    if (!_channel || _channel->serverStopped) return 0;
+    size = std::min(size, _channel->toClient.writable());
+    if (size == 0) return 0;
+    ++_channel->writeCalls;
+    return _channel->toClient.write(buffer, size);
+}
+
+int WiFiClient::availableForWrite() {
+    if (!_channel || _channel->serverStopped) return 0;
+    return static_cast<int>(_channel->toClient.writable());
+}
+
+void WiFiClient::stop() {
+    if (!_channel) return;
+    _channel->serverStopped = true;
+    _channel->toClient.close();
+    _channel.reset();
+}
+
+WiFiClient WiFiServer::available() {
+    if (!_listening || _pending.empty()) return WiFiClient();
+    WiFiClient client(_pending.front());
+    _pending.pop_front();
+    return client;
+}
+
+host::Endpoint WiFiServer::connect(const host::LinkProfile& toServer, const host::LinkProfile& toClient) {
+    auto channel = std::make_shared<host::Channel>(toServer, toClient);
+    _pending.push_back(channel);
+    return host::Endpoint(channel);
+}
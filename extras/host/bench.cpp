@@ -0,0 +1,344 @@
+/* MIT License
+
+Copyright (c) 2023 Kenny Riddile
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+// Replays download, listing, upload and mixed hot-file workloads against SDServer over the
+// in-memory stand-ins and reports throughput and per-request latency for
+// each buffer size. The network and card can be slowed down to model a
+// particular board, which shows whether a change helps on the card side or
+// the radio side.
+
+#include <SDServer.h>
+
+#include <algorithm>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+struct Options {
+    std::vector<size_t> buffers = { 1024, 2048, 4096, 8192 };
+    std::vector<std::string> workloads = { "get", "listing", "json", "upload", "hot" };
+    size_t requests = 20;
+    size_t clients = 1;
+    size_t fileSize = 1048576;
+    size_t entries = 200;
+    host::LinkProfile link;
+    host::StorageProfile card;
+    size_t pipelineSize = 0;
+    size_t writeBufferSize = 0;
+    size_t listingCacheSize = 0;
+    size_t fileCacheSize = 0;
+};
+
+struct Workload {
+    std::string name;
+    bool upload; // throughput counts request bytes rather than response bytes
+};
+
+struct Result {
+    size_t errors = 0;
+    unsigned long long bytes = 0;
+    unsigned long long elapsedMicros = 0;
+    std::vector<unsigned long long> latencies;
+    host::StorageStats card;
+    size_t hotRequests = 0;
+    unsigned long long hotCardReads = 0;
+};
+
+// The hot workload asks for a few small files over and over, with bursts of
+// one-off downloads of larger files and Range requests into the big file in
+// between.
+static const size_t HOT_FILES = 4;
+static const size_t HOT_FILE_SIZE = 1000;
+static const size_t BIG_FILES = 16;
+static const size_t BIG_FILE_SIZE = 65536;
+
+static bool isHotRequest(size_t index) {
+    return index % 16 < 8;
+}
+
+static const char USAGE[] =
+    "Usage: bench [options]\n"
+    "  --buffers LIST         working and upload streaming buffer sizes to try (1024,2048,4096,8192)\n"
+    "  --workloads LIST       any of get,listing,json,upload,hot (all of them)\n"
+    "  --requests N           requests per workload and buffer size (20)\n"
+    "  --clients N            clients making requests at the same time (1)\n"
+    "  --file-size BYTES      size of the downloaded and uploaded files (1048576)\n"
+    "  --entries N            entries in the listed directory (200)\n"
+    "  --link-latency US      one-way network latency (0)\n"
+    "  --link-rate BYTES/S    network bandwidth in each direction, 0 for unlimited (0)\n"
+    "  --card-latency US      cost of every card read, write and sync call (0)\n"
+    "  --card-rate BYTES/S    card bandwidth, 0 for unlimited (0)\n"
+    "  --pipeline BYTES       pipeline buffer, 0 for none (0)\n"
+    "  --write-buffer BYTES   upload write buffer, 0 for none (0)\n"
+    "  --listing-cache BYTES  listing cache, 0 for none (0)\n"
+    "  --file-cache BYTES     file cache, 0 for none (0)\n";
+
+static const char UPLOAD_BOUNDARY[] = "----sdserverbench";
+
+static std::vector<std::string> split(const std::string& list) {
+    std::vector<std::string> items;
+    std::stringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        if (!item.empty()) items.push_back(item);
+    }
+    return items;
+}
+
+static bool parseOptions(int argc, char** argv, Options& options) {
+    for (int i = 1; i < argc; ++i) {
+        std::string name = argv[i];
+        if (name == "--help") {
+            fputs(USAGE, stdout);
+            exit(0);
+        }
+        if (i + 1 == argc) {
+            fprintf(stderr, "%s needs a value\n", name.c_str());
+            return false;
+        }
+        std::string value = argv[++i];
+        unsigned long number = strtoul(value.c_str(), nullptr, 10);
+        if (name == "--buffers") {
+            options.buffers.clear();
+            for (const std::string& size : split(value)) options.buffers.push_back(strtoul(size.c_str(), nullptr, 10));
+        } else if (name == "--workloads") {
+            options.workloads = split(value);
+        } else if (name == "--requests") {
+            options.requests = number;
+        } else if (name == "--clients") {
+            options.clients = std::max(1ul, number);
+        } else if (name == "--file-size") {
+            options.fileSize = number;
+        } else if (name == "--entries") {
+            options.entries = number;
+        } else if (name == "--link-latency") {
+            options.link.latencyMicros = number;
+        } else if (name == "--link-rate") {
+            options.link.bytesPerSecond = number;
+        } else if (name == "--card-latency") {
+            options.card.callLatencyMicros = number;
+        } else if (name == "--card-rate") {
+            options.card.bytesPerSecond = number;
+        } else if (name == "--pipeline") {
+            options.pipelineSize = number;
+        } else if (name == "--write-buffer") {
+            options.writeBufferSize = number;
+        } else if (name == "--listing-cache") {
+            options.listingCacheSize = number;
+        } else if (name == "--file-cache") {
+            options.fileCacheSize = number;
+        } else {
+            fprintf(stderr, "unknown option %s\n%s", name.c_str(), USAGE);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static std::string makeRequest(const Workload& workload, const Options& options, size_t index) {
+    std::string request;
+    if (workload.name == "get") {
+        request = "GET /bench/file.bin HTTP/1.1\r\n";
+    } else if (workload.name == "listing") {
+        request = "GET /bench/dir HTTP/1.1\r\n";
+    } else if (workload.name == "json") {
+        request = "GET /bench/dir?format=json HTTP/1.1\r\n";
+    } else if (workload.name == "hot") {
+        if (isHotRequest(index)) {
+            request = "GET /bench/hot/hot_" + std::to_string(index % HOT_FILES) + ".txt HTTP/1.1\r\n";
+        } else if (index % 2 == 0) {
+            size_t burst = index / 16 * 4 + index % 16 / 2;
+            request = "GET /bench/big/big_" + std::to_string(burst % BIG_FILES) + ".bin HTTP/1.1\r\n";
+        } else {
+            // Seeking through the big file, never from its start
+            size_t burst = index / 16 * 4 + index % 16 / 2;
+            size_t offset = (burst % 15 + 1) * (options.fileSize / 16);
+            request = "GET /bench/file.bin HTTP/1.1\r\nRange: bytes=" + std::to_string(offset) + "-" +
+                std::to_string(offset + 4095) + "\r\n";
+        }
+    } else {
+        std::string head = std::string("--") + UPLOAD_BOUNDARY + "\r\n"
+            "Content-Disposition: form-data; name=\"file\"; filename=\"upload" + std::to_string(index) + ".bin\"\r\n"
+            "Content-Type: application/octet-stream\r\n\r\n";
+        std::string tail = std::string("\r\n--") + UPLOAD_BOUNDARY + "--\r\n";
+        size_t length = head.size() + options.fileSize + tail.size();
+        request = "POST /bench/uploads HTTP/1.1\r\n"
+            "Content-Type: multipart/form-data; boundary=" + std::string(UPLOAD_BOUNDARY) + "\r\n"
+            "Content-Length: " + std::to_string(length) + "\r\n";
+        request += "Host: bench\r\nConnection: close\r\n\r\n" + head;
+        request.append(options.fileSize, static_cast<char>('a' + index % 26));
+        return request + tail;
+    }
+
+    return request + "Host: bench\r\nConnection: close\r\n\r\n";
+}
+
+static Result run(SdFs& sd, const Options& options, const Workload& workload, size_t bufferSize) {
+    WiFiServer server(80);
+    server.begin();
+    std::vector<char> workingBuffer(bufferSize);
+    std::vector<char> uploadBuffer(bufferSize);
+    std::vector<char> pipelineBuffer(options.pipelineSize);
+    std::vector<char> writeBuffer(options.writeBufferSize);
+    std::vector<char> listingCache(options.listingCacheSize);
+    std::vector<char> fileCache(options.fileCacheSize);
+    std::unique_ptr<SDServer> sdServer(new SDServer());
+    sdServer->begin(&server, &sd, workingBuffer.data(), bufferSize, uploadBuffer.data(), bufferSize);
+    if (options.pipelineSize) sdServer->setPipelineBuffer(pipelineBuffer.data(), options.pipelineSize);
+    if (options.writeBufferSize) sdServer->setUploadWriteBuffer(writeBuffer.data(), options.writeBufferSize);
+    if (options.listingCacheSize) sdServer->setListingCache(listingCache.data(), options.listingCacheSize);
+    if (options.fileCacheSize) sdServer->setFileCache(fileCache.data(), options.fileCacheSize);
+
+    struct Exchange {
+        host::Endpoint endpoint;
+        unsigned long long start;
+        std::string statusLine;
+        unsigned long long received = 0;
+        bool hot = false;
+        unsigned long long cardReads = 0; // when it was sent
+    };
+    std::vector<std::optional<Exchange>> clients(options.clients);
+    host::StorageStats before = sd.stats();
+    Result result;
+    size_t issued = 0;
+    size_t completed = 0;
+    unsigned long long start = host::nowMicros();
+    unsigned long long lastProgress = start;
+    static char scratch[65536];
+    while (completed < options.requests) {
+        for (std::optional<Exchange>& client : clients) {
+            if (client || issued == options.requests) continue;
+
+            std::string request = makeRequest(workload, options, issued++);
+            client.emplace(Exchange{ server.connect(options.link, options.link), host::nowMicros() });
+            client->hot = workload.name == "hot" && isHotRequest(issued - 1);
+            client->cardReads = sd.stats().readCalls;
+            client->endpoint.send(request.data(), request.size());
+            if (workload.upload) result.bytes += request.size();
+        }
+
+        sdServer->handleClient();
+
+        for (std::optional<Exchange>& client : clients) {
+            if (!client) continue;
+
+            while (size_t available = client->endpoint.available()) {
+                size_t count = client->endpoint.receive(scratch, std::min(available, sizeof(scratch)));
+                if (client->statusLine.size() < 12) {
+                    client->statusLine.append(scratch, std::min<size_t>(count, 12 - client->statusLine.size()));
+                }
+                client->received += count;
+                lastProgress = host::nowMicros();
+            }
+            if (!client->endpoint.serverClosed()) continue;
+
+            unsigned long long now = host::nowMicros();
+            result.latencies.push_back(now - client->start);
+            bool ok = workload.upload ? client->statusLine == "HTTP/1.1 303" :
+                client->statusLine == "HTTP/1.1 200" || (workload.name == "hot" && client->statusLine == "HTTP/1.1 206");
+            if (!ok) ++result.errors;
+            if (client->hot) {
+                // Only the hot file's own reads with one client at a time
+                ++result.hotRequests;
+                result.hotCardReads += sd.stats().readCalls - client->cardReads;
+            }
+            if (!workload.upload) result.bytes += client->received;
+            client.reset();
+            ++completed;
+            lastProgress = now;
+        }
+
+        if (host::nowMicros() - lastProgress > 10000000) {
+            fprintf(stderr, "%s with %zu byte buffers stalled\n", workload.name.c_str(), bufferSize);
+            result.errors += options.requests - completed;
+            break;
+        }
+    }
+    result.elapsedMicros = host::nowMicros() - start;
+
+    host::StorageStats after = sd.stats();
+    result.card.readCalls = after.readCalls - before.readCalls;
+    result.card.writeCalls = after.writeCalls - before.writeCalls;
+    result.card.syncCalls = after.syncCalls - before.syncCalls;
+    std::sort(result.latencies.begin(), result.latencies.end());
+
+    return result;
+}
+
+static double percentileMillis(const std::vector<unsigned long long>& sorted, double fraction) {
+    if (sorted.empty()) return 0;
+    size_t index = std::min(sorted.size() - 1, static_cast<size_t>(fraction * sorted.size()));
+    return sorted[index] / 1000.0;
+}
+
+int main(int argc, char** argv) {
+    Options options;
+    if (!parseOptions(argc, argv, options)) return 2;
+
+    SdFs sd;
+    std::string data(options.fileSize, '\0');
+    for (size_t i = 0; i < data.size(); ++i) data[i] = static_cast<char>(i * 131 + (i >> 9));
+    sd.addFile("/bench/file.bin", data);
+    for (size_t i = 0; i < options.entries; ++i) {
+        sd.addFile(("/bench/dir/entry_" + std::to_string(i) + ".txt").c_str(), "x");
+    }
+    for (size_t i = 0; i < HOT_FILES; ++i) {
+        sd.addFile(("/bench/hot/hot_" + std::to_string(i) + ".txt").c_str(), std::string(HOT_FILE_SIZE, 'a' + i));
+    }
+    for (size_t i = 0; i < BIG_FILES; ++i) {
+        sd.addFile(("/bench/big/big_" + std::to_string(i) + ".bin").c_str(), data.substr(0, BIG_FILE_SIZE));
+    }
+    sd.mkdir("/bench/uploads");
+    sd.setProfile(options.card);
+
+    printf("%-8s %7s %8s %6s %9s %9s %9s %9s %10s %10s\n",
+        "workload", "buffer", "requests", "errors", "MB/s", "p50 ms", "p95 ms", "max ms", "card rd/rq", "card wr/rq");
+    int status = 0;
+    for (const std::string& name : options.workloads) {
+        if (name != "get" && name != "listing" && name != "json" && name != "upload" && name != "hot") {
+            fprintf(stderr, "unknown workload %s\n", name.c_str());
+            return 2;
+        }
+        Workload workload = { name, name == "upload" };
+        for (size_t bufferSize : options.buffers) {
+            Result result = run(sd, options, workload, bufferSize);
+            double seconds = result.elapsedMicros / 1e6;
+            size_t requests = std::max<size_t>(1, result.latencies.size());
+            printf("%-8s %7zu %8zu %6zu %9.2f %9.2f %9.2f %9.2f %10.1f %10.1f\n",
+                name.c_str(), bufferSize, result.latencies.size(), result.errors,
+                seconds > 0 ? result.bytes / seconds / 1e6 : 0.0,
+                percentileMillis(result.latencies, 0.5), percentileMillis(result.latencies, 0.95),
+                result.latencies.empty() ? 0.0 : result.latencies.back() / 1000.0,
+                double(result.card.readCalls) / requests, double(result.card.writeCalls) / requests);
+            if (result.hotRequests) {
+                printf("%-8s %7s %8zu hot-file requests, %.2f card reads each\n", "", "", result.hotRequests,
+                    double(result.hotCardReads) / result.hotRequests);
+            }
+            if (result.errors) status = 1;
+        }
+    }
+
+    return status;
+}
@@ -0,0 +1,202 @@
+/* MIT License
+
+Copyright (c) 2023 Kenny Riddile
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+// Host stand-in for the subset of SdFat 2.x used by SDServer.
+//
+// The volume is held in memory. Every file's data is laid out as one run of
+// virtual 512-byte sectors unless it is marked fragmented, so the raw sector
+// API (contiguousRange/readSectors) behaves like it does on a freshly
+// formatted card. Card latency and bandwidth can be shaped per call.
+#ifndef SDSERVER_HOST_SDFAT_H
+#define SDSERVER_HOST_SDFAT_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Arduino.h"
+
+typedef int oflag_t;
+
+#define O_RDONLY 0x00
+#define O_WRONLY 0x01
+#define O_RDWR 0x02
+#define O_ACCMODE 0x03
+#define O_APPEND 0x08
+#define O_CREAT 0x10
+#define O_TRUNC 0x20
+#define O_EXCL 0x40
+#define O_READ O_RDONLY
+#define O_WRITE O_WRONLY
+#define O_AT_END 0x80
+#define FILE_READ O_RDONLY
+#define FILE_WRITE (O_RDWR | O_CREAT | O_AT_END)
+
+#define FAT_DATE(year, month, day) (uint16_t)(((year) - 1980) << 9 | (month) << 5 | (day))
+#define FAT_TIME(hour, minute, second) (uint16_t)((hour) << 11 | (minute) << 5 | (second) >> 1)
+
+namespace host {
+
+struct Node {
+    std::string name;
+    bool directory = false;
+    bool fragmented = false;
+    std::vector<uint8_t> data;
+    uint64_t allocated = 0;
+    uint32_t firstSector = 0;
+    uint16_t modifyDate = FAT_DATE(2023, 1, 1);
+    uint16_t modifyTime = 0;
+    Node* parent = nullptr;
+    std::vector<std::shared_ptr<Node>> children;
+    bool removed = false;
+};
+
+struct StorageProfile {
+    unsigned long callLatencyMicros = 0; // fixed cost of each read/write/sync call
+    unsigned long bytesPerSecond = 0;    // 0 means unlimited
+};
+
+struct StorageStats {
+    unsigned long long bytesRead = 0;
+    unsigned long long bytesWritten = 0;
+    unsigned long readCalls = 0;
+    unsigned long writeCalls = 0;
+    unsigned long syncCalls = 0;
+    unsigned long sectorReads = 0;
+    unsigned long opens = 0;
+};
+
+}
+
+class SdFs;
+
+class SdCard {
+public:
+    explicit SdCard(SdFs* fs) : _fs(fs) {}
+    bool readSector(uint32_t sector, uint8_t* dst) { return readSectors(sector, dst, 1); }
+    bool readSectors(uint32_t sector, uint8_t* dst, size_t count);
+
+private:
+    SdFs* _fs;
+};
+
+class FsFile {
+public:
+    FsFile() = default;
+
+    explicit operator bool() const { return isOpen(); }
+    bool isOpen() const { return _node != nullptr; }
+    bool isDirectory() const { return _node && _node->directory; }
+    bool isDir() const { return isDirectory(); }
+    bool isFile() const { return _node && !_node->directory; }
+    bool isWritable() const { return (_flags & O_ACCMODE) != O_RDONLY; }
+    bool isContiguous() const { return isFile() && !_node->fragmented; }
+
+    bool open(const char* path, oflag_t oflag = O_RDONLY);
+    bool open(FsFile* dir, const char* path, oflag_t oflag = O_RDONLY);
+    bool close();
+    bool sync();
+
+    int available() const;
+    uint64_t available64() const { return isFile() ? fileSize() - _position : 0; }
+    int read();
+    int read(void* buffer, size_t size);
+    size_t write(const void* buffer, size_t size);
+    size_t write(uint8_t c) { return write(&c, 1); }
+    uint64_t fileSize() const { return isFile() ? _node->data.size() : 0; }
+    uint64_t size() const { return fileSize(); }
+    uint64_t curPosition() const { return _position; }
+    bool seekSet(uint64_t position);
+    bool seekCur(int64_t offset) { return seekSet(_position + offset); }
+    bool truncate(uint64_t length);
+    bool truncate() { return truncate(_position); }
+    bool preAllocate(uint64_t length);
+    bool contiguousRange(uint32_t* bgnSector, uint32_t* endSector);
+    uint32_t firstSector() const { return _node ? _node->firstSector : 0; }
+
+    void rewindDirectory() { if (isDirectory()) _position = 0; }
+    void rewind() { _position = 0; }
+    FsFile openNextFile(oflag_t oflag = O_RDONLY);
+    size_t getName(char* name, size_t size);
+    bool getModifyDateTime(uint16_t* pdate, uint16_t* ptime);
+    bool getCreateDateTime(uint16_t* pdate, uint16_t* ptime) { return getModifyDateTime(pdate, ptime); }
+    bool timestamp(uint8_t flags, uint16_t year, uint8_t month, uint8_t day, uint8_t hour, uint8_t minute, uint8_t second);
+    bool mkdir(FsFile* dir, const char* path, bool pFlag = true);
+    bool rename(const char* newPath);
+    bool remove();
+    uint32_t dirIndex() const { return _dirIndex; }
+
+private:
+    friend class SdFs;
+    void touch();
+
+    SdFs* _fs = nullptr;
+    host::Node* _node = nullptr;
+    std::shared_ptr<host::Node> _keepAlive;
+    uint64_t _position = 0;
+    oflag_t _flags = 0;
+    uint32_t _dirIndex = 0;
+};
+
+class SdFs {
+public:
+    SdFs();
+
+    bool begin() { return true; }
+    FsFile open(const char* path, oflag_t oflag = O_RDONLY);
+    bool exists(const char* path);
+    bool mkdir(const char* path, bool pFlag = true);
+    bool remove(const char* path);
+    bool rmdir(const char* path);
+    bool rename(const char* oldPath, const char* newPath);
+    SdCard* card() { return &_card; }
+    uint32_t bytesPerCluster() const { return 32768; }
+
+    // Host only.
+    bool addFile(const char* path, const void* data, size_t size, bool fragmented = false);
+    bool addFile(const char* path, const std::string& data, bool fragmented = false) {
+        return addFile(path, data.data(), data.size(), fragmented);
+    }
+    std::string fileData(const char* path);
+    void setProfile(const host::StorageProfile& profile) { _profile = profile; }
+    host::StorageStats& stats() { return _stats; }
+
+private:
+    friend class FsFile;
+    friend class SdCard;
+    std::shared_ptr<host::Node> lookup(const char* path, std::shared_ptr<host::Node>* parent = nullptr, const char** leaf = nullptr);
+    std::shared_ptr<host::Node> lookupFrom(std::shared_ptr<host::Node> dir, const char* path, std::shared_ptr<host::Node>* parent, const char** leaf);
+    std::shared_ptr<host::Node> share(host::Node* node);
+    void allocateSectors(host::Node* node, uint64_t length);
+    void charge(size_t bytes);
+    bool openAt(FsFile& file, std::shared_ptr<host::Node> dir, const char* path, oflag_t oflag);
+
+    std::shared_ptr<host::Node> _root;
+    std::vector<std::shared_ptr<host::Node>> _sectorOwners;
+    uint32_t _nextSector = 1;
+    host::StorageProfile _profile;
+    host::StorageStats _stats;
+    SdCard _card{this};
+};
+
+#endif
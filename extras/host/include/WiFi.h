@@ -0,0 +1,153 @@
+/* MIT License
+
+Copyright (c) 2023 Kenny Riddile
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+// Host stand-in for the WiFiServer/WiFiClient API of the Arduino Wi-Fi cores.
+//
+// Connections are in-memory duplex channels. Each direction can be shaped
+// with a one-way latency and a bandwidth limit so the host harness can model
+// a slow radio link. The far end of a channel is driven through
+// host::Endpoint, which is what benchmark drivers and the TCP bridge use.
+#ifndef SDSERVER_HOST_WIFI_H
+#define SDSERVER_HOST_WIFI_H
+
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include "Arduino.h"
+
+namespace host {
+
+struct LinkProfile {
+    unsigned long latencyMicros = 0;    // one-way delay added to every write
+    unsigned long bytesPerSecond = 0;   // 0 means unlimited
+    size_t sendWindow = 5744;           // bytes that may be in flight, like lwIP's TCP_SND_BUF
+};
+
+// One direction of a connection.
+class Pipe {
+public:
+    explicit Pipe(const LinkProfile& profile) : _profile(profile) {}
+
+    size_t write(const uint8_t* data, size_t size);
+    size_t available();
+    size_t read(uint8_t* data, size_t size);
+    int peek();
+    size_t writable();
+    void close() { _closed = true; }
+    bool closed() const { return _closed; }
+    bool drained() { return available() == 0 && _inFlight.empty(); }
+    const LinkProfile& profile() const { return _profile; }
+    unsigned long long totalBytes() const { return _totalBytes; }
+
+private:
+    struct Segment {
+        unsigned long long readyAt;
+        std::vector<uint8_t> bytes;
+    };
+    void deliver();
+
+    LinkProfile _profile;
+    std::deque<Segment> _inFlight;
+    std::deque<uint8_t> _readable;
+    unsigned long long _linkFreeAt = 0;
+    unsigned long long _totalBytes = 0;
+    bool _closed = false;
+};
+
+struct Channel {
+    Channel(const LinkProfile& toServer, const LinkProfile& toClient)
+        : toServer(toServer), toClient(toClient) {}
+    Pipe toServer;
+    Pipe toClient;
+    bool serverStopped = false;
+    unsigned long writeCalls = 0; // server-side write() calls, i.e. TCP segments pushed
+};
+
+// The remote (browser/curl) side of a connection.
+class Endpoint {
+public:
+    explicit Endpoint(std::shared_ptr<Channel> channel) : _channel(std::move(channel)) {}
+
+    size_t send(const void* data, size_t size) {
+        return _channel->toServer.write(static_cast<const uint8_t*>(data), size);
+    }
+    size_t send(const char* str) { return send(str, strlen(str)); }
+    size_t available() { return _channel->toClient.available(); }
+    size_t receive(void* data, size_t size) {
+        return _channel->toClient.read(static_cast<uint8_t*>(data), size);
+    }
+    void shutdownWrite() { _channel->toServer.close(); }
+    bool serverClosed() { return _channel->serverStopped && _channel->toClient.drained(); }
+    unsigned long serverWriteCalls() const { return _channel->writeCalls; }
+
+private:
+    std::shared_ptr<Channel> _channel;
+};
+
+}
+
+class WiFiClient : public Print {
+public:
+    WiFiClient() = default;
+    explicit WiFiClient(std::shared_ptr<host::Channel> channel) : _channel(std::move(channel)) {}
+
+    explicit operator bool() const { return _channel != nullptr; }
+    bool operator==(const WiFiClient& other) const { return _channel == other._channel; }
+
+    uint8_t connected();
+    int available();
+    int read();
+    int read(uint8_t* buffer, size_t size);
+    int read(char* buffer, size_t size) { return read(reinterpret_cast<uint8_t*>(buffer), size); }
+    int peek();
+    size_t write(uint8_t c) override { return write(&c, 1); }
+    size_t write(const uint8_t* buffer, size_t size) override;
+    using Print::write;
+    int availableForWrite();
+    void flush() {}
+    void stop();
+    void setNoDelay(bool) {}
+
+private:
+    std::shared_ptr<host::Channel> _channel;
+};
+
+class WiFiServer {
+public:
+    explicit WiFiServer(uint16_t port) : _port(port) {}
+
+    void begin() { _listening = true; }
+    WiFiClient available();
+    WiFiClient accept() { return available(); }
+
+    // Host only: opens a connection as a remote client would.
+    host::Endpoint connect(const host::LinkProfile& toServer = {}, const host::LinkProfile& toClient = {});
+
+private:
+    uint16_t _port;
+    bool _listening = false;
+    std::deque<std::shared_ptr<host::Channel>> _pending;
+};
+
+#endif
@@ -0,0 +1,175 @@
+/* MIT License
+
+Copyright (c) 2023 Kenny Riddile
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+// Measures multipart_parser_execute() throughput for a range of chunk sizes,
+// boundary lengths and payloads. The server feeds the parser whatever one
+// network read returned, so how it copes with small chunks, and with part
+// data full of CRs and near-miss delimiters, matters as much as its speed on
+// large clean reads.
+//
+// Usage: parser_bench [--size BYTES] [--chunks LIST] [--boundaries LIST]
+
+#include <multipart_parser.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+struct Counts {
+    size_t dataBytes = 0;
+    size_t parts = 0;
+};
+
+static int countData(multipart_parser* parser, const char*, size_t length) {
+    static_cast<Counts*>(multipart_parser_get_data(parser))->dataBytes += length;
+    return 0;
+}
+
+static int countPart(multipart_parser* parser) {
+    ++static_cast<Counts*>(multipart_parser_get_data(parser))->parts;
+    return 0;
+}
+
+static std::vector<size_t> parseList(const char* list) {
+    std::vector<size_t> values;
+    std::stringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        values.push_back(strtoul(item.c_str(), nullptr, 10));
+    }
+    return values;
+}
+
+static std::string makeBoundary(size_t length) {
+    // Shaped like the ones browsers send: leading hyphens, then alphanumerics
+    static const char ALPHABET[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+    std::string boundary(std::min<size_t>(length, 4), '-');
+    for (size_t i = boundary.size(); i < length; ++i) {
+        boundary += ALPHABET[(i * 7) % (sizeof(ALPHABET) - 1)];
+    }
+    return boundary;
+}
+
+static std::string makePayload(const std::string& kind, const std::string& boundary, size_t size, std::mt19937& random) {
+    std::string payload;
+    payload.reserve(size);
+    if (kind == "random") {
+        while (payload.size() < size) payload += static_cast<char>(random());
+    } else if (kind == "text") {
+        // CSV-like lines, the common case for logged data
+        while (payload.size() < size) {
+            payload += std::to_string(random() % 100000) + "," + std::to_string(random() % 1000) + ",23.5,ok\r\n";
+        }
+    } else {
+        // Every few bytes a CR, CRLF or a delimiter prefix that breaks off
+        // early, to keep the parser out of its fast path
+        std::string delimiter = "\r\n--" + boundary;
+        while (payload.size() < size) {
+            switch (random() % 4) {
+                case 0: payload += '\r'; break;
+                case 1: payload += "\r\n"; break;
+                case 2: payload += delimiter.substr(0, 1 + random() % (delimiter.size() - 1)); break;
+                default: payload.append(1 + random() % 16, 'x'); break;
+            }
+        }
+    }
+    payload.resize(size);
+
+    // The payload must not end the part early
+    std::string delimiter = "\r\n--" + boundary;
+    for (size_t pos = payload.find(delimiter); pos != std::string::npos; pos = payload.find(delimiter, pos)) {
+        payload[pos + delimiter.size() - 1] = '\0';
+    }
+    return payload;
+}
+
+int main(int argc, char** argv) {
+    size_t size = 8 << 20;
+    std::vector<size_t> chunks = { 64, 256, 1460, 4096, 65536 };
+    std::vector<size_t> boundaryLengths = { 16, 40, 70 };
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (!strcmp(argv[i], "--size")) {
+            size = strtoul(argv[i + 1], nullptr, 10);
+        } else if (!strcmp(argv[i], "--chunks")) {
+            chunks = parseList(argv[i + 1]);
+        } else if (!strcmp(argv[i], "--boundaries")) {
+            boundaryLengths = parseList(argv[i + 1]);
+        } else {
+            fprintf(stderr, "Usage: parser_bench [--size BYTES] [--chunks LIST] [--boundaries LIST]\n");
+            return 2;
+        }
+    }
+
+    multipart_parser_settings settings = {};
+    settings.on_part_data = countData;
+    settings.on_part_data_begin = countPart;
+
+    printf("%-8s %8s %7s %9s\n", "payload", "boundary", "chunk", "MB/s");
+    std::mt19937 random(1);
+    for (const char* kind : { "random", "text", "cr-heavy" }) {
+        for (size_t boundaryLength : boundaryLengths) {
+            std::string boundary = makeBoundary(std::min<size_t>(boundaryLength, 70));
+            std::string payload = makePayload(kind, boundary, size, random);
+            std::string body = "--" + boundary + "\r\n"
+                "Content-Disposition: form-data; name=\"file\"; filename=\"data.bin\"\r\n"
+                "Content-Type: application/octet-stream\r\n\r\n" +
+                payload + "\r\n--" + boundary + "--\r\n";
+
+            for (size_t chunk : chunks) {
+                if (chunk == 0) continue;
+
+                // Repeat until the run is long enough to time reliably
+                size_t runs = 0;
+                double seconds = 0;
+                auto start = std::chrono::steady_clock::now();
+                do {
+                    multipart_parser parser;
+                    Counts counts;
+                    multipart_parser_init(&parser, boundary.c_str(), &settings);
+                    multipart_parser_set_data(&parser, &counts);
+                    for (size_t offset = 0; offset < body.size(); offset += chunk) {
+                        size_t length = std::min(chunk, body.size() - offset);
+                        if (multipart_parser_execute(&parser, body.data() + offset, length) != length) break;
+                    }
+                    if (counts.dataBytes != payload.size() || counts.parts != 1) {
+                        fprintf(stderr, "%s payload with a %zu byte boundary in %zu byte chunks: got %zu data bytes in %zu parts\n",
+                            kind, boundary.size(), chunk, counts.dataBytes, counts.parts);
+                        return 1;
+                    }
+                    ++runs;
+                    seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                } while (seconds < 0.2);
+
+                printf("%-8s %8zu %7zu %9.1f\n", kind, boundary.size(), chunk, body.size() * runs / seconds / 1e6);
+            }
+        }
+    }
+
+    return 0;
+}
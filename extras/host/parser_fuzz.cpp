@@ -0,0 +1,361 @@
+/* MIT License
+
+Copyright (c) 2023 Kenny Riddile
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+// Differential fuzzer for multipart_parser. Each input becomes a boundary and
+// a body: a well-formed multipart body built from the input, or whatever
+// follows a valid opening boundary, taken from the input as it is or as a
+// soup of header and delimiter pieces. The parser's
+// callbacks are recorded and compared:
+//
+//  - across chunkings: feeding the body in pieces of any size must produce
+//    the same headers, part data and stopping point as feeding it whole;
+//  - against referenceSplit(), a deliberately simple whole-buffer splitter,
+//    whenever that accepts the body as complete.
+//
+// Built with -DSDSERVER_LIBFUZZER and -fsanitize=fuzzer this is a libFuzzer
+// target. Otherwise it has its own driver:
+//
+// Usage: parser_fuzz [--iterations N] [--seed N] [FILE...]
+//
+// Files are run as inputs, e.g. a crash saved by libFuzzer. Without files,
+// N random inputs are generated.
+
+#include <multipart_parser.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+// Callbacks as (kind, bytes). Consecutive data callbacks of the same kind
+// are merged, since where the parser splits them depends on the chunking.
+struct Event {
+    char kind; // B part begin, F header field, V header value, H headers complete, D data, E part end, Z body end
+    std::string bytes;
+    bool operator==(const Event& other) const { return kind == other.kind && bytes == other.bytes; }
+};
+
+struct Outcome {
+    std::vector<Event> events;
+    size_t consumed = 0; // bytes accepted before the parser stopped
+    bool operator==(const Outcome& other) const { return events == other.events && consumed == other.consumed; }
+};
+
+// Reads the fuzz input a byte at a time, then zeros once it runs out.
+class Input {
+public:
+    Input(const uint8_t* data, size_t size) : _data(data), _size(size) {}
+    uint8_t byte() { return _position < _size ? _data[_position++] : 0; }
+    bool empty() const { return _position == _size; }
+    std::string rest() {
+        std::string bytes(reinterpret_cast<const char*>(_data) + _position, _size - _position);
+        _position = _size;
+        return bytes;
+    }
+
+private:
+    const uint8_t* _data;
+    size_t _size;
+    size_t _position = 0;
+};
+
+void record(std::vector<Event>& events, char kind, const char* data, size_t length) {
+    if (!events.empty() && events.back().kind == kind && (kind == 'F' || kind == 'V' || kind == 'D')) {
+        events.back().bytes.append(data, length);
+    } else if (kind != 'D' || length != 0) {
+        events.push_back({ kind, std::string(data, length) });
+    }
+}
+
+template <char Kind>
+int onData(multipart_parser* parser, const char* at, size_t length) {
+    record(*static_cast<std::vector<Event>*>(multipart_parser_get_data(parser)), Kind, at, length);
+    return 0;
+}
+
+template <char Kind>
+int onNotify(multipart_parser* parser) {
+    record(*static_cast<std::vector<Event>*>(multipart_parser_get_data(parser)), Kind, nullptr, 0);
+    return 0;
+}
+
+Outcome runParser(const std::string& boundary, const std::string& body, const std::vector<size_t>& chunks) {
+    static multipart_parser_settings settings = [] {
+        multipart_parser_settings callbacks = {};
+        callbacks.on_header_field = onData<'F'>;
+        callbacks.on_header_value = onData<'V'>;
+        callbacks.on_part_data = onData<'D'>;
+        callbacks.on_part_data_begin = onNotify<'B'>;
+        callbacks.on_headers_complete = onNotify<'H'>;
+        callbacks.on_part_data_end = onNotify<'E'>;
+        callbacks.on_body_end = onNotify<'Z'>;
+        return callbacks;
+    }();
+
+    Outcome outcome;
+    multipart_parser parser;
+    multipart_parser_init(&parser, boundary.c_str(), &settings);
+    multipart_parser_set_data(&parser, &outcome.events);
+    size_t chunk = 0;
+    while (outcome.consumed < body.size()) {
+        size_t length = std::min(chunks[chunk++ % chunks.size()], body.size() - outcome.consumed);
+        // Copied so reads past the chunk show up under AddressSanitizer
+        std::vector<char> piece(body.begin() + outcome.consumed, body.begin() + outcome.consumed + length);
+        size_t accepted = multipart_parser_execute(&parser, piece.data(), length);
+        outcome.consumed += accepted;
+        if (accepted != length) {
+            // A header name cut short by an invalid byte has been passed on
+            // only if the chunk ended inside it
+            if (!outcome.events.empty() && outcome.events.back().kind == 'F') outcome.events.pop_back();
+            break;
+        }
+    }
+    return outcome;
+}
+
+bool isHeaderNameChar(char c) {
+    return c == '-' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+// Splits a complete body the obvious way, searching the whole buffer for
+// each delimiter. Returns false for anything that isn't a complete,
+// well-formed body.
+bool referenceSplit(const std::string& boundary, const std::string& body, std::vector<Event>& events) {
+    const std::string dashBoundary = "--" + boundary;
+    const std::string delimiter = "\r\n" + dashBoundary;
+    if (body.compare(0, dashBoundary.size() + 2, dashBoundary + "\r\n") != 0) return false;
+
+    size_t pos = dashBoundary.size() + 2;
+    for (;;) {
+        events.push_back({ 'B', "" });
+        while (body.compare(pos, 2, "\r\n") != 0) {
+            size_t colon = pos;
+            while (colon < body.size() && isHeaderNameChar(body[colon])) ++colon;
+            if (colon == body.size() || body[colon] != ':') return false;
+            size_t valueBegin = colon + 1;
+            while (valueBegin < body.size() && body[valueBegin] == ' ') ++valueBegin;
+            size_t valueEnd = body.find('\r', valueBegin);
+            if (valueEnd == std::string::npos || body.compare(valueEnd, 2, "\r\n") != 0) return false;
+            events.push_back({ 'F', body.substr(pos, colon - pos) });
+            events.push_back({ 'V', body.substr(valueBegin, valueEnd - valueBegin) });
+            pos = valueEnd + 2;
+        }
+        pos += 2;
+        events.push_back({ 'H', "" });
+
+        size_t end = body.find(delimiter, pos);
+        if (end == std::string::npos) return false;
+        if (end > pos) events.push_back({ 'D', body.substr(pos, end - pos) });
+        events.push_back({ 'E', "" });
+        pos = end + delimiter.size();
+        if (body.compare(pos, 2, "--") == 0) {
+            events.push_back({ 'Z', "" });
+            return true;
+        }
+        if (body.compare(pos, 2, "\r\n") != 0) return false;
+        pos += 2;
+    }
+}
+
+std::string makeBoundary(Input& input) {
+    // RFC 2046 bchars, hyphens first so they come up often
+    static const char BCHARS[] = "--'()+_,./:=? 0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+    size_t length = 1 + input.byte() % 70;
+    std::string boundary;
+    for (size_t i = 0; i < length; ++i) {
+        boundary += BCHARS[input.byte() % (sizeof(BCHARS) - 1)];
+    }
+    if (boundary.back() == ' ') boundary.back() = '-'; // can't end in a space
+    return boundary;
+}
+
+// Part data biased towards what the delimiter search has to get right: CRs,
+// LFs, hyphens and delimiter prefixes that stop short.
+std::string makePartData(Input& input, const std::string& delimiter) {
+    size_t tokens = input.byte();
+    std::string data;
+    for (size_t i = 0; i < tokens; ++i) {
+        uint8_t token = input.byte();
+        switch (token % 6) {
+            case 0: data += '\r'; break;
+            case 1: data += '\n'; break;
+            case 2: data += '-'; break;
+            case 3: data += delimiter.substr(0, 1 + input.byte() % (delimiter.size() - 1)); break;
+            case 4: data += delimiter[token % delimiter.size()]; break;
+            default: data += static_cast<char>(input.byte()); break;
+        }
+    }
+
+    // A whole delimiter would end the part. Boundaries never hold NUL, so
+    // breaking its last byte can't form a new one.
+    for (size_t pos = data.find(delimiter); pos != std::string::npos; pos = data.find(delimiter, pos)) {
+        data[pos + delimiter.size() - 1] = '\0';
+    }
+    return data;
+}
+
+// Bytes drawn from the pieces a multipart body is made of, in any order, so
+// header lines, delimiters and part data run into each other in ways a
+// well-formed body never has.
+std::string makeTokens(Input& input, const std::string& boundary) {
+    static const char* const TOKENS[] = { "\r", "\n", "\r\n", ":", " ", "-", "--", "a", "Content-Type", "text/plain" };
+    const std::string delimiter = "\r\n--" + boundary;
+    std::string tokens;
+    while (!input.empty()) {
+        uint8_t token = input.byte();
+        if (token % 12 == 10) {
+            tokens += delimiter.substr(0, 1 + input.byte() % delimiter.size());
+        } else if (token % 12 == 11) {
+            tokens += static_cast<char>(input.byte());
+        } else {
+            tokens += TOKENS[token % 12];
+        }
+    }
+    return tokens;
+}
+
+std::string makeBody(Input& input, const std::string& boundary) {
+    static const char NAME_CHARS[] = "-abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+    const std::string delimiter = "\r\n--" + boundary;
+    std::string body = "--" + boundary + "\r\n";
+    size_t parts = 1 + input.byte() % 4;
+    for (size_t part = 0; part < parts; ++part) {
+        size_t headers = input.byte() % 4;
+        for (size_t header = 0; header < headers; ++header) {
+            size_t nameLength = input.byte() % 16;
+            for (size_t i = 0; i < nameLength; ++i) body += NAME_CHARS[input.byte() % (sizeof(NAME_CHARS) - 1)];
+            body += ':';
+            body.append(input.byte() % 3, ' ');
+            size_t valueLength = input.byte() % 48;
+            for (size_t i = 0; i < valueLength; ++i) {
+                char c = static_cast<char>(input.byte());
+                body += c == '\r' ? '?' : c;
+            }
+            if (valueLength != 0 && body.back() == ' ') body.back() = '_'; // leading spaces are skipped, so keep one at the end from looking like them
+            body += "\r\n";
+        }
+        body += "\r\n";
+        body += makePartData(input, delimiter);
+        body += delimiter;
+        body += part + 1 == parts ? "--" : "\r\n";
+    }
+    if (input.byte() % 2) body += input.rest(); // an epilogue, ignored
+    return body;
+}
+
+void fail(const char* what, const std::string& boundary, const std::string& body, const std::vector<size_t>& chunks) {
+    fprintf(stderr, "%s\nboundary (%zu bytes): %s\nbody (%zu bytes): ", what, boundary.size(), boundary.c_str(), body.size());
+    for (unsigned char c : body) {
+        if (c >= 0x20 && c < 0x7F && c != '\\') fputc(c, stderr); else fprintf(stderr, "\\x%02x", c);
+    }
+    fprintf(stderr, "\nchunks:");
+    for (size_t chunk : chunks) fprintf(stderr, " %zu", chunk);
+    fprintf(stderr, "\n");
+    abort();
+}
+
+void check(const uint8_t* data, size_t size) {
+    Input input(data, size);
+    uint8_t mode = input.byte();
+    std::string boundary = makeBoundary(input);
+    std::string body;
+    if (mode % 4 == 0) {
+        body = "--" + boundary + "\r\n" + input.rest();
+    } else if (mode % 4 == 1) {
+        body = "--" + boundary + "\r\n" + makeTokens(input, boundary);
+    } else {
+        body = makeBody(input, boundary);
+    }
+
+    std::vector<size_t> whole = { body.size() ? body.size() : 1 };
+    Outcome expected = runParser(boundary, body, whole);
+
+    std::vector<Event> reference;
+    if (referenceSplit(boundary, body, reference) && !(expected.events == reference)) {
+        fail("parser disagrees with the reference splitter", boundary, body, whole);
+    }
+    if (mode % 4 >= 2 && expected.consumed != body.size()) {
+        fail("parser rejected a well-formed body", boundary, body, whole);
+    }
+
+    // Small chunks, chunks around the delimiter's length ("\r\n--" plus the
+    // boundary), and an uneven schedule seeded from the input
+    size_t delimiterLength = boundary.size() + 4;
+    std::vector<std::vector<size_t>> chunkings = { { 1 }, { 2 }, { 3 }, { 5 }, { 8 } };
+    for (size_t length = delimiterLength - 2; length <= delimiterLength + 2; ++length) {
+        chunkings.push_back({ length });
+    }
+    std::mt19937 random(size);
+    chunkings.emplace_back();
+    for (size_t i = 0; i < 8; ++i) chunkings.back().push_back(1 + random() % (2 * delimiterLength));
+    for (const std::vector<size_t>& chunks : chunkings) {
+        if (!(runParser(boundary, body, chunks) == expected)) fail("chunking changed the result", boundary, body, chunks);
+    }
+}
+
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    check(data, size);
+    return 0;
+}
+
+#ifndef SDSERVER_LIBFUZZER
+int main(int argc, char** argv) {
+    unsigned long iterations = 20000;
+    unsigned long seed = 1;
+    std::vector<std::string> files;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--iterations") && i + 1 < argc) {
+            iterations = strtoul(argv[++i], nullptr, 10);
+        } else if (!strcmp(argv[i], "--seed") && i + 1 < argc) {
+            seed = strtoul(argv[++i], nullptr, 10);
+        } else {
+            files.push_back(argv[i]);
+        }
+    }
+
+    for (const std::string& file : files) {
+        std::ifstream stream(file, std::ios::binary);
+        std::string bytes((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+        check(reinterpret_cast<const uint8_t*>(bytes.data()), bytes.size());
+    }
+    if (!files.empty()) return 0;
+
+    std::mt19937 random(seed);
+    std::vector<uint8_t> bytes;
+    for (unsigned long i = 0; i < iterations; ++i) {
+        bytes.resize(random() % 1024);
+        for (uint8_t& byte : bytes) byte = static_cast<uint8_t>(random());
+        check(bytes.data(), bytes.size());
+    }
+    printf("%lu inputs passed\n", iterations);
+    return 0;
+}
+#endif
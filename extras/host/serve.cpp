@@ -0,0 +1,167 @@
+/* MIT License
+
+Copyright (c) 2023 Kenny Riddile
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+// Serves an in-memory card over a real TCP port on 127.0.0.1 so curl and
+// browsers can be pointed at the host build.
+//
+// Usage: serve [port] [directory]
+//
+// The directory is copied onto the card at startup; files whose names
+// contain ".frag" are stored fragmented. Set NO_PIPELINE, NO_WRITE_BUFFER or
+// NO_LISTING_CACHE in the environment to leave those buffers out. Card
+// activity is reported on stderr.
+#include <SDServer.h>
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+static void load(SdFs& sd, const std::string& hostPath, const std::string& cardPath) {
+    DIR* dir = opendir(hostPath.c_str());
+    if (!dir) return;
+    while (dirent* entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        if (name == "." || name == "..") continue;
+        std::string from = hostPath + "/" + name;
+        std::string to = cardPath + "/" + name;
+        struct stat st;
+        if (stat(from.c_str(), &st) != 0) continue;
+        if (S_ISDIR(st.st_mode)) {
+            sd.mkdir(to.c_str());
+            load(sd, from, to);
+        } else {
+            std::ifstream in(from, std::ios::binary);
+            std::stringstream data;
+            data << in.rdbuf();
+            sd.addFile(to.c_str(), data.str(), name.find(".frag") != std::string::npos);
+        }
+    }
+    closedir(dir);
+}
+
+struct Bridge {
+    int fd;
+    host::Endpoint endpoint;
+    bool readClosed = false;
+};
+
+int main(int argc, char** argv) {
+    int port = argc > 1 ? atoi(argv[1]) : 8080;
+    SdFs sd;
+    if (argc > 2) load(sd, argv[2], "");
+
+    WiFiServer server(port);
+    server.begin();
+    static char workingBuffer[4096];
+    static char uploadBuffer[2048];
+    SDServer sdServer;
+    sdServer.begin(&server, &sd, workingBuffer, sizeof(workingBuffer), uploadBuffer, sizeof(uploadBuffer));
+    static char listingCache[16384];
+    if (!getenv("NO_LISTING_CACHE")) sdServer.setListingCache(listingCache, getenv("LISTING_CACHE_SIZE") ? atoi(getenv("LISTING_CACHE_SIZE")) : sizeof(listingCache));
+    static char fileCache[16384];
+    if (!getenv("NO_FILE_CACHE")) sdServer.setFileCache(fileCache, getenv("FILE_CACHE_SIZE") ? atoi(getenv("FILE_CACHE_SIZE")) : sizeof(fileCache));
+    sdServer.setCacheControl("/logs/", "max-age=60");
+    sdServer.setCacheControl("/logs/l1", "no-store");
+    static char uploadWriteBuffer[8192];
+    if (!getenv("NO_WRITE_BUFFER")) sdServer.setUploadWriteBuffer(uploadWriteBuffer, sizeof(uploadWriteBuffer));
+    static char pipelineBuffer[4096];
+    if (!getenv("NO_PIPELINE")) sdServer.setPipelineBuffer(pipelineBuffer, sizeof(pipelineBuffer));
+
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, 16) != 0) {
+        perror("listen");
+        return 1;
+    }
+    fcntl(listener, F_SETFL, O_NONBLOCK);
+    fprintf(stderr, "listening on 127.0.0.1:%d\n", port);
+
+    std::vector<Bridge> bridges;
+    std::vector<char> buffer(65536);
+    for (;;) {
+        bool busy = false;
+        int fd = accept(listener, nullptr, nullptr);
+        if (fd >= 0) {
+            fcntl(fd, F_SETFL, O_NONBLOCK);
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            bridges.push_back({fd, server.connect()});
+            busy = true;
+        }
+        sdServer.handleClient();
+        for (auto it = bridges.begin(); it != bridges.end();) {
+            if (!it->readClosed) {
+                ssize_t n = recv(it->fd, buffer.data(), buffer.size(), 0);
+                if (n > 0) {
+                    it->endpoint.send(buffer.data(), n);
+                    busy = true;
+                } else if (n == 0) {
+                    it->endpoint.shutdownWrite();
+                    it->readClosed = true;
+                }
+            }
+            size_t pending = it->endpoint.available();
+            if (pending) {
+                size_t n = it->endpoint.receive(buffer.data(), std::min(pending, buffer.size()));
+                size_t sent = 0;
+                while (sent < n) {
+                    ssize_t w = send(it->fd, buffer.data() + sent, n - sent, MSG_NOSIGNAL);
+                    if (w > 0) sent += w;
+                    else if (w < 0 && errno != EAGAIN) break;
+                }
+                busy = true;
+            }
+            if (it->endpoint.serverClosed()) {
+                close(it->fd);
+                it = bridges.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        static unsigned long lastWrites = 0;
+        if (sd.stats().writeCalls != lastWrites) {
+            lastWrites = sd.stats().writeCalls;
+            fprintf(stderr, "writes=%lu syncs=%lu bytes=%llu\n", sd.stats().writeCalls, sd.stats().syncCalls, sd.stats().bytesWritten);
+        }
+        static unsigned long lastReads = 0;
+        if (sd.stats().readCalls != lastReads && !busy) {
+            lastReads = sd.stats().readCalls;
+            fprintf(stderr, "reads=%lu sectors=%lu\n", sd.stats().readCalls, sd.stats().sectorReads);
+        }
+        if (!busy) usleep(200);
+    }
+}
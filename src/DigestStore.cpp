@@ -0,0 +1,117 @@
+/* MIT License
+
+Copyright (c) 2023 Kenny Riddile
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#include "DigestStore.h"
+
+#include <algorithm>
+#include <cstring>
+
+// CRC32C, a nibble at a time
+static const uint32_t CRC32C_TABLE[] = {
+    0x00000000, 0x105ec76f, 0x20bd8ede, 0x30e349b1, 0x417b1dbc, 0x5125dad3, 0x61c69362, 0x7198540d,
+    0x82f63b78, 0x92a8fc17, 0xa24bb5a6, 0xb21572c9, 0xc38d26c4, 0xd3d3e1ab, 0xe330a81a, 0xf36e6f75
+};
+
+uint32_t updateCRC32C(uint32_t crc, const char* data, size_t length) {
+    crc = ~crc;
+    for (size_t i = 0; i < length; ++i) {
+        crc ^= static_cast<uint8_t>(data[i]);
+        crc = (crc >> 4) ^ CRC32C_TABLE[crc & 0xF];
+        crc = (crc >> 4) ^ CRC32C_TABLE[crc & 0xF];
+    }
+
+    return ~crc;
+}
+
+void DigestStore::begin(SdFs* fs) {
+    _fs = fs;
+    _file.close();
+    memset(_occupied, 0, sizeof(_occupied));
+    _file = _fs->open(SDSERVER_DIGEST_STORE_PATH, O_RDWR);
+    if (!_file) return;
+
+    Record record;
+    for (size_t slot = 0; slot < SDSERVER_DIGEST_STORE_SLOTS; ++slot) {
+        if (_file.read(&record, sizeof(record)) != (int)sizeof(record)) break;
+        if (record.check == checkOf(record)) {
+            _occupied[slot / 8] |= 1 << slot % 8;
+        }
+    }
+}
+
+bool DigestStore::lookup(const char* path, uint64_t size, uint32_t modified, uint32_t& crc) {
+    uint32_t pathHash = hashPath(path);
+    size_t slot = pathHash % SDSERVER_DIGEST_STORE_SLOTS;
+    if (!isOccupied(slot)) return false;
+
+    Record record;
+    bool found = _file.seekSet((uint64_t)slot * sizeof(Record)) &&
+        _file.read(&record, sizeof(record)) == (int)sizeof(record) &&
+        record.check == checkOf(record) &&
+        record.pathHash == pathHash && record.size == size && record.modified == modified;
+    if (found) {
+        crc = record.crc;
+    }
+
+    return found;
+}
+
+void DigestStore::store(const char* path, uint64_t size, uint32_t modified, uint32_t crc) {
+    if (!_fs) return;
+
+    Record record = { hashPath(path), modified, size, crc, 0 };
+    record.check = checkOf(record);
+    size_t slot = record.pathHash % SDSERVER_DIGEST_STORE_SLOTS;
+    uint64_t offset = (uint64_t)slot * sizeof(Record);
+    if (!_file) {
+        _file = _fs->open(SDSERVER_DIGEST_STORE_PATH, O_RDWR | O_CREAT);
+        if (!_file) return;
+    }
+
+    // SdFat can't seek past the end, so a short file is padded out to the
+    // slot first. Zeroed records never check out.
+    if (_file.fileSize() < offset && _file.seekSet(_file.fileSize())) {
+        static const char zeros[sizeof(Record)] = {};
+        while (_file.fileSize() < offset) {
+            size_t count = std::min<uint64_t>(sizeof(zeros), offset - _file.fileSize());
+            if (_file.write(zeros, count) != count) break;
+        }
+    }
+    if (_file.seekSet(offset) && _file.write(&record, sizeof(record)) == sizeof(record)) {
+        _occupied[slot / 8] |= 1 << slot % 8;
+    }
+    _file.sync();
+}
+
+// Leading slashes are dropped, so "/a/b" and "a/b" share a record
+uint32_t DigestStore::hashPath(const char* path) {
+    while (*path == '/') {
+        ++path;
+    }
+
+    return updateCRC32C(0, path, strlen(path));
+}
+
+uint32_t DigestStore::checkOf(const Record& record) {
+    return updateCRC32C(0, reinterpret_cast<const char*>(&record), offsetof(Record, check));
+}
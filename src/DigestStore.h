@@ -0,0 +1,82 @@
+/* MIT License
+
+Copyright (c) 2023 Kenny Riddile
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#ifndef DIGESTSTORE_H
+#define DIGESTSTORE_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include <SdFat.h>
+
+// File the digests are kept in, and how many records it holds
+#ifndef SDSERVER_DIGEST_STORE_PATH
+#define SDSERVER_DIGEST_STORE_PATH "/.digests"
+#endif
+
+#ifndef SDSERVER_DIGEST_STORE_SLOTS
+#define SDSERVER_DIGEST_STORE_SLOTS 256
+#endif
+
+// Continues a CRC32C (Castagnoli) over length more bytes. Start with 0.
+uint32_t updateCRC32C(uint32_t crc, const char* data, size_t length);
+
+// Remembers the CRC32C of files the server has received whole or been asked
+// the digest of, so a digest can be answered without reading the file again.
+//
+// The records live in a single file on the card, one slot per path picked by
+// a hash of the path, so a store costs one small write. The file is kept open,
+// and which slots hold a record is kept in RAM, so looking up a file that has
+// no record doesn't touch the card at all. Each record also holds the file's
+// size and modification time, and is only used while they still match, so a
+// file changed behind the server's back is simply a miss. Paths that share a
+// slot take turns.
+class DigestStore {
+public:
+    // Opens the store, if there is one, and notes which slots hold a record
+    void begin(SdFs* fs);
+
+    // modified is the FAT date in the high 16 bits and the FAT time in the low ones
+    bool lookup(const char* path, uint64_t size, uint32_t modified, uint32_t& crc);
+    void store(const char* path, uint64_t size, uint32_t modified, uint32_t crc);
+
+private:
+    struct Record {
+        uint32_t pathHash;
+        uint32_t modified;
+        uint64_t size;
+        uint32_t crc;
+        uint32_t check; // CRC32C of the fields above, so empty or torn records never match
+    };
+
+    static uint32_t hashPath(const char* path);
+    static uint32_t checkOf(const Record& record);
+
+    bool isOccupied(size_t slot) const { return _occupied[slot / 8] & (1 << slot % 8); }
+
+    SdFs* _fs = nullptr;
+    FsFile _file;
+    uint8_t _occupied[(SDSERVER_DIGEST_STORE_SLOTS + 7) / 8] = {};
+};
+
+#endif
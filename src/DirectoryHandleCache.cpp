@@ -0,0 +1,108 @@
+/* MIT License
+
+Copyright (c) 2023 Kenny Riddile
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#include "DirectoryHandleCache.h"
+
+#include <cstring>
+
+static std::string_view normalizeDirectory(std::string_view directory) {
+    while (!directory.empty() && directory.front() == '/') directory.remove_prefix(1);
+    while (!directory.empty() && directory.back() == '/') directory.remove_suffix(1);
+
+    return directory;
+}
+
+void DirectoryHandleCache::begin(SdFs* fs) {
+    _fs = fs;
+    invalidateAll();
+}
+
+FsFile DirectoryHandleCache::open(std::string_view path) {
+    FsFile file;
+    if (path.empty() || path.back() == '/') {
+        // The root, or another directory named with a trailing slash
+        if (FsFile* cached = directory(path)) {
+            file = *cached;
+            file.rewind();
+            return file;
+        }
+    } else {
+        size_t nameBegin = path.rfind('/') + 1; // 0 without a slash
+        if (FsFile* cached = directory(path.substr(0, nameBegin))) {
+            file.open(cached, path.data() + nameBegin, O_RDONLY);
+            return file;
+        }
+    }
+
+    return _fs->open(path.data());
+}
+
+// Returns the open handle of a directory, opening it and evicting the least
+// recently used one if needed, or nullptr when it can't be cached.
+FsFile* DirectoryHandleCache::directory(std::string_view path) {
+    path = normalizeDirectory(path);
+    if (SDSERVER_DIRECTORY_CACHE_ENTRIES == 0 || path.size() > SDSERVER_DIRECTORY_CACHE_PATH_LENGTH) return nullptr;
+
+    Entry* victim = nullptr;
+    for (Entry& entry : _entries) {
+        if (entry.directory.isOpen() && std::string_view(entry.path, entry.pathLength) == path) {
+            entry.lastUse = ++_useCount;
+            return &entry.directory;
+        }
+        if (!victim || !entry.directory.isOpen() || (victim->directory.isOpen() && entry.lastUse < victim->lastUse)) {
+            victim = &entry;
+        }
+    }
+
+    // Opened through SdFs, which wants a null-terminated path with its root
+    char fullPath[SDSERVER_DIRECTORY_CACHE_PATH_LENGTH + 2];
+    fullPath[0] = '/';
+    memcpy(fullPath + 1, path.data(), path.size());
+    fullPath[path.size() + 1] = '\0';
+    victim->directory.close();
+    victim->directory = _fs->open(fullPath);
+    if (!victim->directory.isDirectory()) {
+        victim->directory.close();
+        return nullptr;
+    }
+    memcpy(victim->path, path.data(), path.size());
+    victim->pathLength = path.size();
+    victim->lastUse = ++_useCount;
+
+    return &victim->directory;
+}
+
+void DirectoryHandleCache::invalidate(std::string_view directory) {
+    directory = normalizeDirectory(directory);
+    for (Entry& entry : _entries) {
+        if (entry.directory.isOpen() && std::string_view(entry.path, entry.pathLength) == directory) {
+            entry.directory.close();
+        }
+    }
+}
+
+void DirectoryHandleCache::invalidateAll() {
+    for (Entry& entry : _entries) {
+        entry.directory.close();
+    }
+}
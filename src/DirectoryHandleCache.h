@@ -0,0 +1,81 @@
+/* MIT License
+
+Copyright (c) 2023 Kenny Riddile
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#ifndef DIRECTORYHANDLECACHE_H
+#define DIRECTORYHANDLECACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+#include <SdFat.h>
+
+// Directories kept open for resolving request paths. 0 resolves every path
+// from the root.
+#ifndef SDSERVER_DIRECTORY_CACHE_ENTRIES
+#define SDSERVER_DIRECTORY_CACHE_ENTRIES 4
+#endif
+
+// Longest directory path that can be cached, without leading or trailing slashes
+#ifndef SDSERVER_DIRECTORY_CACHE_PATH_LENGTH
+#define SDSERVER_DIRECTORY_CACHE_PATH_LENGTH 63
+#endif
+
+// Keeps the most recently used directories open, so opening a path in one of
+// them looks up a single name instead of walking every directory from the
+// root. A directory request is answered with a copy of the cached handle,
+// without reading the card at all.
+//
+// Only directories are kept. A file is always opened from its directory
+// entry, so its size can't go stale while it's being written. A cached
+// directory still has to be invalidated when entries are added to it, since
+// an exFAT directory records its own length.
+class DirectoryHandleCache {
+public:
+    void begin(SdFs* fs);
+
+    // Opens path for reading like SdFs::open(). path must be null-terminated.
+    FsFile open(std::string_view path);
+
+    // Closes the cached handle of directory; the empty string is the root.
+    void invalidate(std::string_view directory);
+    void invalidateAll();
+
+private:
+    struct Entry {
+        FsFile directory;
+        uint32_t lastUse = 0;
+        uint8_t pathLength = 0;
+        char path[SDSERVER_DIRECTORY_CACHE_PATH_LENGTH];
+    };
+
+    static_assert(SDSERVER_DIRECTORY_CACHE_PATH_LENGTH <= 255, "cached directory paths are at most 255 characters");
+
+    FsFile* directory(std::string_view path);
+
+    SdFs* _fs = nullptr;
+    uint32_t _useCount = 0;
+    Entry _entries[SDSERVER_DIRECTORY_CACHE_ENTRIES > 0 ? SDSERVER_DIRECTORY_CACHE_ENTRIES : 1];
+};
+
+#endif
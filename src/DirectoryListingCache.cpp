@@ -0,0 +1,261 @@
+/* MIT License
+
+Copyright (c) 2023 Kenny Riddile
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#include "DirectoryListingCache.h"
+
+#include <cstring>
+
+struct DirectoryListingCache::Record {
+    uint32_t length; // of the whole record, padded so the next one stays aligned
+    uint32_t bodyLength;
+    uint32_t hash; // of the body, for the ETag
+    uint16_t id;
+    uint16_t references;
+    uint16_t directoryLength;
+    bool stale;
+
+    // The directory name and then the body follow the record
+    char* directory() { return reinterpret_cast<char*>(this + 1); }
+    char* body() { return directory() + directoryLength; }
+};
+
+static const uint32_t FNV_OFFSET_BASIS = 2166136261u;
+static const uint32_t FNV_PRIME = 16777619u;
+
+static uint32_t hashBytes(uint32_t hash, const char* data, size_t length) {
+    for (size_t i = 0; i < length; ++i) {
+        hash = (hash ^ (uint8_t)data[i]) * FNV_PRIME;
+    }
+
+    return hash;
+}
+
+// "/logs/", "logs/" and "/logs" all name the same directory
+static std::string_view normalizeDirectory(std::string_view directory) {
+    while (!directory.empty() && directory.front() == '/') directory.remove_prefix(1);
+    while (!directory.empty() && directory.back() == '/') directory.remove_suffix(1);
+
+    return directory;
+}
+
+void DirectoryListingCache::begin(char* buffer, size_t size) {
+    // Records hold 32-bit fields, which some cores can't access unaligned
+    size_t misalignment = reinterpret_cast<uintptr_t>(buffer) % alignof(Record);
+    size_t skip = misalignment ? alignof(Record) - misalignment : 0;
+    if (!buffer || size < skip + sizeof(Record)) {
+        _buffer = nullptr;
+        _size = 0;
+    } else {
+        _buffer = buffer + skip;
+        _size = size - skip;
+    }
+    _used = 0;
+    _building = NONE;
+    _hasOversizedDirectory = false;
+}
+
+uint16_t DirectoryListingCache::acquire(std::string_view directory) {
+    directory = normalizeDirectory(directory);
+    for (size_t offset = 0; offset < _used;) {
+        Record* record = recordAt(offset);
+        if (!record->stale && record->id != _building &&
+            std::string_view(record->directory(), record->directoryLength) == directory) {
+            ++record->references;
+            return record->id;
+        }
+        offset += record->length;
+    }
+
+    return NONE;
+}
+
+void DirectoryListingCache::release(uint16_t id) {
+    Record* record = find(id);
+    if (!record) return;
+
+    if (--record->references == 0 && record->stale) {
+        remove(record);
+    }
+}
+
+uint16_t DirectoryListingCache::beginBuild(std::string_view directory) {
+    if (!enabled() || _building != NONE) return NONE;
+
+    directory = normalizeDirectory(directory);
+    if (_hasOversizedDirectory && hashBytes(FNV_OFFSET_BASIS, directory.data(), directory.size()) == _oversizedDirectory) {
+        return NONE;
+    }
+
+    size_t length = recordLength(directory.size());
+    if (length > _size || !makeRoom(length)) return NONE;
+
+    Record* record = recordAt(_used);
+    record->length = length;
+    record->bodyLength = 0;
+    record->hash = FNV_OFFSET_BASIS;
+    record->id = _nextId++;
+    if (_nextId == NONE) ++_nextId;
+    record->references = 1;
+    record->directoryLength = directory.size();
+    record->stale = false;
+    memcpy(record->directory(), directory.data(), directory.size());
+    _used += length;
+    _building = record->id;
+
+    return record->id;
+}
+
+bool DirectoryListingCache::append(uint16_t id, const char* data, size_t length) {
+    Record* record = find(id);
+    if (!record || id != _building) return false;
+
+    // The record being built is always the last one
+    size_t newLength = recordLength(record->directoryLength + record->bodyLength + length);
+    size_t growth = newLength - record->length;
+    if (newLength > _size || !makeRoom(growth)) {
+        _hasOversizedDirectory = true;
+        _oversizedDirectory = hashBytes(FNV_OFFSET_BASIS, record->directory(), record->directoryLength);
+        return false;
+    }
+    record = find(id); // making room moves it
+
+    memcpy(record->body() + record->bodyLength, data, length);
+    record->bodyLength += length;
+    record->hash = hashBytes(record->hash, data, length);
+    record->length = newLength;
+    _used += growth;
+
+    return true;
+}
+
+void DirectoryListingCache::commitBuild(uint16_t id) {
+    if (id == _building) {
+        _building = NONE;
+    }
+}
+
+void DirectoryListingCache::abortBuild(uint16_t id) {
+    if (id != _building) return;
+
+    _building = NONE;
+    if (Record* record = find(id)) {
+        remove(record);
+    }
+}
+
+std::string_view DirectoryListingCache::body(uint16_t id) const {
+    Record* record = find(id);
+    if (!record) return std::string_view();
+
+    return std::string_view(record->body(), record->bodyLength);
+}
+
+void DirectoryListingCache::formatETag(uint16_t id, char* out) const {
+    static const char HEX_DIGITS[] = "0123456789abcdef";
+    Record* record = find(id);
+    uint32_t hash = record ? record->hash : 0;
+    out[0] = '"';
+    for (size_t i = 8; i > 0; --i, hash >>= 4) {
+        out[i] = HEX_DIGITS[hash & 0xF];
+    }
+    out[9] = '"';
+    out[10] = '\0';
+}
+
+void DirectoryListingCache::invalidate(std::string_view directory) {
+    directory = normalizeDirectory(directory);
+    if (_hasOversizedDirectory && hashBytes(FNV_OFFSET_BASIS, directory.data(), directory.size()) == _oversizedDirectory) {
+        _hasOversizedDirectory = false;
+    }
+    for (size_t offset = 0; offset < _used;) {
+        Record* record = recordAt(offset);
+        if (std::string_view(record->directory(), record->directoryLength) == directory) {
+            record->stale = true;
+            if (record->references == 0) {
+                remove(record); // the next record moves to this offset
+                continue;
+            }
+        }
+        offset += record->length;
+    }
+}
+
+void DirectoryListingCache::invalidateAll() {
+    _hasOversizedDirectory = false;
+    for (size_t offset = 0; offset < _used;) {
+        Record* record = recordAt(offset);
+        record->stale = true;
+        if (record->references == 0) {
+            remove(record);
+            continue;
+        }
+        offset += record->length;
+    }
+}
+
+size_t DirectoryListingCache::recordLength(size_t payloadLength) {
+    size_t length = sizeof(Record) + payloadLength;
+    return (length + alignof(Record) - 1) / alignof(Record) * alignof(Record);
+}
+
+DirectoryListingCache::Record* DirectoryListingCache::find(uint16_t id) const {
+    if (id == NONE) return nullptr;
+
+    for (size_t offset = 0; offset < _used;) {
+        Record* record = recordAt(offset);
+        if (record->id == id) return record;
+        offset += record->length;
+    }
+
+    return nullptr;
+}
+
+DirectoryListingCache::Record* DirectoryListingCache::recordAt(size_t offset) const {
+    return reinterpret_cast<Record*>(_buffer + offset);
+}
+
+// Evicts listings nobody is sending, stale ones first and then the oldest,
+// until length more bytes fit at the end of the buffer.
+bool DirectoryListingCache::makeRoom(size_t length) {
+    while (_used + length > _size) {
+        Record* victim = nullptr;
+        for (size_t offset = 0; offset < _used;) {
+            Record* record = recordAt(offset);
+            if (record->references == 0 && (!victim || (record->stale && !victim->stale))) {
+                victim = record;
+            }
+            offset += record->length;
+        }
+        if (!victim) return false;
+        remove(victim);
+    }
+
+    return true;
+}
+
+void DirectoryListingCache::remove(Record* record) {
+    char* begin = reinterpret_cast<char*>(record);
+    size_t length = record->length;
+    char* end = begin + length;
+    memmove(begin, end, _buffer + _used - end);
+    _used -= length;
+}
@@ -0,0 +1,88 @@
+/* MIT License
+
+Copyright (c) 2023 Kenny Riddile
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#ifndef DIRECTORYLISTINGCACHE_H
+#define DIRECTORYLISTINGCACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+// Keeps rendered directory listings in a caller-provided buffer, so repeat
+// requests for a directory neither walk it on the card nor re-check every
+// name, and can be revalidated by ETag alone.
+//
+// Listings are packed one after another in the buffer and referred to by id.
+// A listing is built by one connection at a time by appending to the end of
+// the buffer, evicting the oldest listings when it runs out of room. Every
+// connection sending a listing holds a reference to it, so a listing that is
+// invalidated or evicted while being sent stays in place until released.
+class DirectoryListingCache {
+public:
+    static const uint16_t NONE = 0;
+
+    void begin(char* buffer, size_t size);
+    bool enabled() const { return _size != 0; }
+
+    // Returns the current listing of directory with a reference held, or NONE.
+    uint16_t acquire(std::string_view directory);
+    void release(uint16_t id);
+
+    // Starts building the listing of directory and returns it with a
+    // reference held. Returns NONE while another listing is being built, or
+    // when the directory didn't fit the last time it was built.
+    uint16_t beginBuild(std::string_view directory);
+    // Returns false when the listing no longer fits, after which the build
+    // has to be aborted.
+    bool append(uint16_t id, const char* data, size_t length);
+    void commitBuild(uint16_t id);
+    // Drops a listing being built along with its reference.
+    void abortBuild(uint16_t id);
+
+    // The rendered entries, and a quoted strong ETag derived from them
+    std::string_view body(uint16_t id) const;
+    void formatETag(uint16_t id, char* out) const; // out must hold at least 11 bytes
+
+    // Stops serving the listing of directory, e.g. when a file is created in
+    // it. The empty string is the root directory.
+    void invalidate(std::string_view directory);
+    void invalidateAll();
+
+private:
+    struct Record;
+
+    static size_t recordLength(size_t payloadLength);
+    Record* find(uint16_t id) const;
+    Record* recordAt(size_t offset) const;
+    bool makeRoom(size_t length);
+    void remove(Record* record);
+
+    char* _buffer = nullptr;
+    size_t _size = 0;
+    size_t _used = 0;
+    uint16_t _nextId = 1;
+    uint16_t _building = NONE;
+    bool _hasOversizedDirectory = false;
+    uint32_t _oversizedDirectory = 0; // hash of the last directory that didn't fit
+};
+
+#endif
@@ -0,0 +1,291 @@
+/* MIT License
+
+Copyright (c) 2023 Kenny Riddile
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#include "FileCache.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "DigestStore.h"
+
+struct FileCache::Record {
+    uint64_t fileSize;
+    uint32_t length; // of the whole record, padded so the next one stays aligned
+    uint32_t capacity; // bytes of the file the record keeps
+    uint32_t filled;
+    uint32_t modified; // FAT date and time
+    uint32_t crc; // of the whole file, once it's all been filled in
+    uint32_t lastUse;
+    uint16_t id;
+    uint16_t references;
+    uint16_t pathLength;
+    bool gzip;
+    bool stale;
+
+    bool complete() const { return filled == capacity; }
+    // The path and then the file data follow the record
+    char* path() { return reinterpret_cast<char*>(this + 1); }
+    char* data() { return path() + pathLength; }
+};
+
+// The directory part of a path, as the listing cache names directories
+static std::string_view parentDirectory(std::string_view path) {
+    size_t slash = path.rfind('/');
+    path = slash == path.npos ? std::string_view() : path.substr(0, slash);
+    while (!path.empty() && path.front() == '/') path.remove_prefix(1);
+
+    return path;
+}
+
+static std::string_view normalizeDirectory(std::string_view directory) {
+    while (!directory.empty() && directory.front() == '/') directory.remove_prefix(1);
+    while (!directory.empty() && directory.back() == '/') directory.remove_suffix(1);
+
+    return directory;
+}
+
+void FileCache::begin(char* buffer, size_t size) {
+    // Records hold 64-bit fields, which some cores can't access unaligned
+    size_t misalignment = reinterpret_cast<uintptr_t>(buffer) % alignof(Record);
+    size_t skip = misalignment ? alignof(Record) - misalignment : 0;
+    if (!buffer || size < skip + sizeof(Record)) {
+        _buffer = nullptr;
+        _size = 0;
+    } else {
+        _buffer = buffer + skip;
+        _size = size - skip;
+    }
+    _used = 0;
+    _ghostCount = 0;
+}
+
+uint16_t FileCache::acquire(std::string_view path, bool gzip, uint64_t size, uint32_t modified) {
+    Record* record = find(path, gzip);
+    if (!record || !record->complete()) return NONE;
+
+    if (record->fileSize != size || record->modified != modified) {
+        // Changed behind the server's back, so it's no use to anyone
+        record->stale = true;
+        if (record->references == 0) remove(record);
+        return NONE;
+    }
+    ++record->references;
+    record->lastUse = ++_clock;
+
+    return record->id;
+}
+
+void FileCache::release(uint16_t id) {
+    Record* record = find(id);
+    if (!record) return;
+
+    if (--record->references == 0 && (record->stale || !record->complete())) {
+        remove(record);
+    }
+}
+
+uint16_t FileCache::beginFill(std::string_view path, bool gzip, uint64_t size, uint32_t modified) {
+    if (!enabled() || find(path, gzip)) return NONE;
+    if (size > SDSERVER_FILE_CACHE_ENTRY_SIZE && !seenRecently(path, gzip)) return NONE;
+
+    size_t capacity = std::min<uint64_t>(size, SDSERVER_FILE_CACHE_ENTRY_SIZE);
+    size_t length = recordLength(path.size() + capacity);
+    if (length > _size || !makeRoom(length)) return NONE;
+
+    Record* record = recordAt(_used);
+    record->fileSize = size;
+    record->length = length;
+    record->capacity = capacity;
+    record->filled = 0;
+    record->modified = modified;
+    record->crc = 0;
+    record->lastUse = ++_clock;
+    record->id = _nextId++;
+    if (_nextId == NONE) ++_nextId;
+    record->references = 1;
+    record->pathLength = path.size();
+    record->gzip = gzip;
+    record->stale = false;
+    memcpy(record->path(), path.data(), path.size());
+    _used += length;
+
+    return record->id;
+}
+
+void FileCache::fill(uint16_t id, uint64_t offset, const char* data, size_t length) {
+    Record* record = find(id);
+    if (!record || record->complete() || record->stale) return;
+
+    if (offset != record->filled) {
+        record->stale = true; // the file is being read out of order, it won't be filled in
+        return;
+    }
+    size_t count = std::min<size_t>(length, record->capacity - record->filled);
+    memcpy(record->data() + record->filled, data, count);
+    record->filled += count;
+    if (record->complete() && record->capacity == record->fileSize) {
+        record->crc = updateCRC32C(0, record->data(), record->capacity);
+    }
+}
+
+size_t FileCache::read(uint16_t id, uint64_t offset, char* out, size_t length) const {
+    Record* record = find(id);
+    if (!record || offset >= record->filled) return 0;
+
+    size_t count = std::min<uint64_t>(length, record->filled - offset);
+    memcpy(out, record->data() + offset, count);
+
+    return count;
+}
+
+bool FileCache::holdsWholeFile(uint16_t id) const {
+    Record* record = find(id);
+
+    return record && record->complete() && record->capacity == record->fileSize;
+}
+
+bool FileCache::digest(uint16_t id, uint32_t& crc) const {
+    if (!holdsWholeFile(id)) return false;
+
+    crc = find(id)->crc;
+    return true;
+}
+
+void FileCache::invalidate(std::string_view directory) {
+    directory = normalizeDirectory(directory);
+    for (size_t offset = 0; offset < _used;) {
+        Record* record = recordAt(offset);
+        if (parentDirectory(std::string_view(record->path(), record->pathLength)) == directory) {
+            record->stale = true;
+            if (record->references == 0) {
+                remove(record); // the next record moves to this offset
+                continue;
+            }
+        }
+        offset += record->length;
+    }
+}
+
+void FileCache::invalidateAll() {
+    for (size_t offset = 0; offset < _used;) {
+        Record* record = recordAt(offset);
+        record->stale = true;
+        if (record->references == 0) {
+            remove(record);
+            continue;
+        }
+        offset += record->length;
+    }
+}
+
+size_t FileCache::recordLength(size_t payloadLength) {
+    size_t length = sizeof(Record) + payloadLength;
+    return (length + alignof(Record) - 1) / alignof(Record) * alignof(Record);
+}
+
+uint32_t FileCache::hashPath(std::string_view path, bool gzip) {
+    char suffix = gzip;
+    return updateCRC32C(updateCRC32C(0, path.data(), path.size()), &suffix, 1);
+}
+
+// Whether the file is in the list of large files asked for recently. It's
+// taken out if so and added, pushing out the oldest, if not.
+bool FileCache::seenRecently(std::string_view path, bool gzip) {
+    if (SDSERVER_FILE_CACHE_GHOST_ENTRIES == 0) return true;
+
+    uint32_t hash = hashPath(path, gzip);
+    uint32_t* end = _ghosts + _ghostCount;
+    uint32_t* ghost = std::find(_ghosts, end, hash);
+    if (ghost != end) {
+        std::copy(ghost + 1, end, ghost);
+        --_ghostCount;
+        return true;
+    }
+    if (_ghostCount == SDSERVER_FILE_CACHE_GHOST_ENTRIES) {
+        std::copy(_ghosts + 1, end, _ghosts);
+        --_ghostCount;
+    }
+    _ghosts[_ghostCount++] = hash;
+
+    return false;
+}
+
+// The entry of a file that's cached or being filled in, if any
+FileCache::Record* FileCache::find(std::string_view path, bool gzip) const {
+    for (size_t offset = 0; offset < _used;) {
+        Record* record = recordAt(offset);
+        if (!record->stale && record->gzip == gzip && std::string_view(record->path(), record->pathLength) == path) {
+            return record;
+        }
+        offset += record->length;
+    }
+
+    return nullptr;
+}
+
+FileCache::Record* FileCache::find(uint16_t id) const {
+    if (id == NONE) return nullptr;
+
+    for (size_t offset = 0; offset < _used;) {
+        Record* record = recordAt(offset);
+        if (record->id == id) return record;
+        offset += record->length;
+    }
+
+    return nullptr;
+}
+
+FileCache::Record* FileCache::recordAt(size_t offset) const {
+    return reinterpret_cast<Record*>(_buffer + offset);
+}
+
+// Evicts entries nobody is using, stale ones first and then by size-adjusted
+// LRU, until length more bytes fit at the end of the buffer.
+bool FileCache::makeRoom(size_t length) {
+    while (_used + length > _size) {
+        Record* victim = nullptr;
+        uint64_t victimCost = 0;
+        for (size_t offset = 0; offset < _used;) {
+            Record* record = recordAt(offset);
+            uint64_t cost = (uint64_t)(_clock - record->lastUse) * record->length;
+            if (record->references == 0 &&
+                (!victim || (record->stale && !victim->stale) || (record->stale == victim->stale && cost > victimCost))) {
+                victim = record;
+                victimCost = cost;
+            }
+            offset += record->length;
+        }
+        if (!victim) return false;
+        remove(victim);
+    }
+
+    return true;
+}
+
+void FileCache::remove(Record* record) {
+    char* begin = reinterpret_cast<char*>(record);
+    size_t length = record->length;
+    char* end = begin + length;
+    memmove(begin, end, _buffer + _used - end);
+    _used -= length;
+}
@@ -0,0 +1,116 @@
+/* MIT License
+
+Copyright (c) 2023 Kenny Riddile
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#ifndef FILECACHE_H
+#define FILECACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+// Most bytes of one file kept by the file cache. Smaller files are kept
+// whole, larger ones only up to here.
+#ifndef SDSERVER_FILE_CACHE_ENTRY_SIZE
+#define SDSERVER_FILE_CACHE_ENTRY_SIZE 4096
+#endif
+
+// Files larger than an entry that were asked for recently but not cached.
+// Such a file only gets an entry for its leading block the second time; 0
+// admits them the first time.
+#ifndef SDSERVER_FILE_CACHE_GHOST_ENTRIES
+#define SDSERVER_FILE_CACHE_GHOST_ENTRIES 8
+#endif
+
+// Keeps the contents of small files, and the leading block of larger ones,
+// in a caller-provided buffer, so a file that's requested over and over is
+// sent from RAM instead of being read from the card every time.
+//
+// An entry is filled as its file is first sent and only served once it's
+// complete. It's keyed by path and checked against the file's size and
+// modification time, which the server has to read from the directory entry
+// anyway. Entries are packed one after another in the buffer and referred to
+// by id. Every connection sending from an entry holds a reference to it, so
+// an entry that is invalidated or evicted while in use stays in place until
+// released. When room is needed, the entries nobody is using are evicted by
+// size-adjusted LRU: the one whose size times the time since it was last used
+// is largest goes first, so a big entry has to be used more often than a
+// small one to stay. A file larger than an entry is only admitted once it's
+// been asked for again while still in a short list of recently seen ones, so
+// one-off downloads of big files don't push the small hot ones out.
+class FileCache {
+public:
+    static const uint16_t NONE = 0;
+
+    void begin(char* buffer, size_t size);
+    bool enabled() const { return _size != 0; }
+
+    // Returns the complete entry of the file at path with a reference held,
+    // or NONE when there is none or the file has changed since. gzip selects
+    // the file's .gz sidecar.
+    uint16_t acquire(std::string_view path, bool gzip, uint64_t size, uint32_t modified);
+    void release(uint16_t id);
+
+    // Starts an entry for the file at path and returns it with a reference
+    // held, or NONE when it's already cached, doesn't fit, or is a large file
+    // that hasn't been asked for recently. The entry is
+    // filled by the file's data as it's read from the start, and dropped on
+    // release if it was never completed.
+    uint16_t beginFill(std::string_view path, bool gzip, uint64_t size, uint32_t modified);
+    // Adds data read at offset in the file. Data from anywhere but the end of
+    // what the entry holds so far ends the fill.
+    void fill(uint16_t id, uint64_t offset, const char* data, size_t length);
+
+    // Copies up to length bytes of the file from offset and returns how many
+    // were cached, 0 once offset is past the entry.
+    size_t read(uint16_t id, uint64_t offset, char* out, size_t length) const;
+    // Whether the complete entry holds the whole file, and its CRC32C if so
+    bool holdsWholeFile(uint16_t id) const;
+    bool digest(uint16_t id, uint32_t& crc) const;
+
+    // Stops serving the files in directory, e.g. when a file is written in
+    // it. The empty string is the root directory.
+    void invalidate(std::string_view directory);
+    void invalidateAll();
+
+private:
+    struct Record;
+
+    static size_t recordLength(size_t payloadLength);
+    static uint32_t hashPath(std::string_view path, bool gzip);
+    bool seenRecently(std::string_view path, bool gzip);
+    Record* find(std::string_view path, bool gzip) const;
+    Record* find(uint16_t id) const;
+    Record* recordAt(size_t offset) const;
+    bool makeRoom(size_t length);
+    void remove(Record* record);
+
+    char* _buffer = nullptr;
+    size_t _size = 0;
+    size_t _used = 0;
+    uint16_t _nextId = 1;
+    uint32_t _clock = 0; // counts uses, for the age of entries
+    uint32_t _ghosts[SDSERVER_FILE_CACHE_GHOST_ENTRIES > 0 ? SDSERVER_FILE_CACHE_GHOST_ENTRIES : 1];
+    size_t _ghostCount = 0; // oldest first
+};
+
+#endif
@@ -0,0 +1,230 @@
+/* MIT License
+
+Copyright (c) 2023 Kenny Riddile
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#include "GzipDeflater.h"
+
+#include <cstring>
+
+#include "HTTPResponseWriter.h"
+
+static const uint16_t LENGTH_BASES[] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t LENGTH_EXTRA_BITS[] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint16_t DISTANCE_BASES[] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const uint8_t DISTANCE_EXTRA_BITS[] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+// CRC-32 as used by gzip, a nibble at a time
+static const uint32_t CRC_TABLE[] = {
+    0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+    0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+};
+
+static uint32_t updateCRC(uint32_t crc, const uint8_t* data, size_t length) {
+    crc = ~crc;
+    for (size_t i = 0; i < length; ++i) {
+        crc ^= data[i];
+        crc = (crc >> 4) ^ CRC_TABLE[crc & 0xF];
+        crc = (crc >> 4) ^ CRC_TABLE[crc & 0xF];
+    }
+
+    return ~crc;
+}
+
+// Huffman codes go out most significant bit first, everything else least significant bit first
+static uint32_t reverseBits(uint32_t value, unsigned count) {
+    uint32_t reversed = 0;
+    for (unsigned i = 0; i < count; ++i, value >>= 1) {
+        reversed = (reversed << 1) | (value & 1);
+    }
+
+    return reversed;
+}
+
+void GzipDeflater::begin(HTTPResponseWriter& out) {
+    _out = &out;
+    memset(_head, 0, sizeof(_head));
+    memset(_prev, 0, sizeof(_prev));
+    _position = 0;
+    _end = 0;
+    _bitBuffer = 0;
+    _bitCount = 0;
+    _crc = 0;
+    _inputLength = 0;
+    _outputLength = 0;
+
+    // Member header: deflate, no flags, no modification time, unknown OS
+    static const uint8_t header[] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 0xff };
+    memcpy(_output, header, sizeof(header));
+    _outputLength = sizeof(header);
+
+    // The whole stream is one final block using the fixed codes
+    putBits(1, 1);
+    putBits(1, 2);
+}
+
+void GzipDeflater::write(const char* data, size_t length) {
+    while (length) {
+        if (_end == sizeof(_window)) {
+            // Slide the window down, compress() always leaves _position past its middle
+            memmove(_window, _window + WINDOW_SIZE, WINDOW_SIZE);
+            _position -= WINDOW_SIZE;
+            _end -= WINDOW_SIZE;
+            for (uint16_t& entry : _head) entry = entry > WINDOW_SIZE ? entry - WINDOW_SIZE : 0;
+            for (uint16_t& entry : _prev) entry = entry > WINDOW_SIZE ? entry - WINDOW_SIZE : 0;
+        }
+
+        size_t count = sizeof(_window) - _end;
+        if (count > length) count = length;
+        memcpy(_window + _end, data, count);
+        _crc = updateCRC(_crc, _window + _end, count);
+        _inputLength += count;
+        _end += count;
+        data += count;
+        length -= count;
+
+        compress(false);
+    }
+    flushOutput();
+}
+
+void GzipDeflater::finish() {
+    compress(true);
+    putSymbol(256); // end of block
+    if (_bitCount) {
+        putBits(0, 8 - _bitCount);
+    }
+
+    // Trailer: CRC-32 and input length, both little-endian
+    for (uint32_t value : { _crc, _inputLength }) {
+        putBits(value & 0xFFFF, 16);
+        putBits(value >> 16, 16);
+    }
+    flushOutput();
+}
+
+// Codes input with greedy matching. Unless flushing, positions are only coded
+// once a full maximum-length match could be compared at them, so the output
+// doesn't depend on how the input was split up.
+void GzipDeflater::compress(bool flush) {
+    while (_position < _end && (flush || _end - _position >= MAX_MATCH)) {
+        size_t available = _end - _position;
+        size_t maxLength = available < MAX_MATCH ? available : MAX_MATCH;
+        size_t bestLength = 0;
+        size_t bestDistance = 0;
+        if (available >= MIN_MATCH) {
+            size_t hash = ((_window[_position] << 6) ^ (_window[_position + 1] << 3) ^ _window[_position + 2]) & (HASH_SIZE - 1);
+            size_t candidate = _head[hash];
+            _prev[_position & (WINDOW_SIZE - 1)] = candidate;
+            _head[hash] = _position + 1;
+
+            for (size_t chain = 0; candidate && chain < MAX_CHAIN; ++chain) {
+                size_t match = candidate - 1;
+                // Older positions' chain entries have been overwritten
+                if (match >= _position || _position - match >= WINDOW_SIZE) break;
+
+                size_t length = 0;
+                while (length < maxLength && _window[match + length] == _window[_position + length]) ++length;
+                if (length > bestLength) {
+                    bestLength = length;
+                    bestDistance = _position - match;
+                    if (length == maxLength) break;
+                }
+                candidate = _prev[match & (WINDOW_SIZE - 1)];
+            }
+        }
+
+        if (bestLength >= MIN_MATCH) {
+            putMatch(bestLength, bestDistance);
+            for (size_t i = 1; i < bestLength; ++i) {
+                insertHash(_position + i);
+            }
+            _position += bestLength;
+        } else {
+            putSymbol(_window[_position]);
+            ++_position;
+        }
+    }
+}
+
+void GzipDeflater::insertHash(size_t position) {
+    if (_end - position < MIN_MATCH) return;
+
+    size_t hash = ((_window[position] << 6) ^ (_window[position + 1] << 3) ^ _window[position + 2]) & (HASH_SIZE - 1);
+    _prev[position & (WINDOW_SIZE - 1)] = _head[hash];
+    _head[hash] = position + 1;
+}
+
+void GzipDeflater::putBits(uint32_t value, unsigned count) {
+    _bitBuffer |= value << _bitCount;
+    _bitCount += count;
+    while (_bitCount >= 8) {
+        if (_outputLength == sizeof(_output)) {
+            flushOutput();
+        }
+        _output[_outputLength++] = _bitBuffer & 0xFF;
+        _bitBuffer >>= 8;
+        _bitCount -= 8;
+    }
+}
+
+// Writes a literal/length symbol with its fixed Huffman code
+void GzipDeflater::putSymbol(unsigned symbol) {
+    if (symbol < 144) {
+        putBits(reverseBits(0x30 + symbol, 8), 8);
+    } else if (symbol < 256) {
+        putBits(reverseBits(0x190 + symbol - 144, 9), 9);
+    } else if (symbol < 280) {
+        putBits(reverseBits(symbol - 256, 7), 7);
+    } else {
+        putBits(reverseBits(0xC0 + symbol - 280, 8), 8);
+    }
+}
+
+void GzipDeflater::putMatch(size_t length, size_t distance) {
+    unsigned code = sizeof(LENGTH_BASES) / sizeof(LENGTH_BASES[0]) - 1;
+    while (LENGTH_BASES[code] > length) --code;
+    putSymbol(257 + code);
+    putBits(length - LENGTH_BASES[code], LENGTH_EXTRA_BITS[code]);
+
+    code = sizeof(DISTANCE_BASES) / sizeof(DISTANCE_BASES[0]) - 1;
+    while (DISTANCE_BASES[code] > distance) --code;
+    putBits(reverseBits(code, 5), 5);
+    putBits(distance - DISTANCE_BASES[code], DISTANCE_EXTRA_BITS[code]);
+}
+
+void GzipDeflater::flushOutput() {
+    if (_outputLength == 0) return;
+
+    _out->write(reinterpret_cast<const char*>(_output), _outputLength);
+    _outputLength = 0;
+}
@@ -0,0 +1,87 @@
+/* MIT License
+
+Copyright (c) 2023 Kenny Riddile
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#ifndef GZIPDEFLATER_H
+#define GZIPDEFLATER_H
+
+#include <cstddef>
+#include <cstdint>
+
+class HTTPResponseWriter;
+
+// Bytes of history searched for repeated strings when compressing generated
+// responses. A power of two of at least 512. The deflater needs about four
+// times this much RAM.
+#ifndef SDSERVER_DEFLATE_WINDOW_SIZE
+#define SDSERVER_DEFLATE_WINDOW_SIZE 1024
+#endif
+
+// Streams data through a small fixed-memory deflate compressor and writes it
+// as gzip. Repeated strings are found with hash chains over the last
+// SDSERVER_DEFLATE_WINDOW_SIZE bytes and coded with the fixed Huffman codes,
+// so there are no code tables to build or buffer. That's a poor fit for
+// arbitrary data but does well on generated HTML, which is mostly the same
+// few strings over and over.
+//
+// Up to 258 bytes of input are held back to look for matches, so output
+// trails input until finish() is called.
+class GzipDeflater {
+public:
+    static const size_t WINDOW_SIZE = SDSERVER_DEFLATE_WINDOW_SIZE;
+    static_assert(WINDOW_SIZE >= 512 && (WINDOW_SIZE & (WINDOW_SIZE - 1)) == 0 && WINDOW_SIZE <= 32768,
+                  "SDSERVER_DEFLATE_WINDOW_SIZE must be a power of two from 512 to 32768");
+
+    // Starts a gzip stream written to out.
+    void begin(HTTPResponseWriter& out);
+    void write(const char* data, size_t length);
+    // Compresses whatever input is held back and writes the gzip trailer.
+    void finish();
+
+private:
+    static const size_t MIN_MATCH = 3;
+    static const size_t MAX_MATCH = 258;
+    static const size_t HASH_BITS = 9;
+    static const size_t HASH_SIZE = 1 << HASH_BITS;
+    static const size_t MAX_CHAIN = 16; // candidates compared per position
+
+    void compress(bool flush);
+    void insertHash(size_t position);
+    void putBits(uint32_t value, unsigned count);
+    void putSymbol(unsigned symbol);
+    void putMatch(size_t length, size_t distance);
+    void flushOutput();
+
+    HTTPResponseWriter* _out = nullptr;
+    uint8_t _window[2 * WINDOW_SIZE]; // history followed by input not yet compressed
+    uint16_t _head[HASH_SIZE];        // latest position + 1 for each hash, 0 for none
+    uint16_t _prev[WINDOW_SIZE];      // previous position + 1 with the same hash
+    size_t _position = 0;             // next byte to compress
+    size_t _end = 0;                  // end of the input in the window
+    uint32_t _bitBuffer = 0;
+    unsigned _bitCount = 0;
+    uint32_t _crc = 0;
+    uint32_t _inputLength = 0;
+    uint8_t _output[64];
+    size_t _outputLength = 0;
+};
+
+#endif
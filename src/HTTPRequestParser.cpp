@@ -0,0 +1,394 @@
+/* MIT License
+
+Copyright (c) 2023 Kenny Riddile
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#include "HTTPRequestParser.h"
+
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+
+static const char* const HEADER_NAMES[] = {
+    "accept-encoding",
+    "connection",
+    "content-length",
+    "content-type",
+    "expect",
+    "if-modified-since",
+    "if-none-match",
+    "if-range",
+    "last-event-id",
+    "range",
+    "transfer-encoding",
+    "x-content-crc32c"
+};
+
+static_assert(sizeof(HEADER_NAMES) / sizeof(HEADER_NAMES[0]) == static_cast<size_t>(HTTPRequestParser::Header::Count),
+              "every kept header needs a name");
+
+static bool equalsIgnoreCase(const char* text, size_t length, const char* lowercase) {
+    for (size_t i = 0; i < length; ++i) {
+        if (!lowercase[i] || tolower((unsigned char)text[i]) != lowercase[i]) return false;
+    }
+    return lowercase[length] == '\0';
+}
+
+static int hexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    c = tolower((unsigned char)c);
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+size_t percentDecode(char* text, size_t length, bool plusAsSpace) {
+    size_t decodedLength = 0;
+    for (size_t i = 0; i < length; ++i) {
+        char c = text[i];
+        if (c == '%' && i + 2 < length) {
+            int high = hexValue(text[i + 1]);
+            int low = hexValue(text[i + 2]);
+            if (high >= 0 && low >= 0) {
+                c = static_cast<char>(high << 4 | low);
+                i += 2;
+            }
+        } else if (c == '+' && plusAsSpace) {
+            c = ' ';
+        }
+        text[decodedLength++] = c;
+    }
+
+    return decodedLength;
+}
+
+bool headerHasToken(std::string_view value, const char* token) {
+    size_t tokenLength = strlen(token);
+    while (!value.empty()) {
+        size_t comma = value.find(',');
+        std::string_view item = value.substr(0, comma);
+        while (!item.empty() && (item.front() == ' ' || item.front() == '\t')) item.remove_prefix(1);
+        while (!item.empty() && (item.back() == ' ' || item.back() == '\t')) item.remove_suffix(1);
+        if (item.size() == tokenLength && equalsIgnoreCase(item.data(), tokenLength, token)) return true;
+        if (comma == value.npos) break;
+        value.remove_prefix(comma + 1);
+    }
+
+    return false;
+}
+
+bool headerHasETag(std::string_view value, std::string_view etag) {
+    while (!value.empty()) {
+        size_t comma = value.find(',');
+        std::string_view item = value.substr(0, comma);
+        while (!item.empty() && (item.front() == ' ' || item.front() == '\t')) item.remove_prefix(1);
+        while (!item.empty() && (item.back() == ' ' || item.back() == '\t')) item.remove_suffix(1);
+        if (item == "*") return true;
+        if (item.size() > 2 && item[0] == 'W' && item[1] == '/') item.remove_prefix(2);
+        if (item == etag) return true;
+        if (comma == value.npos) break;
+        value.remove_prefix(comma + 1);
+    }
+
+    return false;
+}
+
+void HTTPRequestParser::begin(char* buffer, size_t size) {
+    _buffer = buffer;
+    _size = size;
+    beginNext(nullptr, 0);
+}
+
+void HTTPRequestParser::beginNext(const char* pending, size_t length) {
+    if (length) {
+        memmove(_buffer, pending, length);
+    }
+    _length = length;
+    _scanPos = 0;
+    _lineBegin = 0;
+    _headLength = 0;
+    _state = State::RequestLine;
+    _status = Status::Incomplete;
+    _method = Method::Unsupported;
+    _isHTTP11 = false;
+    _hasContentLength = false;
+    _contentLength = 0;
+    _target = nullptr;
+    _targetLength = 0;
+    _path = std::string_view();
+    _queryParameterCount = 0;
+    for (auto& header : _headers) {
+        header = std::string_view();
+    }
+}
+
+HTTPRequestParser::Status HTTPRequestParser::parse(size_t bytesAdded) {
+    _length += bytesAdded;
+    if (_state == State::Done) return _status;
+
+    while (_scanPos < _length) {
+        char* lineEnd = static_cast<char*>(memchr(_buffer + _scanPos, '\n', _length - _scanPos));
+        if (!lineEnd) {
+            _scanPos = _length;
+            break;
+        }
+
+        char* line = _buffer + _lineBegin;
+        size_t lineLength = lineEnd - line;
+        size_t nextLine = lineEnd + 1 - _buffer;
+        if (lineLength && line[lineLength - 1] == '\r') {
+            --lineLength;
+        }
+        line[lineLength] = '\0'; // replaces the \r or \n
+
+        bool keep = true;
+        if (_state == State::RequestLine) {
+            if (lineLength == 0) {
+                keep = false; // blank lines before a request line are ignored
+            } else {
+                _status = parseRequestLine(line, lineLength);
+                _state = State::Headers;
+            }
+        } else if (lineLength == 0) {
+            _headLength = nextLine;
+            _scanPos = nextLine;
+            _status = finishHead();
+        } else {
+            _status = parseHeaderLine(line, lineLength, keep);
+        }
+
+        if (_status != Status::Incomplete) {
+            _state = State::Done;
+            return _status;
+        }
+
+        if (keep) {
+            _lineBegin = nextLine;
+            _scanPos = nextLine;
+        } else {
+            // Drop the line by pulling the unscanned bytes down over it
+            memmove(_buffer + _lineBegin, _buffer + nextLine, _length - nextLine);
+            _length -= nextLine - _lineBegin;
+            _scanPos = _lineBegin;
+        }
+    }
+
+    if (_length == _size) {
+        // The line being read can't fit
+        _state = State::Done;
+        _status = _target ? Status::HeadersTooLarge : Status::URITooLong;
+        return _status;
+    }
+
+    return Status::Incomplete;
+}
+
+HTTPRequestParser::Status HTTPRequestParser::parseRequestLine(char* line, size_t length) {
+    char* methodEnd = static_cast<char*>(memchr(line, ' ', length));
+    if (!methodEnd) return Status::BadRequest;
+    char* target = methodEnd + 1;
+    char* targetEnd = static_cast<char*>(memchr(target, ' ', line + length - target));
+    if (!targetEnd || targetEnd == target) return Status::BadRequest;
+    const char* version = targetEnd + 1;
+
+    size_t methodLength = methodEnd - line;
+    static const struct {
+        const char* name;
+        Method method;
+    } methods[] = {
+        { "GET", Method::GET },
+        { "HEAD", Method::HEAD },
+        { "POST", Method::POST },
+        { "PUT", Method::PUT },
+        { "PATCH", Method::PATCH },
+        { "DELETE", Method::DELETE }
+    };
+    for (const auto& entry : methods) {
+        if (strlen(entry.name) == methodLength && memcmp(entry.name, line, methodLength) == 0) {
+            _method = entry.method;
+            break;
+        }
+    }
+
+    if (strncmp(version, "HTTP/1.", 7) != 0 || !isdigit((unsigned char)version[7]) || version[8] != '\0') {
+        return Status::BadRequest;
+    }
+    _isHTTP11 = version[7] != '0';
+
+    *targetEnd = '\0';
+    _target = target;
+    _targetLength = targetEnd - target;
+
+    return Status::Incomplete;
+}
+
+HTTPRequestParser::Status HTTPRequestParser::parseHeaderLine(char* line, size_t length, bool& keep) {
+    char* colon = static_cast<char*>(memchr(line, ':', length));
+    if (!colon || colon == line) return Status::BadRequest;
+
+    size_t nameLength = colon - line;
+    size_t header = 0;
+    for (; header < static_cast<size_t>(Header::Count); ++header) {
+        if (equalsIgnoreCase(line, nameLength, HEADER_NAMES[header])) break;
+    }
+    if (header == static_cast<size_t>(Header::Count)) {
+        keep = false;
+        return Status::Incomplete;
+    }
+
+    char* value = colon + 1;
+    char* valueEnd = line + length;
+    while (value < valueEnd && (*value == ' ' || *value == '\t')) ++value;
+    while (valueEnd > value && (valueEnd[-1] == ' ' || valueEnd[-1] == '\t')) --valueEnd;
+    *valueEnd = '\0';
+    _headers[header] = std::string_view(value, valueEnd - value);
+
+    if (header == static_cast<size_t>(Header::ContentLength)) {
+        if (value == valueEnd) return Status::BadRequest;
+        uint64_t contentLength = 0;
+        for (const char* digit = value; digit < valueEnd; ++digit) {
+            if (!isdigit((unsigned char)*digit)) return Status::BadRequest;
+            if (contentLength > (UINT64_MAX - (*digit - '0')) / 10) return Status::BadRequest;
+            contentLength = contentLength * 10 + (*digit - '0');
+        }
+        if (_hasContentLength && contentLength != _contentLength) return Status::BadRequest;
+        _hasContentLength = true;
+        _contentLength = contentLength;
+    }
+
+    return Status::Incomplete;
+}
+
+HTTPRequestParser::Status HTTPRequestParser::finishHead() {
+    if (!_target) return Status::BadRequest;
+    if (hasHeader(Header::TransferEncoding) && _hasContentLength) return Status::BadRequest;
+
+    if (_target[0] != '/') {
+        // Absolute-form targets ("http://host/path") are reduced to their path
+        char* authority = strstr(_target, "://");
+        char* path = authority ? strchr(authority + 3, '/') : nullptr;
+        if (!path) return Status::BadRequest;
+        _targetLength -= path - _target;
+        _target = path;
+    }
+
+    char* query = static_cast<char*>(memchr(_target, '?', _targetLength));
+    size_t pathLength = query ? query - _target : _targetLength;
+    if (query) {
+        *query++ = '\0';
+        if (!parseQuery(query, _target + _targetLength)) return Status::BadRequest;
+    }
+    pathLength = percentDecode(_target, pathLength, false);
+    _target[pathLength] = '\0';
+    _path = std::string_view(_target, pathLength);
+
+    return Status::Complete;
+}
+
+// Splits the query into parameters first and then decodes each name and
+// value in place, null-terminated. Returns false when there are too many.
+bool HTTPRequestParser::parseQuery(char* query, char* end) {
+    while (query < end) {
+        char* parameterEnd = static_cast<char*>(memchr(query, '&', end - query));
+        if (!parameterEnd) parameterEnd = end;
+        if (parameterEnd != query) {
+            if (_queryParameterCount == SDSERVER_MAX_QUERY_PARAMETERS) return false;
+
+            QueryParameter& parameter = _queryParameters[_queryParameterCount++];
+            char* equals = static_cast<char*>(memchr(query, '=', parameterEnd - query));
+            size_t nameLength = percentDecode(query, (equals ? equals : parameterEnd) - query, true);
+            query[nameLength] = '\0';
+            parameter.name = std::string_view(query, nameLength);
+            if (equals) {
+                char* value = equals + 1;
+                size_t valueLength = percentDecode(value, parameterEnd - value, true);
+                value[valueLength] = '\0';
+                parameter.value = std::string_view(value, valueLength);
+            } else {
+                parameter.value = std::string_view(query + nameLength, 0); // bare, so empty but present
+            }
+        }
+        query = parameterEnd + 1;
+    }
+
+    return true;
+}
+
+bool HTTPRequestParser::keepAlive() const {
+    // HTTP/1.1 connections persist unless either side asks to close them
+    return _isHTTP11 && !headerHasToken(header(Header::Connection), "close");
+}
+
+bool HTTPRequestParser::expectsContinue() const {
+    return _isHTTP11 && headerHasToken(header(Header::Expect), "100-continue");
+}
+
+bool HTTPRequestParser::acceptsEncoding(const char* coding) const {
+    std::string_view value = header(Header::AcceptEncoding);
+    size_t codingLength = strlen(coding);
+    while (!value.empty()) {
+        size_t comma = value.find(',');
+        std::string_view item = value.substr(0, comma);
+        size_t semicolon = item.find(';');
+        std::string_view name = item.substr(0, semicolon);
+        while (!name.empty() && (name.front() == ' ' || name.front() == '\t')) name.remove_prefix(1);
+        while (!name.empty() && (name.back() == ' ' || name.back() == '\t')) name.remove_suffix(1);
+        if (name.size() == codingLength && equalsIgnoreCase(name.data(), codingLength, coding)) {
+            // "q=0", "q=0.0" and so on refuse the coding
+            if (semicolon == item.npos) return true;
+            std::string_view parameters = item.substr(semicolon + 1);
+            size_t q = parameters.find("q=");
+            if (q == parameters.npos) return true;
+            for (char c : parameters.substr(q + 2)) {
+                if (c >= '1' && c <= '9') return true;
+                if (c != '0' && c != '.') break;
+            }
+            return false;
+        }
+        if (comma == value.npos) break;
+        value.remove_prefix(comma + 1);
+    }
+
+    return false;
+}
+
+std::string_view HTTPRequestParser::queryParameter(std::string_view name) const {
+    for (size_t i = 0; i < _queryParameterCount; ++i) {
+        if (_queryParameters[i].name == name) return _queryParameters[i].value;
+    }
+
+    return std::string_view();
+}
+
+std::string_view HTTPRequestParser::boundary() const {
+    std::string_view contentType = header(Header::ContentType);
+    size_t parameter = contentType.find("boundary=");
+    if (parameter == contentType.npos) return std::string_view();
+
+    std::string_view boundary = contentType.substr(parameter + 9); // 9 == strlen("boundary=")
+    if (!boundary.empty() && boundary.front() == '"') {
+        boundary.remove_prefix(1);
+        boundary = boundary.substr(0, boundary.find('"'));
+    } else {
+        boundary = boundary.substr(0, boundary.find_first_of("; \t"));
+    }
+
+    return boundary;
+}
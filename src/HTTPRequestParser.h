@@ -0,0 +1,174 @@
+/* MIT License
+
+Copyright (c) 2023 Kenny Riddile
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#ifndef HTTPREQUESTPARSER_H
+#define HTTPREQUESTPARSER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+// Query parameters a request may carry. More than this is a bad request.
+#ifndef SDSERVER_MAX_QUERY_PARAMETERS
+#define SDSERVER_MAX_QUERY_PARAMETERS 8
+#endif
+
+// Incremental parser for the request line and headers of an HTTP/1.x request.
+//
+// Bytes are read straight into the caller's buffer in bulk and each call to
+// parse() only scans what's new, so a head split across any number of TCP
+// segments parses the same as one that arrives whole. Headers the server
+// uses are kept as null-terminated views into the buffer. Every other header
+// line is dropped as soon as it's complete, so requests carrying large
+// headers the server doesn't care about still fit.
+class HTTPRequestParser {
+public:
+    enum class Method : uint8_t {
+        Unsupported,
+        GET,
+        HEAD,
+        POST,
+        PUT,
+        PATCH,
+        DELETE
+    };
+
+    // Headers kept by the parser. Add new entries before Count and to the
+    // name table in HTTPRequestParser.cpp.
+    enum class Header : uint8_t {
+        AcceptEncoding,
+        Connection,
+        ContentLength,
+        ContentType,
+        Expect,
+        IfModifiedSince,
+        IfNoneMatch,
+        IfRange,
+        LastEventID,
+        Range,
+        TransferEncoding,
+        ContentCRC32C,
+        Count
+    };
+
+    enum class Status : uint8_t {
+        Incomplete,
+        Complete,
+        BadRequest,
+        URITooLong,
+        HeadersTooLarge
+    };
+
+    // Starts parsing a new request into buffer.
+    void begin(char* buffer, size_t size);
+
+    // Starts parsing the next request on the same connection. Bytes that were
+    // received after the previous request, such as a pipelined request, are
+    // moved to the front of the buffer and parsed by the next call to parse().
+    void beginNext(const char* pending, size_t length);
+
+    // Where to read more of the request, and how much room is left there.
+    char* freeSpace() const { return _buffer + _length; }
+    size_t freeSpaceSize() const { return _size - _length; }
+
+    // Scans bytesAdded newly read bytes, along with any bytes carried over by
+    // beginNext(). Once the head is complete, further bytes are left alone.
+    Status parse(size_t bytesAdded);
+
+    Status status() const { return _status; }
+    // Bytes of the request held in the buffer, and whether any haven't been scanned yet.
+    size_t bufferedLength() const { return _length; }
+    bool hasUnscannedData() const { return _scanPos < _length; }
+
+    Method method() const { return _method; }
+    // Percent-decoded and null-terminated.
+    std::string_view path() const { return _path; }
+    // The value of name=value in the query, empty for a bare name, or a view
+    // with a null data() if the query doesn't have it. Names and values are
+    // decoded separately, so an escaped '&' or '=' is part of them.
+    std::string_view queryParameter(std::string_view name) const;
+    bool isHTTP11() const { return _isHTTP11; }
+    bool keepAlive() const;
+
+    bool hasHeader(Header header) const { return _headers[static_cast<size_t>(header)].data() != nullptr; }
+    // Null-terminated with surrounding whitespace trimmed, or empty if absent.
+    std::string_view header(Header header) const { return _headers[static_cast<size_t>(header)]; }
+    bool hasContentLength() const { return _hasContentLength; }
+    uint64_t contentLength() const { return _contentLength; }
+    bool expectsContinue() const;
+    // Whether Accept-Encoding lists coding without q=0.
+    bool acceptsEncoding(const char* coding) const;
+    // The boundary parameter of a multipart Content-Type, without quotes.
+    std::string_view boundary() const;
+
+    // Bytes received after the end of the head: the start of the body, or
+    // the next pipelined request.
+    std::string_view pending() const { return std::string_view(_buffer + _headLength, _length - _headLength); }
+
+private:
+    enum class State : uint8_t {
+        RequestLine,
+        Headers,
+        Done
+    };
+
+    Status parseRequestLine(char* line, size_t length);
+    Status parseHeaderLine(char* line, size_t length, bool& keep);
+    Status finishHead();
+    bool parseQuery(char* query, char* end);
+
+    char* _buffer = nullptr;
+    size_t _size = 0;
+    size_t _length = 0;     // bytes in the buffer
+    size_t _scanPos = 0;    // first byte not yet scanned for a line ending
+    size_t _lineBegin = 0;  // start of the line being read
+    size_t _headLength = 0; // bytes up to and including the blank line ending the head
+    State _state = State::RequestLine;
+    Status _status = Status::Incomplete;
+    Method _method = Method::Unsupported;
+    bool _isHTTP11 = false;
+    bool _hasContentLength = false;
+    uint64_t _contentLength = 0;
+    char* _target = nullptr;
+    size_t _targetLength = 0;
+    std::string_view _path;
+    struct QueryParameter {
+        std::string_view name;
+        std::string_view value;
+    };
+    QueryParameter _queryParameters[SDSERVER_MAX_QUERY_PARAMETERS];
+    uint8_t _queryParameterCount = 0;
+    std::string_view _headers[static_cast<size_t>(Header::Count)];
+};
+
+// Decodes %XX escapes in place and returns the decoded length. With
+// plusAsSpace, '+' decodes to a space as in form-encoded query strings.
+size_t percentDecode(char* text, size_t length, bool plusAsSpace);
+
+// Checks whether a comma-separated header value lists the given token, ignoring case.
+bool headerHasToken(std::string_view value, const char* token);
+
+// Checks whether an If-None-Match value lists etag (given with its quotes) or
+// is "*". Uses weak comparison, so W/ prefixes are ignored.
+bool headerHasETag(std::string_view value, std::string_view etag);
+
+#endif
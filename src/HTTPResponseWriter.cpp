@@ -0,0 +1,184 @@
+/* MIT License
+
+Copyright (c) 2023 Kenny Riddile
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#include "HTTPResponseWriter.h"
+#include "ServerMetrics.h"
+
+#include <algorithm>
+
+#include <WiFi.h>
+
+static const char HEX_DIGITS[] = "0123456789abcdef";
+
+void HTTPResponseWriter::begin(WiFiClient& client, char* buffer, size_t size) {
+    // What the same client didn't take of the last flush goes out first
+    if (&client != _client || buffer != _buffer) {
+        _length = 0;
+    }
+    _client = &client;
+    _buffer = buffer;
+    _size = size;
+    _chunked = false;
+    _chunkOpen = false;
+    _failed = false;
+    _bytesWritten = 0;
+    _status = 0;
+
+    // Enough hex digits for a chunk that fills the whole buffer
+    _chunkDigits = 1;
+    while (_chunkDigits < 2 * sizeof(size_t) && (size >> (4 * _chunkDigits)) != 0) {
+        ++_chunkDigits;
+    }
+}
+
+void HTTPResponseWriter::discard() {
+    _length = 0;
+    _chunked = false;
+    _chunkOpen = false;
+}
+
+void HTTPResponseWriter::write(const char* data, size_t length) {
+    while (length && !_failed) {
+        size_t space = freeSpaceSize();
+        if (space == 0) {
+            flush();
+            _failed = freeSpaceSize() == 0; // the client has stopped taking data
+            continue;
+        }
+        size_t count = std::min(space, length);
+        memcpy(freeSpace(), data, count);
+        _length += count;
+        data += count;
+        length -= count;
+    }
+}
+
+void HTTPResponseWriter::println(std::string_view text) {
+    if (text.size() >= 12 && text.compare(0, 9, "HTTP/1.1 ") == 0) {
+        _status = (text[9] - '0') * 100 + (text[10] - '0') * 10 + (text[11] - '0');
+    }
+    print(text);
+    write("\r\n", 2);
+}
+
+void HTTPResponseWriter::print(uint64_t number) {
+    char digits[20];
+    size_t count = 0;
+    do {
+        digits[count++] = '0' + number % 10;
+        number /= 10;
+    } while (number);
+    std::reverse(digits, digits + count);
+    write(digits, count);
+}
+
+char* HTTPResponseWriter::freeSpace() {
+    if (_chunked && !_chunkOpen && !_failed) {
+        openChunk();
+    }
+
+    return _buffer + _length;
+}
+
+size_t HTTPResponseWriter::freeSpaceSize() {
+    if (_chunked && !_chunkOpen) {
+        openChunk();
+    }
+    if (_failed) return 0;
+
+    size_t reserved = _chunked ? 2 : 0; // the CRLF that closes the chunk
+    if (_length + reserved >= _size) return 0;
+
+    return _size - _length - reserved;
+}
+
+void HTTPResponseWriter::beginChunked() {
+    _chunked = true;
+    _chunkOpen = false;
+}
+
+void HTTPResponseWriter::endChunked() {
+    if (_chunkOpen) {
+        closeChunk();
+    }
+    _chunked = false;
+    print("0\r\n\r\n");
+}
+
+void HTTPResponseWriter::openChunk() {
+    // The chunk-size line plus at least one byte of data and the closing CRLF have to fit
+    if (_length + _chunkDigits + 2 + 1 + 2 > _size) {
+        flush();
+        if (_length + _chunkDigits + 2 + 1 + 2 > _size) {
+            _failed = true;
+            return;
+        }
+    }
+    _chunkBegin = _length;
+    _length += _chunkDigits + 2;
+    _chunkOpen = true;
+}
+
+void HTTPResponseWriter::closeChunk() {
+    _chunkOpen = false;
+    size_t dataBegin = _chunkBegin + _chunkDigits + 2;
+    size_t chunkLength = _length - dataBegin;
+    if (chunkLength == 0) {
+        _length = _chunkBegin; // an empty chunk would end the body
+        return;
+    }
+
+    char* sizeLine = _buffer + _chunkBegin;
+    for (size_t i = _chunkDigits; i-- > 0; chunkLength >>= 4) {
+        sizeLine[i] = HEX_DIGITS[chunkLength & 0xF];
+    }
+    sizeLine[_chunkDigits] = '\r';
+    sizeLine[_chunkDigits + 1] = '\n';
+    _buffer[_length++] = '\r';
+    _buffer[_length++] = '\n';
+}
+
+void HTTPResponseWriter::flush() {
+    if (_chunkOpen) {
+        closeChunk();
+    }
+    if (_length == 0) return;
+
+    unsigned long start = micros();
+    size_t written = 0;
+    while (written < _length) {
+        size_t count = _client->write(_buffer + written, _length - written);
+        if (count == 0) break;
+        written += count;
+    }
+#ifdef SDSERVER_DEBUG
+    Serial.write(_buffer, written);
+#endif
+    if (_metrics) {
+        _metrics->recordDuration(ServerMetrics::Duration::SocketWrite, micros() - start);
+        _metrics->addBytesSent(written);
+    }
+    _bytesWritten += written;
+    _length -= written;
+    memmove(_buffer, _buffer + written, _length);
+}
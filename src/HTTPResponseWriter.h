@@ -0,0 +1,105 @@
+/* MIT License
+
+Copyright (c) 2023 Kenny Riddile
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#ifndef HTTPRESPONSEWRITER_H
+#define HTTPRESPONSEWRITER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+class ServerMetrics;
+class WiFiClient;
+
+// Builds a response in a caller-provided buffer and hands it to the client
+// only when the buffer is full or flush() is called, so a status line and its
+// headers, or dozens of small listing fragments, leave as one write.
+//
+// Between beginChunked() and endChunked() the writer applies chunked
+// transfer coding itself: every flush emits the buffered bytes as one chunk.
+// The chunk-size line is reserved in front of the data, zero-padded to a
+// fixed width, so framing never costs an extra copy or write.
+//
+// Whatever the client doesn't take of a flush stays at the front of the
+// buffer and goes out first on the next flush, including after begin() with
+// the same client and buffer. If the buffer is full and the client takes
+// none of it, the rest of the response is dropped and failed() is set, so
+// the connection can be closed rather than left with a gap in its response.
+class HTTPResponseWriter {
+public:
+    void begin(WiFiClient& client, char* buffer, size_t size);
+    // Drops anything the client hasn't taken, e.g. when it's disconnected
+    void discard();
+    // Where to record the time and bytes of every write to the client. Kept across begin().
+    void setMetrics(ServerMetrics* metrics) { _metrics = metrics; }
+
+    void write(const char* data, size_t length);
+    void print(const char* text) { write(text, strlen(text)); }
+    void print(std::string_view text) { write(text.data(), text.size()); }
+    void print(uint64_t number);
+    void println(std::string_view text);
+    void println(const char* text = "") { println(std::string_view(text)); }
+    void println(uint64_t number) {
+        print(number);
+        write("\r\n", 2);
+    }
+
+    // Direct access to the free part of the buffer, for reading file data
+    // straight into it. Call commit() with the number of bytes filled in.
+    char* freeSpace();
+    size_t freeSpaceSize();
+    void commit(size_t length) { _length += length; }
+    size_t bufferedLength() const { return _length; }
+
+    void beginChunked();
+    void endChunked(); // buffers the last-chunk marker, flush() still has to be called
+
+    void flush();
+    bool writesTo(const WiFiClient& client) const { return _client == &client; }
+    bool failed() const { return _failed; }
+
+    // Total bytes the client took since begin()
+    uint64_t bytesWritten() const { return _bytesWritten; }
+    // Code of the last status line written since begin(), or 0 if none was
+    uint16_t status() const { return _status; }
+
+private:
+    void openChunk();
+    void closeChunk();
+
+    WiFiClient* _client = nullptr;
+    ServerMetrics* _metrics = nullptr;
+    char* _buffer = nullptr;
+    size_t _size = 0;
+    size_t _length = 0;
+    size_t _chunkBegin = 0;  // start of the reserved chunk-size line
+    uint8_t _chunkDigits = 0; // hex digits in the chunk-size line
+    bool _chunked = false;
+    bool _chunkOpen = false;
+    bool _failed = false;
+    uint64_t _bytesWritten = 0;
+    uint16_t _status = 0;
+};
+
+#endif
@@ -22,65 +22,324 @@ SOFTWARE. */
 
 #include "SDServer.h"
 
-#include <initializer_list>
+#include <algorithm>
 #include <string_view>
 
 #include <WiFi.h>
 
-static const char HTTP_200_OK[] = "HTTP/1.1 200 OK";
-static const char HTTP_303_REDIRECT[] = "HTTP/1.1 303 See Other\r\nLocation: /";
-static const char HTTP_404_NOT_FOUND[] = "HTTP/1.1 404 Not Found";
-static const char HTTP_CONTENT_TYPE[] = "Content-Type: ";
-static const char HTTP_CONTENT_LENGTH[] = "Content-Length: ";
-static const char HTTP_TRANSFER_ENCODING_CHUNKED[] = "Transfer-Encoding: chunked";
-static const char HTTP_CONNECTION_CLOSE[] = "Connection: close";
+static constexpr std::string_view HTTP_100_CONTINUE = "HTTP/1.1 100 Continue\r\n\r\n";
+static constexpr std::string_view HTTP_200_OK = "HTTP/1.1 200 OK";
+static constexpr std::string_view HTTP_201_CREATED = "HTTP/1.1 201 Created";
+static constexpr std::string_view HTTP_204_NO_CONTENT = "HTTP/1.1 204 No Content";
+static constexpr std::string_view HTTP_206_PARTIAL_CONTENT = "HTTP/1.1 206 Partial Content";
+static constexpr std::string_view HTTP_303_REDIRECT = "HTTP/1.1 303 See Other\r\nLocation: /";
+static constexpr std::string_view HTTP_304_NOT_MODIFIED = "HTTP/1.1 304 Not Modified";
+static constexpr std::string_view HTTP_400_BAD_REQUEST = "HTTP/1.1 400 Bad Request";
+static constexpr std::string_view HTTP_403_FORBIDDEN = "HTTP/1.1 403 Forbidden";
+static constexpr std::string_view HTTP_404_NOT_FOUND = "HTTP/1.1 404 Not Found";
+static constexpr std::string_view HTTP_405_METHOD_NOT_ALLOWED = "HTTP/1.1 405 Method Not Allowed\r\nAllow: GET, HEAD, POST, PUT, PATCH";
+static constexpr std::string_view HTTP_409_CONFLICT = "HTTP/1.1 409 Conflict";
+static constexpr std::string_view HTTP_411_LENGTH_REQUIRED = "HTTP/1.1 411 Length Required";
+static constexpr std::string_view HTTP_414_URI_TOO_LONG = "HTTP/1.1 414 URI Too Long";
+static constexpr std::string_view HTTP_416_RANGE_NOT_SATISFIABLE = "HTTP/1.1 416 Range Not Satisfiable";
+static constexpr std::string_view HTTP_431_HEADERS_TOO_LARGE = "HTTP/1.1 431 Request Header Fields Too Large";
+static constexpr std::string_view HTTP_500_INTERNAL_SERVER_ERROR = "HTTP/1.1 500 Internal Server Error";
+static constexpr std::string_view HTTP_503_SERVICE_UNAVAILABLE = "HTTP/1.1 503 Service Unavailable";
+static constexpr std::string_view HTTP_CONTENT_TYPE = "Content-Type: ";
+static constexpr std::string_view HTTP_CONTENT_LENGTH = "Content-Length: ";
+static constexpr std::string_view HTTP_CONTENT_RANGE = "Content-Range: bytes ";
+static constexpr std::string_view HTTP_ACCEPT_RANGES_BYTES = "Accept-Ranges: bytes";
+static constexpr std::string_view HTTP_ETAG = "ETag: ";
+static constexpr std::string_view HTTP_LAST_MODIFIED = "Last-Modified: ";
+static constexpr std::string_view HTTP_CACHE_CONTROL = "Cache-Control: ";
+static constexpr std::string_view HTTP_CONTENT_ENCODING_GZIP = "Content-Encoding: gzip";
+static constexpr std::string_view HTTP_VARY_ACCEPT_ENCODING = "Vary: Accept-Encoding";
+static constexpr std::string_view HTTP_CACHE_CONTROL_NO_CACHE = "Cache-Control: no-cache";
+static constexpr std::string_view HTTP_TRANSFER_ENCODING_CHUNKED = "Transfer-Encoding: chunked";
+static constexpr std::string_view HTTP_CONNECTION_CLOSE = "Connection: close";
+static constexpr std::string_view HTTP_CONNECTION_KEEP_ALIVE = "Connection: keep-alive";
+static constexpr std::string_view HTTP_UPLOAD_OFFSET = "Upload-Offset: ";
+static constexpr std::string_view HTTP_CONTENT_CRC32C = "X-Content-CRC32C: ";
 
 /*void printStringView(std::string_view stringView, const char* prefix = "") {
     Serial.printf("%s%.*s", prefix, stringView.length(), stringView.begin());
 }*/
 
-void clientPrint(const char* string, WiFiClient& client) {
-#ifdef SDSERVER_DEBUG
-    Serial.print(string);
-#endif
-    client.print(string);
+void sendHTMLResponse(std::string_view responseStatusLine, HTTPResponseWriter& response, bool keepAlive = false) {
+    response.println(responseStatusLine);
+    response.print(HTTP_CONTENT_TYPE);
+    response.println("text/html");
+    response.print(HTTP_CONTENT_LENGTH);
+    response.println("0");
+    response.println(keepAlive ? HTTP_CONNECTION_KEEP_ALIVE : HTTP_CONNECTION_CLOSE);
+    response.println();
 }
 
-void clientPrint(size_t number, int base, WiFiClient& client) {
-#ifdef SDSERVER_DEBUG
-    Serial.print(number, base);
-#endif
-    client.print(number, base);
+// Answers a finished upload with an empty page, or nothing at all for a 204,
+// along with the CRC32C of what was received when there is one
+void sendUploadResponse(std::string_view responseStatusLine, HTTPResponseWriter& response, bool keepAlive, const char* digest = nullptr) {
+    response.println(responseStatusLine);
+    if (digest) {
+        response.print(HTTP_CONTENT_CRC32C);
+        response.println(digest);
+    }
+    if (responseStatusLine != HTTP_204_NO_CONTENT) { // a 204 has no body, not even an empty one
+        response.print(HTTP_CONTENT_TYPE);
+        response.println("text/html");
+        response.print(HTTP_CONTENT_LENGTH);
+        response.println("0");
+    }
+    response.println(keepAlive ? HTTP_CONNECTION_KEEP_ALIVE : HTTP_CONNECTION_CLOSE);
+    response.println();
 }
 
-void clientPrintln(const char* string, WiFiClient& client) {
-#ifdef SDSERVER_DEBUG
-    Serial.println(string);
-#endif
-    client.print(string);
-    client.print("\r\n");
+// Formats a decimal number without relying on printf's 64-bit support.
+// out must hold at least 21 bytes.
+char* formatDecimal(uint64_t value, char* out) {
+    char digits[20];
+    size_t count = 0;
+    do {
+        digits[count++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    for (size_t i = 0; i < count; ++i) {
+        out[i] = digits[count - 1 - i];
+    }
+    out[count] = '\0';
+
+    return out;
+}
+
+static const char* const DAY_NAMES[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+static const char* const MONTH_NAMES[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+// Formats a FAT modification date and time as an HTTP date such as
+// "Sun, 06 Nov 1994 08:49:37 GMT". FAT timestamps carry no time zone, so
+// they're taken to be UTC. out must hold at least 30 bytes. Returns false for
+// files without a valid timestamp.
+bool formatHTTPDate(uint16_t fatDate, uint16_t fatTime, char* out) {
+    int year = 1980 + (fatDate >> 9);
+    int month = (fatDate >> 5) & 0xF;
+    int day = fatDate & 0x1F;
+    if (month < 1 || month > 12 || day < 1) return false;
+
+    // Sakamoto's day of the week
+    static const int monthOffsets[] = { 0, 3, 2, 5, 0, 3, 5, 1, 4, 6, 2, 4 };
+    int y = month < 3 ? year - 1 : year;
+    int weekday = (y + y / 4 - y / 100 + y / 400 + monthOffsets[month - 1] + day) % 7;
+
+    snprintf(out, 30, "%s, %02d %s %04d %02d:%02d:%02d GMT", DAY_NAMES[weekday], day, MONTH_NAMES[month - 1], year,
+             fatTime >> 11, (fatTime >> 5) & 0x3F, 2 * (fatTime & 0x1F));
+
+    return true;
+}
+
+// Parses an HTTP date in the preferred "Sun, 06 Nov 1994 08:49:37 GMT" form
+// into a packed FAT date and time, which orders chronologically.
+bool parseHTTPDate(std::string_view text, uint32_t& fatDateTime) {
+    char monthName[4];
+    int day, year, hour, minute, second;
+    char date[32];
+    if (text.size() >= sizeof(date)) return false;
+    memcpy(date, text.data(), text.size());
+    date[text.size()] = '\0';
+    if (sscanf(date, "%*3s, %d %3s %d %d:%d:%d GMT", &day, monthName, &year, &hour, &minute, &second) != 6) return false;
+
+    int month = 0;
+    while (month < 12 && strcmp(monthName, MONTH_NAMES[month]) != 0) ++month;
+    if (month == 12 || year < 1980) return false;
+    if (year > 2107) year = 2107; // the last year a FAT date can hold
+
+    uint16_t fatDate = ((year - 1980) << 9) | ((month + 1) << 5) | day;
+    uint16_t fatTime = (hour << 11) | (minute << 5) | (second / 2);
+    fatDateTime = (uint32_t)fatDate << 16 | fatTime;
+
+    return true;
+}
+
+// Formats a strong ETag from a file's size and FAT modification date and
+// time, e.g. "1f4-56e28a3c". out must hold at least 28 bytes.
+void formatFileETag(uint64_t size, uint16_t fatDate, uint16_t fatTime, char* out) {
+    static const char HEX_DIGITS[] = "0123456789abcdef";
+    char digits[16];
+    size_t count = 0;
+    do {
+        digits[count++] = HEX_DIGITS[size & 0xF];
+        size >>= 4;
+    } while (size);
+
+    *out++ = '"';
+    while (count) *out++ = digits[--count];
+    *out++ = '-';
+    uint32_t dateTime = (uint32_t)fatDate << 16 | fatTime;
+    for (int shift = 28; shift >= 0; shift -= 4) {
+        *out++ = HEX_DIGITS[(dateTime >> shift) & 0xF];
+    }
+    *out++ = '"';
+    *out = '\0';
+}
+
+// Formats a CRC32C as 8 hex digits. out must hold at least 9 bytes.
+char* formatCRC32C(uint32_t crc, char* out) {
+    static const char HEX_DIGITS[] = "0123456789abcdef";
+    for (int i = 0; i < 8; ++i) {
+        out[i] = HEX_DIGITS[(crc >> (28 - 4 * i)) & 0xF];
+    }
+    out[8] = '\0';
+
+    return out;
+}
+
+// Parses a CRC32C given as 8 hex digits in either case
+bool parseCRC32C(std::string_view text, uint32_t& crc) {
+    if (text.size() != 8) return false;
+
+    uint32_t result = 0;
+    for (char c : text) {
+        int value = c >= '0' && c <= '9' ? c - '0' : (c | 0x20) >= 'a' && (c | 0x20) <= 'f' ? (c | 0x20) - 'a' + 10 : -1;
+        if (value < 0) return false;
+        result = result << 4 | value;
+    }
+    crc = result;
+
+    return true;
+}
+
+// A file's FAT modification date and time as one number, date in the high half
+uint32_t fileModified(FsFile& file) {
+    uint16_t fatDate = 0, fatTime = 0;
+    file.getModifyDateTime(&fatDate, &fatTime);
+    return (uint32_t)fatDate << 16 | fatTime;
+}
+
+// Whether name in directory is the digest store. It's the server's own
+// bookkeeping, so it's left out of listings and requests can't write it.
+bool isDigestStore(std::string_view directory, std::string_view name) {
+    std::string_view store = SDSERVER_DIGEST_STORE_PATH;
+    while (!store.empty() && store.front() == '/') store.remove_prefix(1);
+    while (!directory.empty() && directory.front() == '/') directory.remove_prefix(1);
+    while (!directory.empty() && directory.back() == '/') directory.remove_suffix(1);
+    if (directory.empty()) return name == store;
+
+    return store.size() == directory.size() + 1 + name.size() && store.substr(0, directory.size()) == directory &&
+        store[directory.size()] == '/' && store.substr(directory.size() + 1) == name;
 }
 
-void sendHTMLResponse(const char* responseStatusLine, WiFiClient& client) {
-    clientPrintln(responseStatusLine, client);
-    clientPrint(HTTP_CONTENT_TYPE, client);
-    clientPrintln("text/html", client);
-    clientPrint(HTTP_CONTENT_LENGTH, client);
-    clientPrintln("0", client);
-    clientPrintln(HTTP_CONNECTION_CLOSE, client);
-    clientPrintln("", client);
+bool isDigestStore(std::string_view path) {
+    size_t slash = path.rfind('/');
+    if (slash == path.npos) return isDigestStore(std::string_view(), path);
+
+    return isDigestStore(path.substr(0, slash), path.substr(slash + 1));
+}
+
+// A PUT is written under the target's name plus this suffix and only renamed
+// over the target once the whole body has arrived
+static constexpr std::string_view UPLOAD_TEMP_SUFFIX = ".part";
+
+// A resumable upload session is kept under the target's name plus this suffix
+static constexpr std::string_view UPLOAD_SESSION_SUFFIX = ".upload";
+
+// Separates the parts of a multipart/byteranges response
+static constexpr std::string_view BYTERANGES_BOUNDARY = "SDSERVER_BYTERANGES_7d41a5";
+
+enum class RangeSpec {
+    End,
+    Invalid,
+    Unsatisfiable,
+    Satisfiable
+};
+
+// Reads the next range-spec from the list that follows "bytes=" in a Range
+// header and resolves it against the file size.
+RangeSpec nextByteRange(const char*& cursor, uint64_t fileSize, uint64_t& first, uint64_t& last) {
+    while (*cursor == ' ' || *cursor == '\t' || *cursor == ',') ++cursor;
+    if (!*cursor) return RangeSpec::End;
+
+    const char* p = cursor;
+    char* end;
+    bool isSuffix = *p == '-';
+    uint64_t rangeBegin = 0;
+    if (!isSuffix) {
+        if (!isdigit((unsigned char)*p)) return RangeSpec::Invalid;
+        rangeBegin = strtoull(p, &end, 10);
+        p = end;
+    }
+    if (*p++ != '-') return RangeSpec::Invalid;
+    bool hasRangeEnd = isdigit((unsigned char)*p);
+    uint64_t rangeEnd = 0;
+    if (hasRangeEnd) {
+        rangeEnd = strtoull(p, &end, 10);
+        p = end;
+    }
+    while (*p == ' ' || *p == '\t') ++p;
+    if (*p && *p != ',') return RangeSpec::Invalid;
+    cursor = p;
+
+    if (isSuffix) {
+        if (!hasRangeEnd) return RangeSpec::Invalid;
+        if (rangeEnd == 0 || fileSize == 0) return RangeSpec::Unsatisfiable;
+        first = rangeEnd >= fileSize ? 0 : fileSize - rangeEnd;
+        last = fileSize - 1;
+        return RangeSpec::Satisfiable;
+    }
+    if (hasRangeEnd && rangeEnd < rangeBegin) return RangeSpec::Invalid;
+    if (rangeBegin >= fileSize) return RangeSpec::Unsatisfiable;
+    first = rangeBegin;
+    last = hasRangeEnd && rangeEnd < fileSize ? rangeEnd : fileSize - 1;
+    return RangeSpec::Satisfiable;
 }
 
-const char* combinedStrLenAsHex(std::initializer_list<const char*> args) {
-    static char buffer[5]; // max decimal value of 65535 including null terminator
+// The range-specs of a Range header, or nullptr if there's none in a unit we support
+const char* byteRanges(const HTTPRequestParser& request) {
+    std::string_view range = request.header(HTTPRequestParser::Header::Range);
+    if (range.size() < 6 || strncasecmp(range.data(), "bytes=", 6) != 0) return nullptr;
 
+    return range.data() + 6;
+}
+
+// Writes the delimiter and headers that introduce one part of a
+// multipart/byteranges response and returns their length. out must hold at
+// least 160 bytes and isn't null-terminated.
+size_t formatRangePartHeader(char* out, uint64_t first, uint64_t last, uint64_t fileSize) {
+    char digits[21];
     size_t length = 0;
-    for (auto arg : args) {
-        length += strlen(arg);
+    auto append = [out, &length](std::string_view text) {
+        memcpy(out + length, text.data(), text.size());
+        length += text.size();
+    };
+    append("\r\n--");
+    append(BYTERANGES_BOUNDARY);
+    append("\r\nContent-Type: application/octet-stream\r\n");
+    append(HTTP_CONTENT_RANGE);
+    append(formatDecimal(first, digits));
+    append("-");
+    append(formatDecimal(last, digits));
+    append("/");
+    append(formatDecimal(fileSize, digits));
+    append("\r\n\r\n");
+
+    return length;
+}
+
+// Parses an optional decimal query parameter; absent or empty leaves value alone.
+bool parseDecimal(std::string_view text, uint64_t& value) {
+    if (text.empty()) return true;
+    if (text.size() > 19) return false;
+
+    uint64_t result = 0;
+    for (char c : text) {
+        if (c < '0' || c > '9') return false;
+        result = result * 10 + (c - '0');
     }
-    sprintf(buffer, "%x", length);
+    value = result;
+
+    return true;
+}
 
-    return buffer;
+// Where a file starts on the card if it's contiguous, otherwise 0
+uint32_t contiguousFirstSector(FsFile& file) {
+    uint32_t firstSector, lastSector;
+    return file.contiguousRange(&firstSector, &lastSector) ? firstSector : 0;
 }
 
 bool requiresURLEncoding(const char* str) {
@@ -96,93 +355,199 @@ bool requiresURLEncoding(const char* str) {
     return false;
 }
 
-void readToBoundary(WiFiClient& client) {
-    const char* needle = "boundary=";
+// Directory entries read per handleClient() call while listing, so a slow
+// card can't stall the other connections. A streamed listing also stops as
+// soon as one buffer of it has been handed to the client, or before the next
+// entry might not fit in what the client can take, so a write isn't short.
+static const size_t LISTING_ENTRIES_PER_CALL = 32;
 
-    size_t index = 0;
-    while (client.connected()) {
-        char c = client.read();
-        if ((c == needle[0] && index == 0) ||
-            (c == needle[1] && index == 1) ||
-            (c == needle[2] && index == 2) ||
-            (c == needle[3] && index == 3) ||
-            (c == needle[4] && index == 4) ||
-            (c == needle[5] && index == 5) ||
-            (c == needle[6] && index == 6) ||
-            (c == needle[7] && index == 7)) {
-            ++index;
-        } else if (c == needle[8] && index == 8) {
-            break;
-        } else {
-            index = 0;
-        }
-    }
-}
+// Most bytes one rendered listing entry takes besides its directory path: a
+// 255-byte name, escaped for JSON and URL-encoded in its link, and the markup.
+// A step waits until the client can take at least a typical entry.
+static const size_t LISTING_ENTRY_RESERVE = 6 * 255 + 3 * 256 + 128;
+static const size_t LISTING_ENTRY_TYPICAL = 512;
 
-// Read until \r\n\r\n
-void readToBody(WiFiClient& client) {
-    size_t index = 0;
-    while (client.connected()) {
-        char c = client.read();
-        if (c == '\r' && index == 0) {
-            index = 1;
-        } else if (c == '\n' && index == 1) {
-            index = 2;
-        } else if (c == '\r' && index == 2) {
-            index = 3;
-        } else if (c == '\n' && index == 3) {
-            break;
-        } else {
-            index = 0;
-        }
-    }
-}
+// File bytes read per handleClient() call while working out a digest
+static const size_t DIGEST_BYTES_PER_CALL = 16384;
+
+static constexpr std::string_view HTML_START = "<!DOCTYPE html><html><head><link rel=\"icon\" href=\"data:image/png;base64,iVBORw0KGgoAAAANSUhEUgAAAAEAAAABCAIAAACQd1PeAAAADElEQVQI12P4//8/AAX+Av7czFnnAAAAAElFTkSuQmCC\"></head><body><form method=\"post\" enctype=\"multipart/form-data\"><label>Upload file to this folder: </label><br/><input type=\"file\" name=\"file\" required/><br/><input type=\"submit\"/></form><br/>";
+static constexpr std::string_view HTML_END = "</body></html>\n";
 
 int SDServer::readHeaderValue(multipart_parser* p, const char* at, size_t length) {
-    SDServer* self = static_cast<SDServer*>(multipart_parser_get_data(p));
-    if (self->_headerBufferPos + length > self->_workingBufferSize) {
-        length = self->_workingBufferSize - self->_headerBufferPos;
+    Connection* connection = static_cast<Connection*>(multipart_parser_get_data(p));
+    // Header values may grow up to any body bytes still waiting at the back of the buffer
+    size_t bufferSize = connection->inputBegin < connection->inputEnd ? connection->inputBegin : sizeof(connection->buffer);
+    --bufferSize; // leave room for a null terminator
+    if (connection->bufferPos + length > bufferSize) {
+        length = connection->bufferPos < bufferSize ? bufferSize - connection->bufferPos : 0;
     }
-    std::copy(at, at + length, self->_workingBuffer + self->_headerBufferPos);
-    self->_headerBufferPos += length;
+    std::copy(at, at + length, connection->buffer + connection->bufferPos);
+    connection->bufferPos += length;
 
     return 0;
 }
 
 int SDServer::readPartData(multipart_parser* p, const char* at, size_t length) {
-    SDServer* self = static_cast<SDServer*>(multipart_parser_get_data(p));
-    if (self->_fileBeingWritten.isOpen()) {
-        self->_fileBeingWritten.write(at, length);
-        self->_fileBeingWritten.sync();
+    Connection* connection = static_cast<Connection*>(multipart_parser_get_data(p));
+    if (connection->file.isOpen()) {
+        connection->server->writeUploadData(*connection, at, length);
     }
 
     return 0;
 }
 
 int SDServer::onHeadersComplete(multipart_parser* p) {
-    SDServer* self = static_cast<SDServer*>(multipart_parser_get_data(p));
-    std::string_view headerValues(self->_workingBuffer, self->_headerBufferPos);
+    Connection* connection = static_cast<Connection*>(multipart_parser_get_data(p));
+    SDServer* self = connection->server;
+    char* buffer = connection->buffer;
+    size_t directoryPathLength = connection->headerValuesBegin - 1;
+    std::string_view headerValues(buffer + connection->headerValuesBegin, connection->bufferPos - connection->headerValuesBegin);
     const char* needle = "filename=\"";
-    auto fileNameBegin = headerValues.find(needle) + 10; // 10 == strlen(needle)
+    auto fileNameBegin = headerValues.find(needle);
     if (fileNameBegin != headerValues.npos) {
+        fileNameBegin += 10; // 10 == strlen(needle)
         auto fileNameEnd = headerValues.find('"', fileNameBegin);
-        self->_workingBuffer[fileNameEnd] = '\0';
-        strcat(self->_workingBuffer, self->_workingBuffer + fileNameBegin); // prepend directory path stored at the front of self->_workingBuffer
-        self->_fileBeingWritten = self->_fs->open(self->_workingBuffer, FILE_WRITE);
-        self->_fileBeingWritten.truncate(0); // overwrite any existing file with the same name
+        if (fileNameEnd != headerValues.npos) {
+            // Append the file name to the directory path stored at the front of the buffer
+            size_t fileNameLength = fileNameEnd - fileNameBegin;
+            if (isDigestStore(std::string_view(buffer, directoryPathLength), headerValues.substr(fileNameBegin, fileNameLength))) {
+                connection->bufferPos = connection->headerValuesBegin;
+                return 0; // the part's data is dropped
+            }
+            self->invalidateDirectory(std::string_view(buffer, directoryPathLength));
+            memmove(buffer + directoryPathLength, headerValues.data() + fileNameBegin, fileNameLength);
+            buffer[directoryPathLength + fileNameLength] = '\0';
+            connection->file = self->_fs->open(buffer, FILE_WRITE);
+            connection->file.truncate(0); // overwrite any existing file with the same name
+            connection->digesting = connection->file.isOpen();
+            connection->digest = 0;
+            buffer[directoryPathLength] = '\0';
+
+            // The rest of the body is an upper bound on the file size
+            self->prepareUploadFile(*connection, connection->bodyRemaining);
+        }
     }
+    connection->bufferPos = connection->headerValuesBegin;
 
     return 0;
 }
 
 int SDServer::onPartDataEnd(multipart_parser* p) {
-    SDServer* self = static_cast<SDServer*>(multipart_parser_get_data(p));
-    if (self->_fileBeingWritten.isOpen()) {
-        self->_fileBeingWritten.close();
+    Connection* connection = static_cast<Connection*>(multipart_parser_get_data(p));
+    SDServer* self = connection->server;
+    if (connection->file.isOpen()) {
+        // Put the file name back after the directory path to record the digest under
+        char* buffer = connection->buffer;
+        size_t directoryPathLength = connection->headerValuesBegin - 1;
+        size_t bufferSize = connection->inputBegin < connection->inputEnd ? connection->inputBegin : sizeof(connection->buffer);
+        bool named = connection->digesting &&
+            connection->file.getName(buffer + directoryPathLength, bufferSize - directoryPathLength) != 0;
+        self->endUploadFile(*connection);
+        if (named) {
+            self->storeDigest(buffer, connection->digest);
+        }
+        buffer[directoryPathLength] = '\0';
+        connection->digesting = false;
+    }
+    connection->bufferPos = connection->headerValuesBegin;
+
+    return 0;
+}
+
+#if SDSERVER_ENABLE_ARCHIVES
+int SDServer::onArchiveMember(TarReader* reader, TarReader::Type type, uint64_t size) {
+    Connection* connection = static_cast<Connection*>(reader->data());
+    SDServer* self = connection->server;
+    char* path = connection->buffer; // the target directory, with the member's path appended by the reader
+    char* memberPath = path + connection->headerValuesBegin;
+
+    // Member paths are relative, so "./" and "/" in front are dropped and ".." is refused
+    size_t length = strlen(memberPath);
+    size_t skip = 0;
+    while (memberPath[skip] == '/' || (memberPath[skip] == '.' && memberPath[skip + 1] == '/')) {
+        skip += memberPath[skip] == '/' ? 1 : 2;
+    }
+    length -= skip;
+    memmove(memberPath, memberPath + skip, length + 1);
+    while (length != 0 && memberPath[length - 1] == '/') {
+        memberPath[--length] = '\0';
+    }
+    bool safe = length != 0;
+    for (const char* component = memberPath; safe && *component; ) {
+        size_t componentLength = strcspn(component, "/");
+        safe = !(componentLength == 2 && component[0] == '.' && component[1] == '.');
+        component += componentLength + (component[componentLength] == '/');
+    }
+    safe = safe && !isDigestStore(path);
+
+    if (type == TarReader::Type::Other) {
+        ++self->_skippedMembers;
+        return 0;
+    }
+    if (type == TarReader::Type::Directory && length == 0 && skip != 0) return 0; // "./", the target directory itself
+    if (!safe) {
+        self->recordExtractFailure(*connection);
+        return 0;
+    }
+
+    if (type == TarReader::Type::Directory) {
+        FsFile directory = self->_fs->open(path);
+        if (directory.isDirectory() || (!directory && self->_fs->mkdir(path, true))) {
+            ++self->_extractedMembers;
+        } else {
+            self->recordExtractFailure(*connection);
+        }
+        return 0;
+    }
+
+    connection->file = self->_fs->open(path, FILE_WRITE);
+    if (!connection->file) {
+        // Archives needn't list a member's directories before it
+        char* slash = strrchr(memberPath, '/');
+        if (slash) {
+            *slash = '\0';
+            self->_fs->mkdir(path, true);
+            *slash = '/';
+            connection->file = self->_fs->open(path, FILE_WRITE);
+        }
+    }
+    if (!connection->file) {
+        self->recordExtractFailure(*connection);
+        return 0;
+    }
+    connection->file.truncate(0);
+    self->prepareUploadFile(*connection, size);
+    self->_extractMemberSize = size;
+
+    return 0;
+}
+
+int SDServer::onArchiveData(TarReader* reader, const char* at, size_t length) {
+    Connection* connection = static_cast<Connection*>(reader->data());
+    if (connection->file.isOpen()) {
+        connection->server->writeUploadData(*connection, at, length);
+    }
+
+    return 0;
+}
+
+int SDServer::onArchiveMemberEnd(TarReader* reader) {
+    Connection* connection = static_cast<Connection*>(reader->data());
+    SDServer* self = connection->server;
+    if (!connection->file.isOpen()) return 0;
+
+    self->flushUploadData(*connection);
+    if (connection->file.curPosition() == self->_extractMemberSize) {
+        self->endUploadFile(*connection);
+        ++self->_extractedMembers;
+    } else {
+        self->discardUploadFile(*connection); // the card is full
+        self->recordExtractFailure(*connection);
     }
 
     return 0;
 }
+#endif
 
 void SDServer::begin(
     WiFiServer* server,
@@ -197,6 +562,11 @@ void SDServer::begin(
     _multipartParserCallbacks.on_part_data = readPartData;
     _multipartParserCallbacks.on_headers_complete = onHeadersComplete;
     _multipartParserCallbacks.on_part_data_end = onPartDataEnd;
+#if SDSERVER_ENABLE_ARCHIVES
+    _archiveCallbacks.onMember = onArchiveMember;
+    _archiveCallbacks.onData = onArchiveData;
+    _archiveCallbacks.onMemberEnd = onArchiveMemberEnd;
+#endif
 
     _server = server;
     _fs = fs;
@@ -204,163 +574,2432 @@ void SDServer::begin(
     _workingBufferSize = workingBufferSize;
     _uploadStreamingBuffer = uploadStreamingBuffer;
     _uploadStreamingBufferSize = uploadStreamingBufferSize;
+    _response.setMetrics(&_metrics);
+    _digests.begin(fs);
+    _directories.begin(fs);
+
+    for (Connection& connection : _connections) {
+        connection.server = this;
+    }
+#if SDSERVER_STORAGE_ON_SECOND_CORE
+    recursive_mutex_init(&_storageMutex);
+#endif
+}
+
+void SDServer::setKeepAlive(unsigned long idleTimeoutMs, size_t maxRequests) {
+    _keepAliveTimeout = idleTimeoutMs;
+    _keepAliveMaxRequests = maxRequests;
+}
+
+void SDServer::setUploadWriteBuffer(char* buffer, size_t size) {
+    _uploadWriteBuffer = buffer;
+    _uploadWriteBufferSize = size / 512 * 512;
+}
+
+void SDServer::setUploadSyncInterval(uint32_t syncIntervalBytes) {
+    _uploadSyncInterval = syncIntervalBytes;
+}
+
+void SDServer::setListingCache(char* buffer, size_t size) {
+    _listingCache.begin(buffer, size);
+}
+
+void SDServer::invalidateListings() {
+    _listingCache.invalidateAll();
+    _directories.invalidateAll();
+    _fileCache.invalidateAll();
+}
+
+void SDServer::setFileCache(char* buffer, size_t size) {
+    _fileCache.begin(buffer, size);
+}
+
+// Drops what's cached about a directory whose entries changed
+void SDServer::invalidateDirectory(std::string_view directory) {
+    _listingCache.invalidate(directory);
+    _directories.invalidate(directory);
+    _fileCache.invalidate(directory);
+}
+
+bool SDServer::setCacheControl(const char* pathPrefix, const char* value) {
+    for (size_t i = 0; i < _cacheControlRuleCount; ++i) {
+        if (strcmp(_cacheControlRules[i].pathPrefix, pathPrefix) == 0) {
+            _cacheControlRules[i].value = value;
+            return true;
+        }
+    }
+    if (_cacheControlRuleCount == SDSERVER_MAX_CACHE_CONTROL_RULES) return false;
+
+    _cacheControlRules[_cacheControlRuleCount++] = { pathPrefix, value };
+    return true;
+}
+
+void SDServer::setPipelineBuffer(char* buffer, size_t size) {
+    _pipeline.begin(buffer, size);
+}
+
+SDServer::StorageLock::StorageLock(SDServer& server, bool engaged) : _server(engaged ? &server : nullptr) {
+#if SDSERVER_STORAGE_ON_SECOND_CORE
+    if (_server) recursive_mutex_enter_blocking(&_server->_storageMutex);
+#endif
+}
+
+SDServer::StorageLock::~StorageLock() {
+#if SDSERVER_STORAGE_ON_SECOND_CORE
+    if (_server) recursive_mutex_exit(&_server->_storageMutex);
+#endif
 }
 
 void SDServer::handleClient() {
     if (!_server) return;
 
+    // Output a client didn't take all of holds the working buffer, so until
+    // it has gone out only that client's connection is serviced
+    Connection* holder = nullptr;
+    if (_response.bufferedLength() != 0) {
+        for (Connection& connection : _connections) {
+            if (connection.state != Connection::State::Free && _response.writesTo(connection.client)) {
+                holder = &connection;
+            }
+        }
+    }
+
+    if (!holder) {
+        acceptClient();
+    }
+#if !SDSERVER_STORAGE_ON_SECOND_CORE
+    serviceStorage();
+#endif
+
+    for (Connection& connection : _connections) {
+        if (connection.state != Connection::State::Free && (!holder || holder == &connection)) {
+            serviceConnection(connection);
+        }
+    }
+}
+
+void SDServer::acceptClient() {
     WiFiClient client = _server->available();
-    if (client) {
-        size_t index = 0;
-        while (client.connected()) {
-            if (client.available()) { // data is available to read from client
-                char c = client.read();
-                if (c != '\n' && c != '\r') {
-                    _workingBuffer[index++] = c;
-                    if (index > _workingBufferSize) {
-                        index = _workingBufferSize - 1;
-                    }
-                    continue;
+    if (!client) return;
+
+    // Take a free slot, or else the one that has waited longest for its next request
+    Connection* slot = nullptr;
+    for (Connection& connection : _connections) {
+        if (connection.state == Connection::State::Free) {
+            slot = &connection;
+            break;
+        }
+        if (connection.isIdle() && (!slot || connection.lastActivity < slot->lastActivity)) {
+            slot = &connection;
+        }
+    }
+
+    if (!slot) {
+        _response.begin(client, _workingBuffer, _workingBufferSize);
+        sendHTMLResponse(HTTP_503_SERVICE_UNAVAILABLE, _response);
+        _response.flush();
+        _response.discard();
+        client.stop();
+        return;
+    }
+
+    if (slot->state != Connection::State::Free) {
+        closeConnection(*slot);
+    }
+    slot->client = client;
+    slot->state = Connection::State::ReadingRequestHead;
+    slot->request.begin(slot->buffer, sizeof(slot->buffer));
+    slot->requestCount = 0;
+    slot->lastActivity = millis();
+}
+
+void SDServer::serviceConnection(Connection& connection) {
+    // Everything this step produces is coalesced in the working buffer
+    _response.begin(connection.client, _workingBuffer, _workingBufferSize);
+    if (!connection.client.connected()) {
+        closeConnection(connection);
+        return;
+    }
+
+    // What the client didn't take on an earlier pass goes out before anything new
+    bool progressed = false;
+    _response.flush();
+    if (_response.bufferedLength() == 0) {
+    // A pipelined transfer only moves data between the pipeline and the
+    // network here, so the other core can keep working the card meanwhile
+    StorageLock lock(*this, !isPipelined(connection));
+    switch (connection.state) {
+        case Connection::State::ReadingRequestHead:
+            progressed = readRequestHead(connection);
+            break;
+        case Connection::State::ReadingMultipartBody:
+#if SDSERVER_ENABLE_ARCHIVES
+        case Connection::State::ExtractingArchive:
+#endif
+            progressed = readUploadBody(connection);
+            break;
+        case Connection::State::ReadingFileBody:
+            progressed = readFileBody(connection);
+            break;
+        case Connection::State::SendingFile:
+            progressed = sendFileData(connection);
+            break;
+        case Connection::State::SendingListing:
+            progressed = sendListingEntries(connection);
+            break;
+        case Connection::State::SendingJSONListing:
+            progressed = sendJSONListingEntries(connection);
+            break;
+        case Connection::State::BuildingListing:
+            progressed = buildListingEntries(connection);
+            break;
+        case Connection::State::SendingCachedListing:
+            progressed = sendCachedListingData(connection);
+            break;
+        case Connection::State::FollowingFile:
+            progressed = sendFollowData(connection);
+            break;
+        case Connection::State::ComputingDigest:
+            progressed = computeDigest(connection);
+            break;
+#if SDSERVER_ENABLE_ARCHIVES
+        case Connection::State::SizingArchive:
+            progressed = sizeArchive(connection);
+            break;
+        case Connection::State::SendingArchive:
+            progressed = sendArchiveData(connection);
+            break;
+#endif
+        case Connection::State::Free:
+            break;
+    }
+    }
+    if (_response.status() != 0) {
+        connection.status = _response.status();
+    }
+    _response.flush();
+    if (_response.failed() && connection.state != Connection::State::Free) {
+        closeConnection(connection); // part of the response was dropped
+        return;
+    }
+
+    if (progressed || _response.bytesWritten() != 0) {
+        connection.lastActivity = millis();
+    } else if (connection.state != Connection::State::Free) {
+        unsigned long timeout = connection.isIdle() ? _keepAliveTimeout :
+            connection.state == Connection::State::FollowingFile ? SDSERVER_FOLLOW_IDLE_TIMEOUT_MS : SDSERVER_IDLE_TIMEOUT_MS;
+        if (millis() - connection.lastActivity > timeout) {
+            closeConnection(connection);
+        }
+    }
+}
+
+void SDServer::closeConnection(Connection& connection) {
+    recordRequest(connection);
+    StorageLock lock(*this);
+    _response.flush(); // a final response may still be buffered
+    if (_response.writesTo(connection.client)) {
+        _response.discard(); // whatever the client still hasn't taken goes with it
+    }
+    releasePipeline(connection);
+    if (connection.file.isOpen()) {
+        if (connection.state == Connection::State::ReadingMultipartBody || connection.sessionUpload) {
+            endUploadFile(connection); // keep what arrived of an interrupted upload, a session resumes from it
+        } else if (connection.state == Connection::State::ReadingFileBody || connection.isExtracting()) {
+            discardUploadFile(connection); // an interrupted PUT leaves the target untouched, and no member is left half written
+        } else {
+            connection.file.close();
+        }
+    }
+    releaseCachedFile(connection);
+    releaseListing(connection);
+    releaseArchive(connection);
+    connection.client.stop();
+    connection.client = WiFiClient();
+    connection.state = Connection::State::Free;
+}
+
+void SDServer::finishResponse(Connection& connection) {
+    recordRequest(connection);
+    StorageLock lock(*this);
+    releasePipeline(connection);
+    if (connection.file.isOpen()) {
+        connection.file.close();
+    }
+    releaseCachedFile(connection);
+    releaseListing(connection);
+    releaseArchive(connection);
+    if (!connection.keepAlive) {
+        closeConnection(connection);
+        return;
+    }
+
+    // Bytes already received after this request belong to the next one
+    connection.request.beginNext(connection.buffer + connection.inputBegin, connection.inputEnd - connection.inputBegin);
+    connection.state = Connection::State::ReadingRequestHead;
+    connection.lastActivity = millis();
+}
+
+bool SDServer::readRequestHead(Connection& connection) {
+    HTTPRequestParser& request = connection.request;
+    size_t bytesRead = 0;
+    int available = connection.client.available();
+    if (available > 0 && request.freeSpaceSize() != 0) {
+        int result = connection.client.read(reinterpret_cast<uint8_t*>(request.freeSpace()), std::min((size_t)available, request.freeSpaceSize()));
+        if (result > 0) {
+            bytesRead = result;
+            _metrics.addBytesReceived(result);
+        }
+    }
+    if (bytesRead == 0 && !request.hasUnscannedData()) return false;
+
+    std::string_view errorStatusLine;
+    switch (request.parse(bytesRead)) {
+        case HTTPRequestParser::Status::Incomplete:
+            break;
+        case HTTPRequestParser::Status::Complete:
+            handleRequest(connection);
+            break;
+        case HTTPRequestParser::Status::BadRequest:
+            errorStatusLine = HTTP_400_BAD_REQUEST;
+            break;
+        case HTTPRequestParser::Status::URITooLong:
+            errorStatusLine = HTTP_414_URI_TOO_LONG;
+            break;
+        case HTTPRequestParser::Status::HeadersTooLarge:
+            errorStatusLine = HTTP_431_HEADERS_TOO_LARGE;
+            break;
+    }
+    if (!errorStatusLine.empty()) {
+        connection.requestStart = micros();
+        connection.requestOpen = true;
+        sendHTMLResponse(errorStatusLine, _response);
+        closeConnection(connection);
+    }
+
+    return true;
+}
+
+void SDServer::handleRequest(Connection& connection) {
+    HTTPRequestParser& request = connection.request;
+    std::string_view pending = request.pending();
+    connection.inputBegin = pending.data() - connection.buffer;
+    connection.inputEnd = connection.inputBegin + pending.size();
+    connection.bodyRemaining = request.contentLength();
+    connection.requestStart = micros();
+    connection.requestOpen = true;
+    connection.status = 0;
+
+    ++connection.requestCount;
+    connection.gzipEncoded = false;
+    connection.sessionUpload = false;
+    connection.digesting = false;
+    connection.verifyDigest = false;
+    connection.keepAlive = request.keepAlive() && connection.requestCount < _keepAliveMaxRequests;
+    if (request.hasHeader(HTTPRequestParser::Header::TransferEncoding)) {
+        connection.keepAlive = false; // a body of unknown length, so the next request can't be found
+    }
+
+    switch (request.method()) {
+        case HTTPRequestParser::Method::GET:
+        case HTTPRequestParser::Method::HEAD:
+            connection.headOnly = request.method() == HTTPRequestParser::Method::HEAD;
+            if (connection.bodyRemaining != 0) {
+                connection.keepAlive = false; // don't try to find the next request after an unexpected body
+            }
+#if SDSERVER_ENABLE_METRICS
+            if (request.path() == SDSERVER_METRICS_PATH) {
+                sendMetrics(connection);
+                break;
+            }
+#endif
+            if (request.queryParameter("upload").data()) {
+                handleUploadSession(connection);
+                break;
+            }
+            connection.file = _directories.open(request.path());
+            if (!connection.file) {
+                sendHTMLResponse(HTTP_404_NOT_FOUND, _response, connection.keepAlive);
+                finishResponse(connection);
+            } else if (connection.file.isDirectory()) {
+#if SDSERVER_ENABLE_ARCHIVES
+                if (request.queryParameter("archive").data()) {
+                    beginArchive(connection);
+                    break;
+                }
+#endif
+                if (request.queryParameter("format") == "json") {
+                    beginJSONListing(connection);
+                } else {
+                    listFiles(connection);
                 }
-                _workingBuffer[index] = '\0';
-                (strstr(_workingBuffer, " HTTP"))[0] = '\0'; // chop off the " HTTP/1.1"
-                bool isGET = strstr(_workingBuffer, "GET ") != 0;
-                bool isPOST = strstr(_workingBuffer, "POST ") != 0;
-                char* decodedRequestLine = urlDecode(_workingBuffer);
-                char* filePath = strcpy(decodedRequestLine, strstr(decodedRequestLine, " ") + 1);
-
-                if (isGET) {
-                    FsFile file = _fs->open(filePath);
-                    if (!file) {
-                        sendHTMLResponse(HTTP_404_NOT_FOUND, client);
-                    } else {
-                        if (file.isDirectory()) {
-                           listFiles(filePath, file, client);
-                        } else {
-                            clientPrintln(HTTP_200_OK, client);
-                            clientPrint(HTTP_CONTENT_TYPE, client);
-                            clientPrintln("application/octet-stream", client);
-                            clientPrint(HTTP_CONTENT_LENGTH, client);
-                            clientPrint(file.size(), DEC, client);
-                            clientPrintln("", client);
-                            clientPrintln(HTTP_CONNECTION_CLOSE, client);
-                            clientPrintln("", client);
-                            while (file.available()) {
-                                size_t bytesRead = file.read(_workingBuffer, _workingBufferSize);
-                                client.write(_workingBuffer, bytesRead);
-                            }
-                        }
-                    }
-                    file.close();
-                } else if (isPOST) {
-                    char* directoryPath = strcpy(filePath, filePath + 1); // remove leading /
-                    size_t directoryPathLength = strlen(directoryPath);
-                    if (directoryPathLength != 0 && directoryPath[directoryPathLength - 1] != '/')
-                    {
-                        directoryPath[directoryPathLength] = '/';
-                        directoryPath[directoryPathLength + 1] = '\0';
-                    }
-
-                    readToBoundary(client);
-                    _headerBufferPos = strlen(directoryPath) + 1;
-                    size_t bytesRead = client.readBytesUntil('\n', _workingBuffer + _headerBufferPos, _workingBufferSize - _headerBufferPos);
-                    _workingBuffer[_headerBufferPos + bytesRead - 1] = '\0'; // replace the \r in \r\n with null terminator
-                    readToBody(client); // will probably break if Content-Type is the last header
-                    multipart_parser parser;
-                    multipart_parser_init(&parser, _workingBuffer + _headerBufferPos, &_multipartParserCallbacks);
-                    multipart_parser_set_data(&parser, this);
-                    while (bytesRead = client.readBytes(_uploadStreamingBuffer, _uploadStreamingBufferSize)) {
-                        multipart_parser_execute(&parser, _uploadStreamingBuffer, bytesRead);
-                    }
-                    sendHTMLResponse(HTTP_303_REDIRECT, client);
+            } else if (request.queryParameter("digest").data()) {
+                beginDigest(connection);
+            } else if (request.queryParameter("follow").data() && request.queryParameter("follow") != "0") {
+                beginFollow(connection);
+            } else {
+                openGzipSidecar(connection);
+                sendFileResponse(connection);
+                if (connection.state == Connection::State::SendingFile) {
+                    sendFileData(connection); // the first data shares a write with the headers
                 }
             }
+            break;
+        case HTTPRequestParser::Method::POST:
+            if (request.queryParameter("upload").data()) {
+                handleUploadSession(connection);
+                break;
+            }
+#if SDSERVER_ENABLE_ARCHIVES
+            if (request.queryParameter("extract").data()) {
+                beginExtract(connection);
+                break;
+            }
+#endif
+            beginUpload(connection);
+            break;
+        case HTTPRequestParser::Method::PUT:
+            if (request.queryParameter("upload").data()) {
+                beginSessionWrite(connection);
+                break;
+            }
+#if SDSERVER_ENABLE_ARCHIVES
+            if (request.queryParameter("extract").data()) {
+                beginExtract(connection);
+                break;
+            }
+#endif
+            beginFileUpload(connection);
+            break;
+        case HTTPRequestParser::Method::PATCH:
+            if (request.queryParameter("upload").data()) {
+                beginSessionWrite(connection);
+                break;
+            }
+            [[fallthrough]];
+        default:
+            if (connection.bodyRemaining != 0 || request.hasHeader(HTTPRequestParser::Header::TransferEncoding)) {
+                connection.keepAlive = false;
+            }
+            sendHTMLResponse(HTTP_405_METHOD_NOT_ALLOWED, _response, connection.keepAlive);
+            finishResponse(connection);
+            break;
+    }
+}
 
-            client.stop();
-        }
+void SDServer::beginUpload(Connection& connection) {
+    HTTPRequestParser& request = connection.request;
+    std::string_view boundary = request.boundary();
+    if (!request.hasContentLength()) {
+        sendHTMLResponse(HTTP_411_LENGTH_REQUIRED, _response);
+        closeConnection(connection);
+        return;
+    }
+    if (boundary.empty() || boundary.size() > 70) { // RFC 2046 limits boundaries to 70 characters
+        sendHTMLResponse(HTTP_400_BAD_REQUEST, _response);
+        closeConnection(connection);
+        return;
+    }
+
+    char boundaryString[71];
+    memcpy(boundaryString, boundary.data(), boundary.size());
+    boundaryString[boundary.size()] = '\0';
+    multipart_parser_init(&connection.parser, boundaryString, &_multipartParserCallbacks);
+    multipart_parser_set_data(&connection.parser, &connection);
+
+    // Lay the buffer out with the directory path at the front and any body
+    // bytes that arrived with the head at the back. Part header values are
+    // collected in between.
+    size_t pendingLength = connection.inputEnd - connection.inputBegin;
+    size_t inputBegin = sizeof(connection.buffer) - pendingLength;
+    memmove(connection.buffer + inputBegin, connection.buffer + connection.inputBegin, pendingLength);
+    connection.inputBegin = inputBegin;
+    connection.inputEnd = sizeof(connection.buffer);
+
+    std::string_view path = request.path();
+    path.remove_prefix(std::min<size_t>(1, path.size())); // remove leading /
+    size_t directoryPathLength = path.size();
+    memmove(connection.buffer, path.data(), directoryPathLength);
+    if (directoryPathLength != 0 && connection.buffer[directoryPathLength - 1] != '/') {
+        connection.buffer[directoryPathLength++] = '/';
+    }
+    connection.buffer[directoryPathLength] = '\0';
+    connection.headerValuesBegin = directoryPathLength + 1;
+    connection.bufferPos = connection.headerValuesBegin;
+
+    if (request.expectsContinue()) {
+        _response.print(HTTP_100_CONTINUE);
     }
+    connection.state = Connection::State::ReadingMultipartBody;
 }
 
-void SDServer::listFiles(const char* directoryPath, FsFile& directory, WiFiClient& client) {
-    clientPrintln(HTTP_200_OK, client);
-    clientPrint(HTTP_CONTENT_TYPE, client);
-    clientPrintln("text/html", client);
-    clientPrintln(HTTP_TRANSFER_ENCODING_CHUNKED, client);
-    clientPrintln(HTTP_CONNECTION_CLOSE, client);
-    clientPrintln("", client);
+void SDServer::beginFileUpload(Connection& connection) {
+    HTTPRequestParser& request = connection.request;
+    if (!request.hasContentLength() || request.hasHeader(HTTPRequestParser::Header::TransferEncoding)) {
+        sendHTMLResponse(HTTP_411_LENGTH_REQUIRED, _response);
+        closeConnection(connection);
+        return;
+    }
+    bool expectsContinue = request.expectsContinue();
+    connection.verifyDigest = request.hasHeader(HTTPRequestParser::Header::ContentCRC32C);
+    if (connection.verifyDigest && !parseCRC32C(request.header(HTTPRequestParser::Header::ContentCRC32C), connection.expectedDigest)) {
+        sendHTMLResponse(HTTP_400_BAD_REQUEST, _response);
+        closeConnection(connection);
+        return;
+    }
+    if (!layOutUploadPaths(connection, UPLOAD_TEMP_SUFFIX)) return;
+
+    const char* tempPath = connection.buffer;
+    const char* targetPath = tempPath + strlen(tempPath) + 1;
+    connection.file = _fs->open(tempPath, FILE_WRITE);
+    if (!connection.file) {
+        sendHTMLResponse(HTTP_409_CONFLICT, _response); // no such directory
+        closeConnection(connection);
+        return;
+    }
+    connection.file.truncate(0); // a leftover from an earlier interrupted upload
+    prepareUploadFile(connection, connection.bodyRemaining);
+    connection.digesting = true;
+    connection.digest = 0;
+    invalidateDirectory(std::string_view(targetPath, strrchr(targetPath, '/') - targetPath));
 
-    const char* htmlStart = "<!DOCTYPE html><html><head><link rel=\"icon\" href=\"data:image/png;base64,iVBORw0KGgoAAAANSUhEUgAAAAEAAAABCAIAAACQd1PeAAAADElEQVQI12P4//8/AAX+Av7czFnnAAAAAElFTkSuQmCC\"></head><body><form method=\"post\" enctype=\"multipart/form-data\"><label>Upload file to this folder: </label><br/><input type=\"file\" name=\"file\" required/><br/><input type=\"submit\"/></form><br/>";
-    const char* chunkSize = combinedStrLenAsHex({ htmlStart });
-    clientPrintln(chunkSize, client);
-    clientPrintln(htmlStart, client);
+    if (expectsContinue) {
+        _response.print(HTTP_100_CONTINUE);
+    }
+    connection.state = Connection::State::ReadingFileBody;
+}
 
-    size_t directoryPathLength = strlen(directoryPath);
-    bool appendPathSeparator = directoryPathLength == 0 || directoryPath[directoryPathLength - 1] != '/';
-    const char* directoryPathSuffix = appendPathSeparator ? "/" : "";
+// Lays the buffer out for an upload to the request's path: the path with
+// suffix appended and then the path itself, both null-terminated, at the
+// front, and any body bytes that arrived with the head at the back. This
+// overwrites the request's views. Answers and returns false when the path is
+// too long, names a directory or the digest store.
+bool SDServer::layOutUploadPaths(Connection& connection, std::string_view suffix) {
+    if (isDigestStore(connection.request.path())) {
+        sendHTMLResponse(HTTP_403_FORBIDDEN, _response);
+        closeConnection(connection);
+        return false;
+    }
 
-    char* fileNameBuffer = _workingBuffer + directoryPathLength + 1;
-    size_t fileNameBufferSize = _workingBufferSize - directoryPathLength - 1;
+    size_t pendingLength = connection.inputEnd - connection.inputBegin;
+    size_t inputBegin = sizeof(connection.buffer) - pendingLength;
+    memmove(connection.buffer + inputBegin, connection.buffer + connection.inputBegin, pendingLength);
+    connection.inputBegin = inputBegin;
+    connection.inputEnd = sizeof(connection.buffer);
 
-    const char* linkStart = "<a href=\"";
-    const char* linkMiddle = "\">";
-    const char* linkEnd = "</a><br/>";
+    std::string_view path = connection.request.path();
+    if (2 * path.size() + suffix.size() + 2 > inputBegin) {
+        sendHTMLResponse(HTTP_414_URI_TOO_LONG, _response);
+        closeConnection(connection);
+        return false;
+    }
+    char* suffixedPath = connection.buffer;
+    char* targetPath = suffixedPath + path.size() + suffix.size() + 1;
+    memmove(targetPath, path.data(), path.size());
+    targetPath[path.size()] = '\0';
+    memcpy(suffixedPath, targetPath, path.size());
+    memcpy(suffixedPath + path.size(), suffix.data(), suffix.size());
+    suffixedPath[path.size() + suffix.size()] = '\0';
 
-    directory.rewindDirectory();
-    FsFile entry;
-    while (entry = directory.openNextFile()) {
-        entry.getName(fileNameBuffer, fileNameBufferSize);
-        if (requiresURLEncoding(fileNameBuffer)) continue; // don't support spaces and other special characters in file names
-        chunkSize = combinedStrLenAsHex({
-            linkStart,
-            directoryPath,
-            directoryPathSuffix,
-            fileNameBuffer,
-            linkMiddle,
-            fileNameBuffer,
-            linkEnd
-        });
-        clientPrintln(chunkSize, client);
-        clientPrint(linkStart, client);
-        clientPrint(directoryPath, client);
-        clientPrint(directoryPathSuffix, client);
-        clientPrint(fileNameBuffer, client);
-        clientPrint(linkMiddle, client);
-        clientPrint(fileNameBuffer, client);
-        clientPrintln(linkEnd, client);
+    if (path.empty() || path.back() == '/' || (connection.file = _fs->open(targetPath)).isDirectory()) {
+        connection.file.close();
+        sendHTMLResponse(HTTP_409_CONFLICT, _response);
+        closeConnection(connection);
+        return false;
+    }
+    connection.file.close();
 
-        entry.close();
+    return true;
+}
+
+// Resumable uploads for links that drop. A session is kept on the card as the
+// target's name plus UPLOAD_SESSION_SUFFIX, so it survives a reboot, and the
+// size of that file is how far the upload has got:
+//   POST /file?upload=new            starts the session, or starts it over
+//   PUT or PATCH /file?upload&offset=N   writes the body at N, see beginSessionWrite()
+//   GET or HEAD /file?upload         reports how far it has got
+//   POST /file?upload=done[&length=N]  replaces the target with it
+//   POST /file?upload=cancel         throws it away
+// Answers carry the session's size in an Upload-Offset header.
+void SDServer::handleUploadSession(Connection& connection) {
+    HTTPRequestParser& request = connection.request;
+    enum class Action : uint8_t { Status, New, Done, Cancel } action = Action::Status;
+    if (request.method() == HTTPRequestParser::Method::POST) {
+        std::string_view name = request.queryParameter("upload");
+        if (name == "new") {
+            action = Action::New;
+        } else if (name == "done") {
+            action = Action::Done;
+        } else if (name == "cancel") {
+            action = Action::Cancel;
+        } else {
+            sendHTMLResponse(HTTP_400_BAD_REQUEST, _response);
+            closeConnection(connection);
+            return;
+        }
+    }
+    std::string_view lengthParameter = request.queryParameter("length");
+    uint64_t length = 0;
+    if (!parseDecimal(lengthParameter, length)) {
+        sendHTMLResponse(HTTP_400_BAD_REQUEST, _response);
+        closeConnection(connection);
+        return;
     }
-    directory.rewindDirectory();
-
-    const char* htmlEnd = "</body></html>\n";
-    chunkSize = combinedStrLenAsHex({ htmlEnd });
-    clientPrintln(chunkSize, client);
-    clientPrintln(htmlEnd, client);
-
-    // Terminating chunk
-    clientPrintln("0", client);
-    clientPrintln("", client);
-}
-
-char* SDServer::urlDecode(char* text) {
-    char hex[] = "0x00";
-    size_t textLength = strlen(text);
-    size_t decodedLength = 0;
-    size_t i = 0;
-    while (i < textLength) {
-        char decodedCharacter;
-        char encodedCharacter = text[i++];
-        if (encodedCharacter == '%' && i + 1 < textLength) {
-            hex[2] = text[i++];
-            hex[3] = text[i++];
-            decodedCharacter = strtol(hex, nullptr, 16);
+    if (connection.bodyRemaining != 0 || request.hasHeader(HTTPRequestParser::Header::TransferEncoding)) {
+        connection.keepAlive = false; // the body isn't read, so the next request can't be found
+    }
+    if (!layOutUploadPaths(connection, UPLOAD_SESSION_SUFFIX)) return;
+
+    const char* sessionPath = connection.buffer;
+    const char* targetPath = sessionPath + strlen(sessionPath) + 1;
+    std::string_view directory(targetPath, strrchr(targetPath, '/') - targetPath);
+    if (action == Action::New) {
+        connection.file = _fs->open(sessionPath, FILE_WRITE);
+        if (!connection.file) {
+            sendHTMLResponse(HTTP_409_CONFLICT, _response, connection.keepAlive); // no such directory
         } else {
-            if (encodedCharacter == '+') decodedCharacter = ' ';
-            else decodedCharacter = encodedCharacter;
+            connection.file.truncate(0);
+            connection.file.close();
+            invalidateDirectory(directory);
+            sendUploadOffset(connection, HTTP_201_CREATED, 0);
         }
-        text[decodedLength++] = decodedCharacter;
+        finishResponse(connection);
+        return;
     }
-    text[decodedLength] = '\0';
 
-    return text;
-}
\ No newline at end of file
+    connection.file = _fs->open(sessionPath);
+    if (!connection.file) {
+        sendHTMLResponse(HTTP_404_NOT_FOUND, _response, connection.keepAlive);
+        finishResponse(connection);
+        return;
+    }
+    uint64_t offset = connection.file.fileSize();
+    connection.file.close();
+
+    switch (action) {
+        case Action::Status:
+            sendUploadOffset(connection, HTTP_200_OK, offset);
+            break;
+        case Action::Done:
+            if (!lengthParameter.empty() && offset != length) {
+                sendUploadOffset(connection, HTTP_409_CONFLICT, offset);
+                break;
+            }
+            // A failed rename leaves the session in place to try again
+            sendUploadResponse(replaceWithUpload(sessionPath, targetPath), _response, connection.keepAlive);
+            invalidateDirectory(directory);
+            break;
+        default:
+            _fs->remove(sessionPath);
+            invalidateDirectory(directory);
+            sendUploadResponse(HTTP_204_NO_CONTENT, _response, connection.keepAlive);
+            break;
+    }
+    finishResponse(connection);
+}
+
+// Writes a request body into an upload session at &offset=N. N may be
+// anything up to the session's size, and whatever the session holds past it
+// is dropped first, so a client unsure how much of its last request arrived
+// can resend from the last offset it was told. Whatever arrives is kept if
+// the connection drops.
+void SDServer::beginSessionWrite(Connection& connection) {
+    HTTPRequestParser& request = connection.request;
+    if (!request.hasContentLength() || request.hasHeader(HTTPRequestParser::Header::TransferEncoding)) {
+        sendHTMLResponse(HTTP_411_LENGTH_REQUIRED, _response);
+        closeConnection(connection);
+        return;
+    }
+    std::string_view offsetParameter = request.queryParameter("offset");
+    uint64_t offset = 0;
+    if (offsetParameter.empty() || !parseDecimal(offsetParameter, offset)) {
+        sendHTMLResponse(HTTP_400_BAD_REQUEST, _response);
+        closeConnection(connection);
+        return;
+    }
+    bool expectsContinue = request.expectsContinue();
+    if (!layOutUploadPaths(connection, UPLOAD_SESSION_SUFFIX)) return;
+
+    connection.file = _fs->open(connection.buffer, O_RDWR);
+    if (!connection.file) {
+        sendHTMLResponse(HTTP_404_NOT_FOUND, _response);
+        closeConnection(connection);
+        return;
+    }
+    uint64_t size = connection.file.fileSize();
+    if (offset > size) {
+        connection.file.close();
+        connection.keepAlive = false; // the body isn't read
+        sendUploadOffset(connection, HTTP_409_CONFLICT, size);
+        closeConnection(connection);
+        return;
+    }
+    if (offset < size) {
+        connection.file.truncate(offset);
+    }
+    const char* sessionPath = connection.buffer;
+    invalidateDirectory(std::string_view(sessionPath, strrchr(sessionPath, '/') - sessionPath)); // the session may have been downloaded
+    connection.file.seekSet(offset);
+    prepareUploadFile(connection, offset == 0 ? connection.bodyRemaining : 0);
+    connection.sessionUpload = true;
+    connection.uploadEnd = offset + connection.bodyRemaining;
+
+    if (expectsContinue) {
+        _response.print(HTTP_100_CONTINUE);
+    }
+    connection.state = Connection::State::ReadingFileBody;
+}
+
+void SDServer::finishSessionWrite(Connection& connection) {
+    StorageLock lock(*this);
+    flushUploadData(connection);
+    uint64_t offset = connection.file.curPosition();
+    endUploadFile(connection); // the session's size is now the offset reached
+    sendUploadOffset(connection, offset == connection.uploadEnd ? HTTP_204_NO_CONTENT : HTTP_500_INTERNAL_SERVER_ERROR, offset);
+    finishResponse(connection);
+}
+
+void SDServer::sendUploadOffset(Connection& connection, std::string_view statusLine, uint64_t offset) {
+    _response.println(statusLine);
+    _response.print(HTTP_UPLOAD_OFFSET);
+    _response.println(offset);
+    if (statusLine != HTTP_204_NO_CONTENT) {
+        _response.print(HTTP_CONTENT_LENGTH);
+        _response.println("0");
+    }
+    _response.println(connection.keepAlive ? HTTP_CONNECTION_KEEP_ALIVE : HTTP_CONNECTION_CLOSE);
+    _response.println();
+}
+
+#if SDSERVER_ENABLE_ARCHIVES
+// Extracts a tar archive body into a directory, POST or PUT /dir?extract=tar,
+// creating the directory and any subdirectories as needed. Members are
+// written straight to the card as they stream in. One archive is extracted
+// at a time.
+void SDServer::beginExtract(Connection& connection) {
+    HTTPRequestParser& request = connection.request;
+    if (!request.hasContentLength() || request.hasHeader(HTTPRequestParser::Header::TransferEncoding)) {
+        sendHTMLResponse(HTTP_411_LENGTH_REQUIRED, _response);
+        closeConnection(connection);
+        return;
+    }
+    if (request.queryParameter("extract") != "tar") {
+        sendHTMLResponse(HTTP_400_BAD_REQUEST, _response);
+        closeConnection(connection);
+        return;
+    }
+    if (_archiveOwner) {
+        sendHTMLResponse(HTTP_503_SERVICE_UNAVAILABLE, _response);
+        closeConnection(connection);
+        return;
+    }
+    if (request.expectsContinue()) {
+        _response.print(HTTP_100_CONTINUE);
+    }
+
+    // The connection buffer is needed for the paths, so body bytes that
+    // arrived with the head are parsed from a copy in the working buffer's
+    // free space. Bytes after the body, the next request, stay at the back.
+    size_t pendingLength = connection.inputEnd - connection.inputBegin;
+    size_t bodyLength = std::min<uint64_t>(pendingLength, connection.bodyRemaining);
+    if (bodyLength > _response.freeSpaceSize()) {
+        sendHTMLResponse(HTTP_503_SERVICE_UNAVAILABLE, _response);
+        closeConnection(connection);
+        return;
+    }
+    char* body = _response.freeSpace();
+    memcpy(body, connection.buffer + connection.inputBegin, bodyLength);
+    size_t inputBegin = sizeof(connection.buffer) - (pendingLength - bodyLength);
+    memmove(connection.buffer + inputBegin, connection.buffer + connection.inputBegin + bodyLength, pendingLength - bodyLength);
+    connection.inputBegin = inputBegin;
+    connection.inputEnd = sizeof(connection.buffer);
+
+    // Lay the buffer out with the target directory and room for a member path
+    // at the front, followed by the names of members that fail
+    std::string_view path = request.path();
+    while (!path.empty() && path.back() == '/') path.remove_suffix(1);
+    if (path.size() + 1 + TarReader::PATH_BUFFER_SIZE > inputBegin) {
+        sendHTMLResponse(HTTP_414_URI_TOO_LONG, _response);
+        closeConnection(connection);
+        return;
+    }
+    memmove(connection.buffer, path.data(), path.size());
+    connection.buffer[path.size()] = '\0';
+    if (!path.empty()) {
+        connection.file = _fs->open(connection.buffer);
+        bool isDirectory = connection.file.isDirectory() || (!connection.file && _fs->mkdir(connection.buffer, true));
+        connection.file.close();
+        if (!isDirectory) {
+            sendHTMLResponse(HTTP_409_CONFLICT, _response);
+            closeConnection(connection);
+            return;
+        }
+    }
+    connection.buffer[path.size()] = '/';
+    connection.headerValuesBegin = path.size() + 1;
+    connection.bufferPos = connection.headerValuesBegin + TarReader::PATH_BUFFER_SIZE;
+
+    _archiveOwner = &connection;
+    _extractedMembers = 0;
+    _skippedMembers = 0;
+    _failedMembers = 0;
+    _tarReader.begin(connection.buffer + connection.headerValuesBegin, &_archiveCallbacks, &connection);
+    invalidateListings();
+    connection.state = Connection::State::ExtractingArchive;
+
+    bool parsed = consumeUploadBody(connection, body, bodyLength);
+    connection.bodyRemaining -= bodyLength;
+    if (!parsed || connection.bodyRemaining == 0) {
+        endUploadBody(connection, !parsed);
+    }
+}
+#endif
+
+void SDServer::sendFileResponse(Connection& connection) {
+    HTTPRequestParser& request = connection.request;
+    uint64_t fileSize = connection.file.size();
+    connection.multipartRanges = false;
+    connection.sendRemaining = fileSize;
+    connection.state = Connection::State::SendingFile;
+
+    // Validators: the modification time, and an ETag made of the size and modification time
+    uint16_t fatDate = 0, fatTime = 0;
+    connection.file.getModifyDateTime(&fatDate, &fatTime);
+    char lastModified[30];
+    bool hasLastModified = formatHTTPDate(fatDate, fatTime, lastModified);
+    char etag[28];
+    formatFileETag(fileSize, fatDate, fatTime, etag);
+    const char* cacheControlValue = cacheControl(request.path());
+    auto printRepresentationHeaders = [&]() {
+        if (connection.gzipEncoded) {
+            _response.println(HTTP_CONTENT_ENCODING_GZIP);
+            _response.println(HTTP_VARY_ACCEPT_ENCODING);
+        }
+        _response.print(HTTP_ETAG);
+        _response.println(etag);
+        if (hasLastModified) {
+            _response.print(HTTP_LAST_MODIFIED);
+            _response.println(lastModified);
+        }
+        if (cacheControlValue) {
+            _response.print(HTTP_CACHE_CONTROL);
+            _response.println(cacheControlValue);
+        }
+    };
+
+    // If-None-Match takes precedence, If-Modified-Since is only used without it
+    bool notModified = false;
+    uint32_t since;
+    if (request.hasHeader(HTTPRequestParser::Header::IfNoneMatch)) {
+        notModified = headerHasETag(request.header(HTTPRequestParser::Header::IfNoneMatch), etag);
+    } else if (hasLastModified && parseHTTPDate(request.header(HTTPRequestParser::Header::IfModifiedSince), since)) {
+        notModified = ((uint32_t)fatDate << 16 | fatTime) <= since;
+    }
+    if (notModified) {
+        _response.println(HTTP_304_NOT_MODIFIED);
+        printRepresentationHeaders();
+        _response.println(connection.keepAlive ? HTTP_CONNECTION_KEEP_ALIVE : HTTP_CONNECTION_CLOSE);
+        _response.println();
+        finishResponse(connection);
+        return;
+    }
+
+    // A file in the file cache is sent from there, otherwise it may be filled
+    // in as the file is read, but only by a response that starts at the
+    // beginning of the file. Only a file that's partly cached needs the card.
+    uint32_t modified = (uint32_t)fatDate << 16 | fatTime;
+    connection.cachedFileId = _fileCache.acquire(request.path(), connection.gzipEncoded, fileSize, modified);
+    auto fillFileCache = [&]() {
+        if (connection.cachedFileId == FileCache::NONE && !connection.headOnly) {
+            connection.cachedFileId = _fileCache.beginFill(request.path(), connection.gzipEncoded, fileSize, modified);
+        }
+    };
+    bool fromCache = _fileCache.holdsWholeFile(connection.cachedFileId);
+    connection.firstSector = fromCache ? 0 : contiguousFirstSector(connection.file);
+
+    // A Range only applies to the representation named by If-Range, if given.
+    // Dates have to match exactly and weak ETags never do.
+    const char* ranges = byteRanges(request);
+    if (ranges && request.hasHeader(HTTPRequestParser::Header::IfRange)) {
+        std::string_view ifRange = request.header(HTTPRequestParser::Header::IfRange);
+        if (ifRange != etag && (!hasLastModified || ifRange != lastModified)) {
+            ranges = nullptr;
+        }
+    }
+    if (ranges) {
+        // Validate the whole range set up front. Any syntax error means the
+        // header is ignored and the whole file is sent.
+        const char* cursor = ranges;
+        size_t satisfiableCount = 0;
+        uint64_t first, last, firstRangeBegin = 0, firstRangeEnd = 0;
+        uint64_t multipartLength = 0;
+        char partHeader[160];
+        RangeSpec spec;
+        while ((spec = nextByteRange(cursor, fileSize, first, last)) != RangeSpec::End && spec != RangeSpec::Invalid) {
+            if (spec != RangeSpec::Satisfiable) continue;
+            if (satisfiableCount++ == 0) {
+                firstRangeBegin = first;
+                firstRangeEnd = last;
+            }
+            multipartLength += formatRangePartHeader(partHeader, first, last, fileSize) + (last - first + 1);
+        }
+
+        if (spec != RangeSpec::Invalid && satisfiableCount == 0) {
+            _response.println(HTTP_416_RANGE_NOT_SATISFIABLE);
+            _response.print(HTTP_CONTENT_RANGE);
+            _response.print("*/");
+            _response.print(fileSize);
+            _response.println();
+            _response.print(HTTP_CONTENT_LENGTH);
+            _response.println("0");
+            _response.println(connection.keepAlive ? HTTP_CONNECTION_KEEP_ALIVE : HTTP_CONNECTION_CLOSE);
+            _response.println();
+            finishResponse(connection);
+            return;
+        }
+
+        if (spec != RangeSpec::Invalid && satisfiableCount <= SDSERVER_MAX_RANGES) {
+            _response.println(HTTP_206_PARTIAL_CONTENT);
+            _response.print(HTTP_CONTENT_TYPE);
+            if (satisfiableCount == 1) {
+                _response.println("application/octet-stream");
+                _response.print(HTTP_CONTENT_RANGE);
+                _response.print(firstRangeBegin);
+                _response.print("-");
+                _response.print(firstRangeEnd);
+                _response.print("/");
+                _response.print(fileSize);
+                _response.println();
+                _response.print(HTTP_CONTENT_LENGTH);
+                _response.print(firstRangeEnd - firstRangeBegin + 1);
+                _response.println();
+                connection.file.seekSet(firstRangeBegin);
+                connection.sendRemaining = firstRangeEnd - firstRangeBegin + 1;
+                if (firstRangeBegin == 0) fillFileCache();
+            } else {
+                _response.print("multipart/byteranges; boundary=");
+                _response.println(BYTERANGES_BOUNDARY);
+                _response.print(HTTP_CONTENT_LENGTH);
+                _response.print(multipartLength + BYTERANGES_BOUNDARY.size() + 8); // "\r\n--" boundary "--\r\n"
+                _response.println();
+                connection.multipartRanges = true;
+                connection.rangeCursor = 0;
+                connection.sendRemaining = 0; // sendFileData() starts the first part
+            }
+            _response.println(HTTP_ACCEPT_RANGES_BYTES);
+            printRepresentationHeaders();
+            _response.println(connection.keepAlive ? HTTP_CONNECTION_KEEP_ALIVE : HTTP_CONNECTION_CLOSE);
+            _response.println();
+            if (connection.headOnly) {
+                finishResponse(connection);
+            } else if (!connection.multipartRanges && !fromCache) {
+                claimPipeline(connection, PipelineDirection::Download);
+            }
+            return;
+        }
+    }
+
+    fillFileCache();
+
+    // A known digest goes in the headers. Downloads don't record one, so a
+    // plain GET never writes to the card. A .gz sidecar is a different
+    // representation.
+    uint32_t crc = 0;
+    bool hasDigest = !connection.gzipEncoded &&
+        (_fileCache.digest(connection.cachedFileId, crc) || _digests.lookup(request.path().data(), fileSize, modified, crc));
+
+    _response.println(HTTP_200_OK);
+    _response.print(HTTP_CONTENT_TYPE);
+    _response.println("application/octet-stream");
+    _response.print(HTTP_CONTENT_LENGTH);
+    _response.print(fileSize);
+    _response.println();
+    _response.println(HTTP_ACCEPT_RANGES_BYTES);
+    if (hasDigest) {
+        char digest[9];
+        _response.print(HTTP_CONTENT_CRC32C);
+        _response.println(formatCRC32C(crc, digest));
+    }
+    printRepresentationHeaders();
+    _response.println(connection.keepAlive ? HTTP_CONNECTION_KEEP_ALIVE : HTTP_CONNECTION_CLOSE);
+    _response.println();
+    if (connection.headOnly) {
+        finishResponse(connection);
+    } else if (!fromCache) {
+        claimPipeline(connection, PipelineDirection::Download);
+    }
+}
+
+// Switches to a precompressed copy of the requested file, named like it
+// with .gz appended, when there is one and the client accepts gzip.
+void SDServer::openGzipSidecar(Connection& connection) {
+    std::string_view path = connection.request.path();
+    if (!connection.request.acceptsEncoding("gzip")) return;
+    if (path.size() >= 3 && path.substr(path.size() - 3) == ".gz") return;
+
+    char sidecarPath[SDSERVER_CONNECTION_BUFFER_SIZE + 4];
+    if (path.size() + 4 > sizeof(sidecarPath)) return;
+    memcpy(sidecarPath, path.data(), path.size());
+    strcpy(sidecarPath + path.size(), ".gz");
+    FsFile sidecar = _directories.open(std::string_view(sidecarPath, path.size() + 3));
+    if (!sidecar) return;
+    if (sidecar.isDirectory()) {
+        sidecar.close();
+        return;
+    }
+
+    connection.file.close();
+    connection.file = sidecar;
+    connection.gzipEncoded = true;
+}
+
+// The Cache-Control value of the longest path prefix matching path, or nullptr.
+const char* SDServer::cacheControl(std::string_view path) const {
+    const CacheControlRule* match = nullptr;
+    size_t matchLength = 0;
+    for (size_t i = 0; i < _cacheControlRuleCount; ++i) {
+        size_t prefixLength = strlen(_cacheControlRules[i].pathPrefix);
+        if (path.substr(0, prefixLength) == _cacheControlRules[i].pathPrefix && (!match || prefixLength > matchLength)) {
+            match = &_cacheControlRules[i];
+            matchLength = prefixLength;
+        }
+    }
+
+    return match ? match->value : nullptr;
+}
+
+// Moves a multipart/byteranges response on to its next part, or writes the
+// closing delimiter and returns false once every range has been sent.
+bool SDServer::startNextRangePart(Connection& connection) {
+    const char* ranges = byteRanges(connection.request);
+    const char* cursor = ranges + connection.rangeCursor;
+    uint64_t fileSize = connection.file.size();
+    uint64_t first, last;
+    RangeSpec spec;
+    while ((spec = nextByteRange(cursor, fileSize, first, last)) == RangeSpec::Unsatisfiable);
+    connection.rangeCursor = cursor - ranges;
+
+    if (spec != RangeSpec::Satisfiable) {
+        _response.print("\r\n--");
+        _response.print(BYTERANGES_BOUNDARY);
+        _response.print("--\r\n");
+        connection.multipartRanges = false;
+        return false;
+    }
+
+    char partHeader[160];
+    size_t partHeaderLength = formatRangePartHeader(partHeader, first, last, fileSize);
+    _response.write(partHeader, partHeaderLength);
+    connection.file.seekSet(first);
+    connection.sendRemaining = last - first + 1;
+
+    return true;
+}
+
+// Reads a multipart or tar archive body and hands it to its parser.
+bool SDServer::readUploadBody(Connection& connection) {
+    // Body bytes that arrived with the head are parsed here first
+    bool hasPendingInput = connection.inputBegin < connection.inputEnd;
+    if (isPipelined(connection) || (!hasPendingInput && claimPipeline(connection, PipelineDirection::Upload))) {
+        return receivePipelinedBody(connection);
+    }
+
+    const char* data;
+    size_t bytesRead;
+    if (connection.inputBegin < connection.inputEnd) {
+        // Body bytes that arrived along with the request head
+        data = connection.buffer + connection.inputBegin;
+        bytesRead = std::min<uint64_t>(connection.inputEnd - connection.inputBegin, connection.bodyRemaining);
+    } else {
+        int available = connection.client.available();
+        if (available <= 0) return false;
+
+        size_t bytesToRead = std::min((size_t)available, _uploadStreamingBufferSize);
+        if (connection.bodyRemaining < bytesToRead) {
+            bytesToRead = connection.bodyRemaining; // anything after the body belongs to the next request
+        }
+        int result = connection.client.read(reinterpret_cast<uint8_t*>(_uploadStreamingBuffer), bytesToRead);
+        if (result <= 0) return false;
+        _metrics.addBytesReceived(result);
+        data = _uploadStreamingBuffer;
+        bytesRead = result;
+    }
+
+    bool parsed = consumeUploadBody(connection, data, bytesRead);
+    if (data != _uploadStreamingBuffer) {
+        connection.inputBegin += bytesRead;
+    }
+    connection.bodyRemaining -= bytesRead;
+    if (!parsed || connection.bodyRemaining == 0) {
+        endUploadBody(connection, !parsed);
+    }
+
+    return true;
+}
+
+// Passes body bytes to whatever the upload writes them with. Returns false
+// when the body is malformed.
+bool SDServer::consumeUploadBody(Connection& connection, const char* data, size_t length) {
+    switch (connection.state) {
+        case Connection::State::ReadingMultipartBody:
+            if (multipart_parser_execute(&connection.parser, data, length) == length) return true;
+            _metrics.recordMultipartError();
+            return false;
+#if SDSERVER_ENABLE_ARCHIVES
+        case Connection::State::ExtractingArchive:
+            return _tarReader.execute(data, length) == length;
+#endif
+        default:
+            writeUploadData(connection, data, length);
+            return true;
+    }
+}
+
+// Answers an upload once its whole body is in, or a malformed one.
+void SDServer::endUploadBody(Connection& connection, bool malformed) {
+#if SDSERVER_ENABLE_ARCHIVES
+    if (connection.state == Connection::State::ExtractingArchive) {
+        finishExtract(connection, malformed);
+        return;
+    }
+#endif
+    if (connection.state == Connection::State::ReadingFileBody) {
+        finishFileUpload(connection);
+    } else if (malformed) {
+        sendHTMLResponse(HTTP_400_BAD_REQUEST, _response);
+        closeConnection(connection);
+    } else {
+        sendHTMLResponse(HTTP_303_REDIRECT, _response, connection.keepAlive);
+        finishResponse(connection);
+    }
+}
+
+#if SDSERVER_ENABLE_ARCHIVES
+void SDServer::recordExtractFailure(Connection& connection) {
+    ++_failedMembers;
+
+    // Named in the summary while there's room between the member path and
+    // any body bytes still waiting at the back of the buffer
+    const char* memberPath = connection.buffer + connection.headerValuesBegin;
+    size_t length = strlen(memberPath);
+    size_t bufferSize = connection.inputBegin < connection.inputEnd ? connection.inputBegin : sizeof(connection.buffer);
+    if (connection.bufferPos + length + 1 <= bufferSize) {
+        memcpy(connection.buffer + connection.bufferPos, memberPath, length);
+        connection.bufferPos += length;
+        connection.buffer[connection.bufferPos++] = '\n';
+    }
+}
+
+// Answers an extraction with a plain-text summary: counts of extracted,
+// skipped and failed members, then the failed members' paths, one per line.
+void SDServer::finishExtract(Connection& connection, bool malformed) {
+    StorageLock lock(*this);
+    if (connection.file.isOpen()) {
+        discardUploadFile(connection); // the body ended inside this member
+        recordExtractFailure(connection);
+    }
+    invalidateListings();
+    bool complete = !malformed && _tarReader.atMemberBoundary();
+
+    char counts[96];
+    char extracted[21], skipped[21], failed[21];
+    snprintf(counts, sizeof(counts), "extracted %s, skipped %s, failed %s%s\n",
+        formatDecimal(_extractedMembers, extracted), formatDecimal(_skippedMembers, skipped), formatDecimal(_failedMembers, failed),
+        complete ? "" : ", archive incomplete");
+    size_t failuresBegin = connection.headerValuesBegin + TarReader::PATH_BUFFER_SIZE;
+    std::string_view failures(connection.buffer + failuresBegin, connection.bufferPos - failuresBegin);
+
+    // Anything left of a malformed body can't be skipped, so the connection closes
+    bool keepAlive = connection.keepAlive && !malformed;
+    _response.println(complete ? HTTP_200_OK : HTTP_400_BAD_REQUEST);
+    _response.print(HTTP_CONTENT_TYPE);
+    _response.println("text/plain");
+    _response.print(HTTP_CONTENT_LENGTH);
+    _response.println(strlen(counts) + failures.size());
+    _response.println(keepAlive ? HTTP_CONNECTION_KEEP_ALIVE : HTTP_CONNECTION_CLOSE);
+    _response.println();
+    _response.print(counts);
+    _response.print(failures);
+    if (keepAlive) {
+        finishResponse(connection);
+    } else {
+        closeConnection(connection);
+    }
+}
+#endif
+
+bool SDServer::readFileBody(Connection& connection) {
+    bool hasPendingInput = connection.inputBegin < connection.inputEnd;
+    if (isPipelined(connection) ||
+        (!hasPendingInput && connection.bodyRemaining != 0 && claimPipeline(connection, PipelineDirection::Upload))) {
+        return receivePipelinedBody(connection);
+    }
+
+    if (connection.bodyRemaining == 0) {
+        finishFileUpload(connection);
+        return true;
+    }
+
+    if (hasPendingInput) {
+        // Body bytes that arrived along with the request head
+        size_t length = std::min<uint64_t>(connection.inputEnd - connection.inputBegin, connection.bodyRemaining);
+        writeUploadData(connection, connection.buffer + connection.inputBegin, length);
+        connection.inputBegin += length;
+        connection.bodyRemaining -= length;
+        return true;
+    }
+
+    int available = connection.client.available();
+    if (available <= 0) return false;
+
+    // The body is the file, so it's read straight into the upload write
+    // buffer when this upload has it
+    bool buffered = &connection == _uploadWriteOwner;
+    char* destination = buffered ? _uploadWriteBuffer + _uploadWriteLength : _uploadStreamingBuffer;
+    size_t bytesToRead = std::min((size_t)available, buffered ? _uploadWriteBufferSize - _uploadWriteLength : _uploadStreamingBufferSize);
+    if (connection.bodyRemaining < bytesToRead) {
+        bytesToRead = connection.bodyRemaining; // anything after the body belongs to the next request
+    }
+    int bytesRead = connection.client.read(reinterpret_cast<uint8_t*>(destination), bytesToRead);
+    if (bytesRead <= 0) return false;
+    _metrics.addBytesReceived(bytesRead);
+    connection.bodyRemaining -= bytesRead;
+    if (buffered) {
+        _uploadWriteLength += bytesRead;
+        if (_uploadWriteLength == _uploadWriteBufferSize) {
+            flushUploadData(connection);
+        }
+        syncUploadFile(connection);
+    } else {
+        writeUploadData(connection, destination, bytesRead);
+    }
+
+    return true;
+}
+
+void SDServer::finishFileUpload(Connection& connection) {
+    if (connection.sessionUpload) {
+        finishSessionWrite(connection);
+        return;
+    }
+
+    StorageLock lock(*this);
+    flushUploadData(connection);
+    const char* tempPath = connection.buffer;
+    const char* targetPath = tempPath + strlen(tempPath) + 1;
+    std::string_view statusLine = HTTP_500_INTERNAL_SERVER_ERROR;
+    char digest[9];
+    formatCRC32C(connection.digest, digest);
+    if (connection.file.curPosition() != connection.request.contentLength()) {
+        discardUploadFile(connection); // the card is full
+    } else if (connection.verifyDigest && connection.digest != connection.expectedDigest) {
+        discardUploadFile(connection); // damaged on the way, the target stays as it was
+        statusLine = HTTP_400_BAD_REQUEST;
+    } else {
+        endUploadFile(connection);
+        statusLine = replaceWithUpload(tempPath, targetPath);
+        if (statusLine == HTTP_500_INTERNAL_SERVER_ERROR) {
+            _fs->remove(tempPath);
+        } else {
+            storeDigest(targetPath, connection.digest);
+        }
+    }
+    invalidateDirectory(std::string_view(targetPath, strrchr(targetPath, '/') - targetPath));
+
+    sendUploadResponse(statusLine, _response, connection.keepAlive, digest);
+    finishResponse(connection);
+}
+
+// Moves a complete upload over its target, and returns the status line to
+// answer with. FAT can't rename over an existing file, so the target is
+// removed first.
+std::string_view SDServer::replaceWithUpload(const char* uploadPath, const char* targetPath) {
+    bool replacing = _fs->exists(targetPath);
+    if ((!replacing || _fs->remove(targetPath)) && _fs->rename(uploadPath, targetPath)) {
+        return replacing ? HTTP_204_NO_CONTENT : HTTP_201_CREATED;
+    }
+
+    return HTTP_500_INTERNAL_SERVER_ERROR;
+}
+
+// Reserving sizeHint bytes up front keeps the file contiguous and the FAT out
+// of the way while writing, endUploadFile() trims whatever wasn't used. It
+// fails harmlessly when there is no contiguous run of free clusters that long.
+void SDServer::prepareUploadFile(Connection& connection, uint64_t sizeHint) {
+    connection.file.preAllocate(sizeHint);
+    connection.unsyncedBytes = 0;
+    if (connection.file && !_uploadWriteOwner && _uploadWriteBufferSize != 0) {
+        _uploadWriteOwner = &connection;
+        _uploadWriteLength = 0;
+    }
+}
+
+void SDServer::writeUploadData(Connection& connection, const char* data, size_t length) {
+    if (&connection != _uploadWriteOwner) {
+        writeUploadFile(connection, data, length);
+    } else {
+        // Every flush writes a whole number of sectors, so the file position
+        // stays sector aligned and SdFat writes straight from the buffer
+        // instead of going through its single-sector cache.
+        while (length) {
+            if (_uploadWriteLength == 0 && length >= _uploadWriteBufferSize) {
+                size_t directLength = length / _uploadWriteBufferSize * _uploadWriteBufferSize;
+                writeUploadFile(connection, data, directLength);
+                data += directLength;
+                length -= directLength;
+                continue;
+            }
+            size_t count = std::min(length, _uploadWriteBufferSize - _uploadWriteLength);
+            memcpy(_uploadWriteBuffer + _uploadWriteLength, data, count);
+            _uploadWriteLength += count;
+            data += count;
+            length -= count;
+            if (_uploadWriteLength == _uploadWriteBufferSize) {
+                flushUploadData(connection);
+            }
+        }
+    }
+
+    syncUploadFile(connection);
+}
+
+void SDServer::syncUploadFile(Connection& connection) {
+    if (_uploadSyncInterval != 0 && connection.unsyncedBytes >= _uploadSyncInterval) {
+        flushUploadData(connection);
+        unsigned long start = micros();
+        connection.file.sync();
+        _metrics.recordDuration(ServerMetrics::Duration::UploadSync, micros() - start);
+        connection.unsyncedBytes = 0;
+    }
+}
+
+void SDServer::flushUploadData(Connection& connection) {
+    if (&connection != _uploadWriteOwner || _uploadWriteLength == 0) return;
+
+    writeUploadFile(connection, _uploadWriteBuffer, _uploadWriteLength);
+    _uploadWriteLength = 0;
+}
+
+void SDServer::writeUploadFile(Connection& connection, const char* data, size_t length) {
+    if (connection.digesting) {
+        connection.digest = updateCRC32C(connection.digest, data, length);
+    }
+    unsigned long start = micros();
+    connection.file.write(data, length);
+    _metrics.recordDuration(ServerMetrics::Duration::CardWrite, micros() - start);
+    connection.unsyncedBytes += length;
+}
+
+void SDServer::endUploadFile(Connection& connection) {
+    flushUploadData(connection);
+    if (&connection == _uploadWriteOwner) {
+        _uploadWriteOwner = nullptr;
+    }
+    if (connection.file.fileSize() != connection.file.curPosition()) {
+        connection.file.truncate(); // give back the unused part of the preallocation
+    }
+    unsigned long start = micros();
+    connection.file.close(); // syncs whatever is still cached
+    _metrics.recordDuration(ServerMetrics::Duration::UploadSync, micros() - start);
+}
+
+void SDServer::discardUploadFile(Connection& connection) {
+    if (&connection == _uploadWriteOwner) {
+        _uploadWriteOwner = nullptr;
+    }
+    connection.file.remove();
+}
+
+bool SDServer::claimPipeline(Connection& connection, PipelineDirection direction) {
+    if (!_pipeline.enabled() || _pipelineOwner) return false;
+
+    StorageLock lock(*this);
+    _pipeline.reset();
+    _pipelineDirection = direction;
+    _pipelineReadRemaining = connection.sendRemaining;
+    _pipelineFailed = false;
+    _pipelineOwner = &connection;
+#if !SDSERVER_STORAGE_ON_SECOND_CORE
+    serviceStorage(); // start reading so the first block can go out with the headers
+#endif
+
+    return true;
+}
+
+// Waits out any card work in progress on the other core, so the pipeline and
+// the connection's file can be reused.
+void SDServer::releasePipeline(Connection& connection) {
+    if (_pipelineOwner != &connection) return;
+
+    StorageLock lock(*this);
+    _pipelineOwner = nullptr;
+}
+
+bool SDServer::isPipelined(const Connection& connection) const {
+    return _pipelineOwner == &connection &&
+        (connection.state == Connection::State::SendingFile || connection.state == Connection::State::ReadingMultipartBody ||
+         connection.state == Connection::State::ReadingFileBody || connection.isExtracting());
+}
+
+void SDServer::serviceStorage() {
+    StorageLock lock(*this);
+    Connection* connection = _pipelineOwner;
+    if (!connection || _pipelineFailed) return;
+
+    if (_pipelineDirection == PipelineDirection::Download) {
+        // Fill every empty block from the file
+        char* block;
+        size_t capacity;
+        while (_pipelineReadRemaining != 0 && (block = _pipeline.producerBlock(capacity))) {
+            size_t bytesToRead = std::min<uint64_t>(capacity, _pipelineReadRemaining);
+            int bytesRead = readFileData(*connection, block, bytesToRead);
+            if (bytesRead <= 0) {
+                _pipelineFailed = true;
+                break;
+            }
+            _pipeline.produce(bytesRead);
+            _pipelineReadRemaining -= bytesRead;
+        }
+    } else {
+        // Write every received block to the card, parsing it first when it's multipart or an archive
+        const char* block;
+        size_t length;
+        while ((block = _pipeline.consumerBlock(length))) {
+            bool parsed = consumeUploadBody(*connection, block, length);
+            _pipeline.consume(length);
+            if (!parsed) {
+                _pipelineFailed = true;
+                break;
+            }
+        }
+    }
+}
+
+bool SDServer::sendPipelinedFileData(Connection& connection) {
+    if (_pipelineFailed) {
+        closeConnection(connection);
+        return true;
+    }
+
+    bool progressed = false;
+    const char* block;
+    size_t length;
+    while (connection.sendRemaining != 0 && (block = _pipeline.consumerBlock(length))) {
+        int writable = connection.client.availableForWrite() - (int)_response.bufferedLength();
+        if (writable <= 0) break;
+
+        size_t count = std::min(length, (size_t)writable);
+        if (_response.bufferedLength() != 0) {
+            // Let the headers and the first data share a write
+            count = std::min(count, _response.freeSpaceSize());
+            if (count == 0) break;
+            _response.write(block, count);
+        } else {
+            unsigned long start = micros();
+            count = connection.client.write(block, count);
+            _metrics.recordDuration(ServerMetrics::Duration::SocketWrite, micros() - start);
+            if (count == 0) break;
+            _metrics.addBytesSent(count);
+        }
+        _pipeline.consume(count);
+        connection.sendRemaining -= count;
+        progressed = true;
+    }
+
+    if (connection.sendRemaining == 0) {
+        finishResponse(connection);
+        return true;
+    }
+
+    return progressed || _response.bufferedLength() != 0;
+}
+
+bool SDServer::receivePipelinedBody(Connection& connection) {
+    if (_pipelineFailed || (connection.bodyRemaining == 0 && _pipeline.empty())) {
+        releasePipeline(connection);
+        endUploadBody(connection, _pipelineFailed);
+        return true;
+    }
+    if (connection.bodyRemaining == 0) return false; // the card side is still writing
+
+    bool progressed = false;
+    char* block;
+    size_t capacity;
+    while (connection.bodyRemaining != 0 && (block = _pipeline.producerBlock(capacity))) {
+        int available = connection.client.available();
+        if (available <= 0) break;
+
+        size_t bytesToRead = std::min((size_t)available, capacity);
+        if (connection.bodyRemaining < bytesToRead) {
+            bytesToRead = connection.bodyRemaining; // anything after the body belongs to the next request
+        }
+        int bytesRead = connection.client.read(reinterpret_cast<uint8_t*>(block), bytesToRead);
+        if (bytesRead <= 0) break;
+        _metrics.addBytesReceived(bytesRead);
+        _pipeline.produce(bytesRead);
+        connection.bodyRemaining -= bytesRead;
+        progressed = true;
+    }
+
+    return progressed;
+}
+
+bool SDServer::sendFileData(Connection& connection) {
+    if (isPipelined(connection)) return sendPipelinedFileData(connection);
+
+    if (connection.sendRemaining == 0) {
+        if (!connection.multipartRanges || !startNextRangePart(connection)) {
+            finishResponse(connection);
+        }
+        return true;
+    }
+
+    // Anything already buffered (headers, a part header) goes out in the same
+    // write as the file data, so it counts against the socket's free space
+    int writable = connection.client.availableForWrite() - (int)_response.bufferedLength();
+    if (writable <= 0) return _response.bufferedLength() != 0;
+
+    size_t bytesToRead = std::min((size_t)writable, _response.freeSpaceSize());
+    if (connection.sendRemaining < bytesToRead) {
+        bytesToRead = connection.sendRemaining;
+    }
+    int bytesRead = readFileData(connection, _response.freeSpace(), bytesToRead);
+    if (bytesRead <= 0) {
+        closeConnection(connection);
+        return true;
+    }
+    _response.commit(bytesRead);
+    connection.sendRemaining -= bytesRead;
+
+    return true;
+}
+
+// Reads the next length bytes of the file being sent, from the file cache
+// when it has them
+int SDServer::readFileData(Connection& connection, char* buffer, size_t length) {
+    uint64_t position = connection.file.curPosition();
+    int result = _fileCache.read(connection.cachedFileId, position, buffer, length);
+    if (result > 0) {
+        connection.file.seekCur(result); // only moves the position, the data isn't read
+    } else {
+        unsigned long start = micros();
+        result = readFileSectors(connection, buffer, length);
+        _metrics.recordDuration(ServerMetrics::Duration::CardRead, micros() - start);
+        if (result > 0) {
+            _fileCache.fill(connection.cachedFileId, position, buffer, result);
+        }
+    }
+    if (result > 0 && connection.digesting) {
+        // Once the whole file has gone by for ?digest, its digest is kept for next time
+        connection.digest = updateCRC32C(connection.digest, buffer, result);
+        if (connection.file.curPosition() == connection.file.fileSize()) {
+            connection.digesting = false;
+            _digests.store(connection.request.path().data(), connection.file.fileSize(), fileModified(connection.file), connection.digest);
+        }
+    }
+
+    return result;
+}
+
+// A contiguous file is read straight from the card in whole sectors, skipping
+// SdFat's sector cache and cluster chain; only a partial sector at either end
+// goes through read().
+int SDServer::readFileSectors(Connection& connection, char* buffer, size_t length) {
+    FsFile& file = connection.file;
+    if (connection.firstSector == 0) return file.read(buffer, length);
+
+    // Whole sectors go no further than the end of the file, so the last
+    // partial sector is read like the first
+    uint64_t position = file.curPosition();
+    length = std::min<uint64_t>(length, file.fileSize() - position);
+    size_t sectorOffset = position % 512;
+    if (sectorOffset != 0 || length < 512) {
+        // Stop at the sector boundary so the next read can be a raw one
+        return file.read(buffer, std::min(length, 512 - sectorOffset));
+    }
+
+    size_t sectors = length / 512;
+    uint32_t sector = connection.firstSector + position / 512;
+    if (!_fs->card()->readSectors(sector, reinterpret_cast<uint8_t*>(buffer), sectors)) return -1;
+    file.seekCur(sectors * 512); // cheap for a contiguous file, no cluster chain walk
+
+    return sectors * 512;
+}
+
+// Answers GET /file?digest with the file's CRC32C, from the digest store
+// when it's there and otherwise by reading the file through once.
+void SDServer::beginDigest(Connection& connection) {
+    if (_digests.lookup(connection.request.path().data(), connection.file.fileSize(), fileModified(connection.file), connection.digest)) {
+        sendDigestResponse(connection);
+        return;
+    }
+
+    connection.digest = 0;
+    connection.digesting = true;
+    connection.firstSector = contiguousFirstSector(connection.file);
+    connection.state = Connection::State::ComputingDigest;
+    if (connection.file.fileSize() == 0) {
+        sendDigestResponse(connection);
+    }
+}
+
+bool SDServer::computeDigest(Connection& connection) {
+    // The working buffer is free until the response is written
+    for (size_t total = 0; connection.digesting && total < DIGEST_BYTES_PER_CALL;) {
+        uint64_t fileRemaining = connection.file.fileSize() - connection.file.curPosition();
+        int bytesRead = readFileData(connection, _response.freeSpace(), std::min<uint64_t>(_response.freeSpaceSize(), fileRemaining));
+        if (bytesRead <= 0) {
+            sendHTMLResponse(HTTP_500_INTERNAL_SERVER_ERROR, _response);
+            closeConnection(connection);
+            return true;
+        }
+        total += bytesRead;
+    }
+    if (!connection.digesting) {
+        sendDigestResponse(connection); // readFileData() stored it on reaching the end
+    }
+
+    return true;
+}
+
+void SDServer::sendDigestResponse(Connection& connection) {
+    char digest[9];
+    formatCRC32C(connection.digest, digest);
+    _response.println(HTTP_200_OK);
+    _response.print(HTTP_CONTENT_TYPE);
+    _response.println("text/plain");
+    _response.print(HTTP_CONTENT_CRC32C);
+    _response.println(digest);
+    _response.print(HTTP_CONTENT_LENGTH);
+    _response.println(sizeof(digest));
+    _response.println(connection.keepAlive ? HTTP_CONNECTION_KEEP_ALIVE : HTTP_CONNECTION_CLOSE);
+    _response.println();
+    if (!connection.headOnly) {
+        digest[8] = '\n';
+        _response.write(digest, sizeof(digest));
+    }
+    finishResponse(connection);
+}
+
+// Records the digest of a file that was just written whole
+void SDServer::storeDigest(const char* path, uint32_t crc) {
+    FsFile file = _fs->open(path);
+    if (file) {
+        _digests.store(path, file.fileSize(), fileModified(file), crc);
+    }
+}
+
+// Streams a file as it grows, GET /file?follow=1, like tail -f. The body
+// starts at &offset=N, at the last &tail=N bytes, or at the current end of
+// the file, and is chunked (delimited by closing the connection for
+// HTTP/1.0). With follow=sse it's sent as Server-Sent Events instead, so a
+// browser's EventSource that reconnects resumes where it left off. The
+// stream ends once the file hasn't grown for SDSERVER_FOLLOW_IDLE_TIMEOUT_MS.
+// Data appended through another file handle only shows up once it's synced.
+void SDServer::beginFollow(Connection& connection) {
+    HTTPRequestParser& request = connection.request;
+    uint64_t fileSize = connection.file.size();
+    uint64_t position = fileSize;
+    uint64_t tail = 0;
+    connection.eventStream = request.queryParameter("follow") == "sse";
+    std::string_view offset = request.queryParameter("offset");
+    if (connection.eventStream && request.hasHeader(HTTPRequestParser::Header::LastEventID)) {
+        offset = request.header(HTTPRequestParser::Header::LastEventID);
+    }
+    if (!parseDecimal(offset, position) || !parseDecimal(request.queryParameter("tail"), tail)) {
+        sendHTMLResponse(HTTP_400_BAD_REQUEST, _response, connection.keepAlive);
+        finishResponse(connection);
+        return;
+    }
+    if (tail != 0) {
+        position = fileSize - std::min(tail, fileSize);
+    }
+    position = std::min(position, fileSize);
+    if (!connection.headOnly) {
+        connection.keepAlive = false; // the body only ends with the stream
+    }
+
+    _response.println(HTTP_200_OK);
+    _response.print(HTTP_CONTENT_TYPE);
+    _response.println(connection.eventStream ? "text/event-stream" : "text/plain");
+    _response.println(HTTP_CACHE_CONTROL_NO_CACHE);
+    if (request.isHTTP11()) {
+        _response.println(HTTP_TRANSFER_ENCODING_CHUNKED);
+    }
+    _response.println(connection.keepAlive ? HTTP_CONNECTION_KEEP_ALIVE : HTTP_CONNECTION_CLOSE);
+    _response.println();
+    if (connection.headOnly) {
+        finishResponse(connection);
+        return;
+    }
+
+    connection.file.seekSet(position);
+    connection.sendRemaining = fileSize - position;
+    connection.firstSector = 0; // the file may not stay contiguous as it grows
+    connection.eventLineOpen = false;
+    connection.lastPoll = millis();
+    connection.state = Connection::State::FollowingFile;
+}
+
+bool SDServer::sendFollowData(Connection& connection) {
+    if (connection.sendRemaining == 0) {
+        unsigned long now = millis();
+        if (now - connection.lastActivity > SDSERVER_FOLLOW_IDLE_TIMEOUT_MS) {
+            endFollow(connection);
+            return true;
+        }
+        if (now - connection.lastPoll < SDSERVER_FOLLOW_POLL_MS) return false;
+
+        connection.lastPoll = now;
+        if (!pollFollowedFile(connection)) {
+            endFollow(connection); // deleted or replaced by a directory
+            return true;
+        }
+        if (connection.sendRemaining == 0) return false;
+    }
+
+    int writable = connection.client.availableForWrite() - (int)_response.bufferedLength();
+    if (writable <= 0) return _response.bufferedLength() != 0;
+
+    // The writer is reset every step; each flush becomes one chunk of the body
+    if (connection.request.isHTTP11()) {
+        _response.beginChunked();
+    }
+    if (connection.eventStream) {
+        if (!writeFollowEvents(connection, writable)) {
+            closeConnection(connection);
+        }
+        return true;
+    }
+
+    size_t bytesToRead = std::min((size_t)writable, _response.freeSpaceSize());
+    if (connection.sendRemaining < bytesToRead) {
+        bytesToRead = connection.sendRemaining;
+    }
+    int bytesRead = readFileData(connection, _response.freeSpace(), bytesToRead);
+    if (bytesRead <= 0) {
+        closeConnection(connection);
+        return true;
+    }
+    _response.commit(bytesRead);
+    connection.sendRemaining -= bytesRead;
+
+    return true;
+}
+
+// Writes up to about writable bytes of the followed file's new data as
+// Server-Sent Events. Every line becomes a "data:" field with any CRs
+// dropped, and whenever a step stops at the end of a line the event is
+// dispatched with the file offset after it as its id.
+bool SDServer::writeFollowEvents(Connection& connection, size_t writable) {
+    char block[128];
+    size_t budget = writable / 2; // leave room for the fields' framing
+    bool wrote = false;
+    while (connection.sendRemaining != 0 && budget != 0) {
+        size_t bytesToRead = std::min<uint64_t>({ sizeof(block), budget, connection.sendRemaining });
+        int bytesRead = readFileData(connection, block, bytesToRead);
+        if (bytesRead <= 0) return false;
+        connection.sendRemaining -= bytesRead;
+        budget -= bytesRead;
+        wrote = true;
+
+        const char* data = block;
+        const char* end = block + bytesRead;
+        while (data != end) {
+            if (!connection.eventLineOpen) {
+                _response.print("data: ");
+                connection.eventLineOpen = true;
+            }
+            const char* lineEnd = static_cast<const char*>(memchr(data, '\n', end - data));
+            const char* segmentEnd = lineEnd ? lineEnd : end;
+            for (const char* cr; (cr = static_cast<const char*>(memchr(data, '\r', segmentEnd - data))); data = cr + 1) {
+                _response.write(data, cr - data);
+            }
+            _response.write(data, segmentEnd - data);
+            data = segmentEnd;
+            if (lineEnd) {
+                _response.write("\n", 1);
+                connection.eventLineOpen = false;
+                ++data;
+            }
+        }
+    }
+
+    if (wrote && !connection.eventLineOpen) {
+        _response.print("id: ");
+        _response.print(connection.file.curPosition());
+        _response.write("\n\n", 2);
+    }
+
+    return true;
+}
+
+// Reopens the followed file to pick up its current size, which SdFat only
+// reads from the directory entry on open. A file that got shorter has been
+// truncated or replaced, so it's sent again from the start.
+bool SDServer::pollFollowedFile(Connection& connection) {
+    uint64_t position = connection.file.curPosition();
+    connection.file.close();
+    connection.file = _directories.open(connection.request.path());
+    if (!connection.file || connection.file.isDirectory()) return false;
+
+    uint64_t fileSize = connection.file.size();
+    if (fileSize < position) {
+        position = 0;
+    }
+    connection.file.seekSet(position);
+    connection.sendRemaining = fileSize - position;
+
+    return true;
+}
+
+void SDServer::endFollow(Connection& connection) {
+    if (connection.request.isHTTP11()) {
+        _response.beginChunked();
+        _response.endChunked();
+    }
+    finishResponse(connection);
+}
+
+void SDServer::listFiles(Connection& connection) {
+    std::string_view directory = connection.request.path();
+    if ((connection.listingId = _listingCache.acquire(directory)) != DirectoryListingCache::NONE) {
+        sendCachedListingResponse(connection);
+        return;
+    }
+
+    connection.file.rewindDirectory();
+    if ((connection.listingId = _listingCache.beginBuild(directory)) != DirectoryListingCache::NONE) {
+        connection.state = Connection::State::BuildingListing;
+        return;
+    }
+
+    streamListing(connection);
+}
+
+// Sends a listing as it's read from the card, for when it can't be cached.
+// It's chunked, or delimited by closing the connection for HTTP/1.0.
+void SDServer::streamListing(Connection& connection) {
+    bool chunked = connection.request.isHTTP11();
+    bool gzip = !connection.headOnly && claimDeflater(connection);
+    _response.println(HTTP_200_OK);
+    _response.print(HTTP_CONTENT_TYPE);
+    _response.println("text/html");
+    if (gzip) {
+        _response.println(HTTP_CONTENT_ENCODING_GZIP);
+    }
+    _response.println(HTTP_VARY_ACCEPT_ENCODING);
+    if (chunked) {
+        _response.println(HTTP_TRANSFER_ENCODING_CHUNKED);
+    }
+    _response.println(connection.keepAlive ? HTTP_CONNECTION_KEEP_ALIVE : HTTP_CONNECTION_CLOSE);
+    _response.println();
+    if (connection.headOnly) {
+        finishResponse(connection);
+        return;
+    }
+
+    if (chunked) {
+        _response.beginChunked();
+    }
+    if (gzip) {
+        _deflater.begin(_response);
+    }
+    writeListing(connection, HTML_START.data(), HTML_START.size());
+
+    connection.state = Connection::State::SendingListing;
+}
+
+// Writes one directory entry's link to the listing through write(data, length).
+template <typename Write>
+static void renderListingEntry(Write&& write, const char* directoryPath, const char* fileName) {
+    static const char linkStart[] = "<a href=\"";
+    static const char linkMiddle[] = "\">";
+    static const char linkEnd[] = "</a><br/>";
+
+    size_t directoryPathLength = strlen(directoryPath);
+    size_t fileNameLength = strlen(fileName);
+    write(linkStart, sizeof(linkStart) - 1);
+    write(directoryPath, directoryPathLength);
+    if (directoryPathLength == 0 || directoryPath[directoryPathLength - 1] != '/') {
+        write("/", 1);
+    }
+    write(fileName, fileNameLength);
+    write(linkMiddle, sizeof(linkMiddle) - 1);
+    write(fileName, fileNameLength);
+    write(linkEnd, sizeof(linkEnd) - 1);
+}
+
+bool SDServer::sendListingEntries(Connection& connection) {
+    const char* directoryPath = connection.request.path().data();
+    size_t entryReserve = LISTING_ENTRY_RESERVE + 3 * strlen(directoryPath);
+    int writable = connection.client.availableForWrite();
+    if (writable <= 0 || (size_t)writable < std::min(entryReserve, LISTING_ENTRY_TYPICAL)) return false;
+
+    char fileName[256];
+    auto write = [this, &connection](const char* data, size_t length) { writeListing(connection, data, length); };
+    bool chunked = connection.request.isHTTP11();
+
+    // The writer is reset every step; each flush becomes one chunk of the body
+    if (chunked) {
+        _response.beginChunked();
+    }
+    uint64_t bytesWritten = _response.bytesWritten();
+    FsFile entry;
+    for (size_t i = 0; i < LISTING_ENTRIES_PER_CALL && _response.bytesWritten() == bytesWritten &&
+        (i == 0 || _response.bufferedLength() + entryReserve <= (size_t)writable); ++i) {
+        if (!(entry = connection.file.openNextFile())) {
+            writeListing(connection, HTML_END.data(), HTML_END.size());
+            if (connection.gzipEncoded) {
+                _deflater.finish();
+            }
+            if (chunked) {
+                _response.endChunked();
+            }
+            finishResponse(connection);
+            break;
+        }
+
+        entry.getName(fileName, sizeof(fileName));
+        entry.close();
+        if (requiresURLEncoding(fileName)) continue; // don't support spaces and other special characters in file names
+        if (isDigestStore(directoryPath, fileName)) continue;
+        renderListingEntry(write, directoryPath, fileName);
+    }
+
+    return true;
+}
+
+// Renders a directory's entries into the listing cache, then answers from it.
+bool SDServer::buildListingEntries(Connection& connection) {
+    const char* directoryPath = connection.request.path().data();
+    char fileName[256];
+    bool fits = true;
+    auto append = [this, &connection, &fits](const char* data, size_t length) {
+        fits = fits && _listingCache.append(connection.listingId, data, length);
+    };
+
+    FsFile entry;
+    for (size_t i = 0; i < LISTING_ENTRIES_PER_CALL; ++i) {
+        if (!(entry = connection.file.openNextFile())) {
+            _listingCache.commitBuild(connection.listingId);
+            sendCachedListingResponse(connection);
+            break;
+        }
+
+        entry.getName(fileName, sizeof(fileName));
+        entry.close();
+        if (requiresURLEncoding(fileName)) continue; // don't support spaces and other special characters in file names
+        if (isDigestStore(directoryPath, fileName)) continue;
+        renderListingEntry(append, directoryPath, fileName);
+        if (!fits) {
+            // Too large for the cache, start over without it
+            _listingCache.abortBuild(connection.listingId);
+            connection.listingId = DirectoryListingCache::NONE;
+            connection.file.rewindDirectory();
+            streamListing(connection);
+            break;
+        }
+    }
+
+    return true;
+}
+
+void SDServer::sendCachedListingResponse(Connection& connection) {
+    HTTPRequestParser& request = connection.request;
+    connection.file.close(); // the listing is all that's needed from here on
+
+    // The compressed variant gets its own ETag. It can be revalidated even
+    // while the deflater is busy with another listing. Its length isn't known
+    // up front, so it's chunked, or delimited by closing the connection for
+    // HTTP/1.0.
+    char etag[16];
+    _listingCache.formatETag(connection.listingId, etag);
+    std::string_view ifNoneMatch = request.header(HTTPRequestParser::Header::IfNoneMatch);
+    bool notModified = headerHasETag(ifNoneMatch, etag);
+    if (request.acceptsEncoding("gzip")) {
+        strcpy(etag + 9, "-gz\"");
+        if (headerHasETag(ifNoneMatch, etag)) {
+            notModified = true;
+        } else if (notModified || connection.headOnly || !claimDeflater(connection)) {
+            etag[9] = '"';
+            etag[10] = '\0';
+        }
+    }
+
+    _response.println(notModified ? HTTP_304_NOT_MODIFIED : HTTP_200_OK);
+    _response.print(HTTP_ETAG);
+    _response.println(etag);
+    _response.println(HTTP_CACHE_CONTROL_NO_CACHE); // revalidate every time, uploads change listings
+    _response.println(HTTP_VARY_ACCEPT_ENCODING);
+    if (notModified) {
+        _response.println(connection.keepAlive ? HTTP_CONNECTION_KEEP_ALIVE : HTTP_CONNECTION_CLOSE);
+        _response.println();
+        finishResponse(connection);
+        return;
+    }
+
+    connection.sendRemaining = HTML_START.size() + _listingCache.body(connection.listingId).size() + HTML_END.size();
+    _response.print(HTTP_CONTENT_TYPE);
+    _response.println("text/html");
+    if (connection.gzipEncoded) {
+        _response.println(HTTP_CONTENT_ENCODING_GZIP);
+        if (request.isHTTP11()) {
+            _response.println(HTTP_TRANSFER_ENCODING_CHUNKED);
+        }
+    } else {
+        _response.print(HTTP_CONTENT_LENGTH);
+        _response.println(connection.sendRemaining);
+    }
+    _response.println(connection.keepAlive ? HTTP_CONNECTION_KEEP_ALIVE : HTTP_CONNECTION_CLOSE);
+    _response.println();
+    if (connection.headOnly) {
+        finishResponse(connection);
+        return;
+    }
+    if (connection.gzipEncoded) {
+        if (request.isHTTP11()) {
+            _response.beginChunked();
+        }
+        _deflater.begin(_response);
+    }
+    connection.state = Connection::State::SendingCachedListing;
+}
+
+bool SDServer::sendCachedListingData(Connection& connection) {
+    int writable = connection.client.availableForWrite() - (int)_response.bufferedLength();
+    if (writable <= 0) return _response.bufferedLength() != 0;
+
+    // The writer is reset every step; each flush becomes one chunk of the body
+    bool chunked = connection.gzipEncoded && connection.request.isHTTP11();
+    if (chunked) {
+        _response.beginChunked();
+    }
+
+    std::string_view parts[] = { HTML_START, _listingCache.body(connection.listingId), HTML_END };
+    size_t offset = parts[0].size() + parts[1].size() + parts[2].size() - connection.sendRemaining;
+    size_t budget = std::min((size_t)writable, _response.freeSpaceSize());
+    for (std::string_view part : parts) {
+        if (offset >= part.size()) {
+            offset -= part.size();
+            continue;
+        }
+        size_t count = std::min(part.size() - offset, budget);
+        writeListing(connection, part.data() + offset, count);
+        connection.sendRemaining -= count;
+        budget -= count;
+        offset = 0;
+        if (budget == 0) break;
+    }
+
+    if (connection.sendRemaining == 0) {
+        if (connection.gzipEncoded) {
+            _deflater.finish();
+        }
+        if (chunked) {
+            _response.endChunked();
+        }
+        finishResponse(connection);
+    }
+
+    return true;
+}
+
+#if SDSERVER_ENABLE_ARCHIVES
+// Sends a directory tree as a tar archive, GET /dir?archive=tar. The archive is
+// chunked, or, for HTTP/1.0 clients and with &length, preceded by a pass over
+// the tree that works out its Content-Length. One archive is sent at a time.
+void SDServer::beginArchive(Connection& connection) {
+    HTTPRequestParser& request = connection.request;
+    if (request.queryParameter("archive") != "tar") {
+        sendHTMLResponse(HTTP_400_BAD_REQUEST, _response, connection.keepAlive);
+        finishResponse(connection);
+        return;
+    }
+    if (_archiveOwner) {
+        sendHTMLResponse(HTTP_503_SERVICE_UNAVAILABLE, _response, connection.keepAlive);
+        finishResponse(connection);
+        return;
+    }
+
+    _archiveOwner = &connection;
+    _archive.begin(connection.file);
+    _archiveSize = 0;
+    _archivePadding = 0;
+    _archiveEnding = false;
+    connection.sendRemaining = 0;
+    if (!request.isHTTP11() || request.queryParameter("length").data()) {
+        _archiveSize = TarArchive::END_SIZE;
+        connection.state = Connection::State::SizingArchive;
+        return;
+    }
+
+    sendArchiveResponse(connection);
+}
+
+bool SDServer::sizeArchive(Connection& connection) {
+    for (size_t i = 0; i < LISTING_ENTRIES_PER_CALL; ++i) {
+        TarArchive::Entry entry = _archive.next(connection.file);
+        if (entry == TarArchive::Entry::None) {
+            _archive.rewind();
+            sendArchiveResponse(connection);
+            break;
+        }
+        _archiveSize += TarArchive::entrySize(entry, connection.file.fileSize());
+        connection.file.close();
+    }
+
+    return true;
+}
+
+void SDServer::sendArchiveResponse(Connection& connection) {
+    // Named after the directory, or the card for the root
+    std::string_view name = connection.request.path();
+    while (!name.empty() && name.back() == '/') name.remove_suffix(1);
+    name.remove_prefix(name.rfind('/') + 1);
+    if (name.empty()) {
+        name = "sd";
+    }
+
+    _response.println(HTTP_200_OK);
+    _response.print(HTTP_CONTENT_TYPE);
+    _response.println("application/x-tar");
+    _response.print("Content-Disposition: attachment; filename=\"");
+    _response.print(name);
+    _response.println(".tar\"");
+    if (_archiveSize != 0) {
+        _response.print(HTTP_CONTENT_LENGTH);
+        _response.println(_archiveSize);
+    } else {
+        _response.println(HTTP_TRANSFER_ENCODING_CHUNKED);
+    }
+    _response.println(connection.keepAlive ? HTTP_CONNECTION_KEEP_ALIVE : HTTP_CONNECTION_CLOSE);
+    _response.println();
+    if (connection.headOnly) {
+        finishResponse(connection);
+        return;
+    }
+
+    connection.state = Connection::State::SendingArchive;
+}
+
+bool SDServer::sendArchiveData(Connection& connection) {
+    int writable = connection.client.availableForWrite() - (int)_response.bufferedLength();
+    if (writable <= 0) return _response.bufferedLength() != 0;
+
+    // The writer is reset every step; each flush becomes one chunk of the body
+    if (_archiveSize == 0) {
+        _response.beginChunked();
+    }
+    uint64_t bytesWritten = _response.bytesWritten();
+    while (_response.bytesWritten() == bytesWritten && _response.freeSpaceSize() != 0) {
+        if (connection.sendRemaining != 0) {
+            // Member data, read straight into the response
+            size_t length = std::min<uint64_t>(_response.freeSpaceSize(), connection.sendRemaining);
+            int bytesRead = readFileData(connection, _response.freeSpace(), length);
+            if (bytesRead <= 0) {
+                closeConnection(connection);
+                return true;
+            }
+            _response.commit(bytesRead);
+            connection.sendRemaining -= bytesRead;
+            continue;
+        }
+        if (_archivePadding != 0) {
+            static const char zeros[64] = {};
+            size_t count = std::min(_archivePadding, sizeof(zeros));
+            _response.write(zeros, count);
+            _archivePadding -= count;
+            continue;
+        }
+        connection.file.close();
+        if (_archiveEnding) {
+            if (_archiveSize == 0) {
+                _response.endChunked();
+            }
+            finishResponse(connection);
+            break;
+        }
+
+        TarArchive::Entry entry = _archive.next(connection.file);
+        if (entry == TarArchive::Entry::None) {
+            _archivePadding = TarArchive::END_SIZE;
+            _archiveEnding = true;
+            continue;
+        }
+        uint16_t fatDate = 0, fatTime = 0;
+        connection.file.getModifyDateTime(&fatDate, &fatTime);
+        char header[TarArchive::BLOCK_SIZE];
+        _archive.formatHeader(header, entry, connection.file.fileSize(), fatDate, fatTime);
+        _response.write(header, sizeof(header));
+        if (entry == TarArchive::Entry::File) {
+            connection.sendRemaining = connection.file.fileSize();
+            connection.firstSector = contiguousFirstSector(connection.file);
+            _archivePadding = TarArchive::paddingSize(connection.sendRemaining);
+        }
+    }
+
+    return true;
+}
+
+#endif
+
+void SDServer::releaseArchive([[maybe_unused]] Connection& connection) {
+#if SDSERVER_ENABLE_ARCHIVES
+    if (_archiveOwner != &connection) return;
+
+    _archive.end();
+    _archiveOwner = nullptr;
+#endif
+}
+
+#if SDSERVER_ENABLE_METRICS
+// Serves the counters collected in _metrics, for Prometheus to scrape. The
+// body is chunked, or delimited by closing the connection for HTTP/1.0.
+void SDServer::sendMetrics(Connection& connection) {
+    bool chunked = connection.request.isHTTP11();
+    _response.println(HTTP_200_OK);
+    _response.print(HTTP_CONTENT_TYPE);
+    _response.println("text/plain; version=0.0.4");
+    _response.println(HTTP_CACHE_CONTROL_NO_CACHE);
+    if (chunked) {
+        _response.println(HTTP_TRANSFER_ENCODING_CHUNKED);
+    }
+    _response.println(connection.keepAlive ? HTTP_CONNECTION_KEEP_ALIVE : HTTP_CONNECTION_CLOSE);
+    _response.println();
+    if (!connection.headOnly) {
+        if (chunked) {
+            _response.beginChunked();
+        }
+        _metrics.write(_response);
+        if (chunked) {
+            _response.endChunked();
+        }
+    }
+    finishResponse(connection);
+}
+#endif
+
+// Counts the response to the connection's current request, once. A request
+// dropped before any response was started isn't counted.
+void SDServer::recordRequest(Connection& connection) {
+    if (!connection.requestOpen) return;
+
+    connection.requestOpen = false;
+    uint16_t status = _response.status() != 0 ? _response.status() : connection.status;
+    if (status == 0) return;
+
+    _metrics.recordRequest(connection.request.method(), status);
+    _metrics.recordDuration(ServerMetrics::Duration::Request, micros() - connection.requestStart);
+}
+
+// Writes text as the inside of a JSON string.
+template <typename Write>
+static void writeJSONString(Write&& write, const char* text) {
+    static const char HEX_DIGITS[] = "0123456789abcdef";
+    const char* run = text;
+    for (; *text; ++text) {
+        uint8_t c = *text;
+        if (c >= 0x20 && c != '"' && c != '\\') continue;
+
+        write(run, text - run);
+        run = text + 1;
+        char escape[6] = { '\\', static_cast<char>(c), 0 };
+        if (c < 0x20) {
+            memcpy(escape + 1, "u00", 3);
+            escape[4] = HEX_DIGITS[c >> 4];
+            escape[5] = HEX_DIGITS[c & 0xF];
+        }
+        write(escape, c < 0x20 ? 6 : 2);
+    }
+    write(run, text - run);
+}
+
+// Writes text percent-encoded for a URL path, leaving '/' alone.
+template <typename Write>
+static void writeURLPath(Write&& write, const char* text) {
+    static const char HEX_DIGITS[] = "0123456789ABCDEF";
+    const char* run = text;
+    for (; *text; ++text) {
+        uint8_t c = *text;
+        if (isalnum(c) || strchr("-._~/", c)) continue;
+
+        write(run, text - run);
+        run = text + 1;
+        char escape[3] = { '%', HEX_DIGITS[c >> 4], HEX_DIGITS[c & 0xF] };
+        write(escape, 3);
+    }
+    write(run, text - run);
+}
+
+// Lists a directory as JSON for scripts, GET /dir?format=json. Every entry is
+// included, with its size and modification time. With &limit=N the listing
+// is cut into pages of N entries; "next" then holds the cursor to pass as
+// &cursor= for the following page, or null after the last one. A cursor is
+// a position within the directory, so a page is read without walking the
+// entries before it. The body is chunked, or delimited by closing the
+// connection for HTTP/1.0.
+void SDServer::beginJSONListing(Connection& connection) {
+    HTTPRequestParser& request = connection.request;
+    uint64_t position = 0;
+    uint64_t limit = 0;
+    // A cursor is the position of a 32-byte directory entry that a previous
+    // page ended before, so it has to land on an entry boundary and still find
+    // an entry there. Anything else would read as an empty last page.
+    bool valid = parseDecimal(request.queryParameter("cursor"), position) &&
+        parseDecimal(request.queryParameter("limit"), limit) &&
+        position % 32 == 0 && connection.file.seekSet(position);
+    if (valid && position != 0) {
+        FsFile entry = connection.file.openNextFile();
+        valid = entry && connection.file.seekSet(position);
+        entry.close();
+    }
+    if (!valid) {
+        sendHTMLResponse(HTTP_400_BAD_REQUEST, _response, connection.keepAlive);
+        finishResponse(connection);
+        return;
+    }
+    connection.pageEntries = 0;
+    connection.pageLimit = limit == 0 || limit > UINT32_MAX ? UINT32_MAX : limit;
+
+    bool gzip = !connection.headOnly && claimDeflater(connection);
+    _response.println(HTTP_200_OK);
+    _response.print(HTTP_CONTENT_TYPE);
+    _response.println("application/json");
+    if (gzip) {
+        _response.println(HTTP_CONTENT_ENCODING_GZIP);
+    }
+    _response.println(HTTP_VARY_ACCEPT_ENCODING);
+    _response.println(HTTP_CACHE_CONTROL_NO_CACHE);
+    if (request.isHTTP11()) {
+        _response.println(HTTP_TRANSFER_ENCODING_CHUNKED);
+    }
+    _response.println(connection.keepAlive ? HTTP_CONNECTION_KEEP_ALIVE : HTTP_CONNECTION_CLOSE);
+    _response.println();
+    if (connection.headOnly) {
+        finishResponse(connection);
+        return;
+    }
+
+    if (request.isHTTP11()) {
+        _response.beginChunked();
+    }
+    if (gzip) {
+        _deflater.begin(_response);
+    }
+    static const char start[] = "{\"entries\":[";
+    writeListing(connection, start, sizeof(start) - 1);
+
+    connection.state = Connection::State::SendingJSONListing;
+}
+
+bool SDServer::sendJSONListingEntries(Connection& connection) {
+    const char* directoryPath = connection.request.path().data();
+    size_t entryReserve = LISTING_ENTRY_RESERVE + 3 * strlen(directoryPath);
+    int writable = connection.client.availableForWrite();
+    if (writable <= 0 || (size_t)writable < std::min(entryReserve, LISTING_ENTRY_TYPICAL)) return false;
+
+    bool directoryHasSlash = directoryPath[0] && directoryPath[strlen(directoryPath) - 1] == '/';
+    char fileName[256];
+    auto write = [this, &connection](const char* data, size_t length) { writeListing(connection, data, length); };
+    auto print = [&write](const char* text) { write(text, strlen(text)); };
+    bool chunked = connection.request.isHTTP11();
+
+    // The writer is reset every step; each flush becomes one chunk of the body
+    if (chunked) {
+        _response.beginChunked();
+    }
+    uint64_t bytesWritten = _response.bytesWritten();
+    FsFile entry;
+    for (size_t i = 0; i < LISTING_ENTRIES_PER_CALL && _response.bytesWritten() == bytesWritten &&
+        (i == 0 || _response.bufferedLength() + entryReserve <= (size_t)writable); ++i) {
+        uint64_t position = connection.file.curPosition();
+        entry = connection.file.openNextFile();
+        if (!entry || connection.pageEntries == connection.pageLimit) {
+            // The page ends, with the cursor of the entry that starts the next one
+            print("],\"next\":");
+            if (entry) {
+                char cursor[21];
+                print("\"");
+                print(formatDecimal(position, cursor));
+                print("\"");
+            } else {
+                print("null");
+            }
+            print("}\n");
+            if (connection.gzipEncoded) {
+                _deflater.finish();
+            }
+            if (chunked) {
+                _response.endChunked();
+            }
+            finishResponse(connection);
+            break;
+        }
+
+        entry.getName(fileName, sizeof(fileName));
+        bool isDirectory = entry.isDirectory();
+        uint64_t size = isDirectory ? 0 : entry.fileSize();
+        uint16_t fatDate = 0, fatTime = 0;
+        entry.getModifyDateTime(&fatDate, &fatTime);
+        entry.close();
+        if (isDigestStore(directoryPath, fileName)) continue;
+
+        char number[21];
+        char mtime[20];
+        snprintf(mtime, sizeof(mtime), "%04u-%02u-%02uT%02u:%02u:%02u",
+            1980 + (fatDate >> 9), (fatDate >> 5) & 0x0F, fatDate & 0x1F, fatTime >> 11, (fatTime >> 5) & 0x3F, (fatTime & 0x1F) * 2);
+        print(connection.pageEntries++ == 0 ? "{\"name\":\"" : ",{\"name\":\"");
+        writeJSONString(write, fileName);
+        print(isDirectory ? "\",\"type\":\"directory\",\"size\":" : "\",\"type\":\"file\",\"size\":");
+        print(formatDecimal(size, number));
+        print(",\"mtime\":\"");
+        print(mtime);
+        print("\",\"href\":\"");
+        writeURLPath(write, directoryPath);
+        if (!directoryHasSlash) {
+            print("/");
+        }
+        writeURLPath(write, fileName);
+        print("\"}");
+    }
+
+    return true;
+}
+
+// Takes the deflater for a listing when the client accepts gzip and no other
+// listing is being compressed.
+bool SDServer::claimDeflater(Connection& connection) {
+    if (_deflaterOwner || !connection.request.acceptsEncoding("gzip")) return false;
+
+    _deflaterOwner = &connection;
+    connection.gzipEncoded = true;
+    return true;
+}
+
+void SDServer::writeListing(Connection& connection, const char* data, size_t length) {
+    if (connection.gzipEncoded) {
+        _deflater.write(data, length);
+    } else {
+        _response.write(data, length);
+    }
+}
+
+void SDServer::releaseListing(Connection& connection) {
+    if (_deflaterOwner == &connection) {
+        _deflaterOwner = nullptr;
+    }
+    if (connection.listingId == DirectoryListingCache::NONE) return;
+
+    if (connection.state == Connection::State::BuildingListing) {
+        _listingCache.abortBuild(connection.listingId);
+    } else {
+        _listingCache.release(connection.listingId);
+    }
+    connection.listingId = DirectoryListingCache::NONE;
+}
+
+void SDServer::releaseCachedFile(Connection& connection) {
+    _fileCache.release(connection.cachedFileId);
+    connection.cachedFileId = FileCache::NONE;
+}
@@ -23,14 +23,98 @@ SOFTWARE. */
 #ifndef SDSERVER_H
 #define SDSERVER_H
 
+#include <atomic>
 #include <cstddef>
 
 #include <SdFat.h>
+#include <WiFi.h>
 
+#include "DigestStore.h"
+#include "DirectoryHandleCache.h"
+#include "FileCache.h"
+#include "DirectoryListingCache.h"
+#include "GzipDeflater.h"
+#include "HTTPRequestParser.h"
+#include "HTTPResponseWriter.h"
+#include "ServerMetrics.h"
+#include "TarArchive.h"
+#include "TarReader.h"
+#include "TransferPipeline.h"
 #include "multipart_parser.h"
 
-class WiFiServer;
-class WiFiClient;
+// Maximum number of clients served at the same time. Further clients are
+// turned away with 503 Service Unavailable until a slot frees up.
+#ifndef SDSERVER_MAX_CONNECTIONS
+#define SDSERVER_MAX_CONNECTIONS 4
+#endif
+
+// Per-connection buffer holding the request head while it's parsed plus,
+// during uploads, the current multipart part's header values. Request
+// headers the server doesn't use are dropped as they arrive, so this only
+// needs to fit the request line and a handful of short headers.
+#ifndef SDSERVER_CONNECTION_BUFFER_SIZE
+#define SDSERVER_CONNECTION_BUFFER_SIZE 512
+#endif
+
+// Connections that make no progress for this long are dropped.
+#ifndef SDSERVER_IDLE_TIMEOUT_MS
+#define SDSERVER_IDLE_TIMEOUT_MS 10000
+#endif
+
+// Requests asking for more byte ranges than this get the whole file instead.
+#ifndef SDSERVER_MAX_RANGES
+#define SDSERVER_MAX_RANGES 8
+#endif
+
+// Defaults for persistent connections, see SDServer::setKeepAlive().
+#ifndef SDSERVER_KEEP_ALIVE_TIMEOUT_MS
+#define SDSERVER_KEEP_ALIVE_TIMEOUT_MS 5000
+#endif
+
+#ifndef SDSERVER_KEEP_ALIVE_MAX_REQUESTS
+#define SDSERVER_KEEP_ALIVE_MAX_REQUESTS 100
+#endif
+
+// Set to 1 on the RP2040 to move the card side of pipelined transfers to the
+// second core: handleClient() then leaves it to serviceStorage(), which has to
+// be called from loop1(). Card access from both cores is serialized with a
+// mutex.
+#ifndef SDSERVER_STORAGE_ON_SECOND_CORE
+#define SDSERVER_STORAGE_ON_SECOND_CORE 0
+#endif
+
+#if SDSERVER_STORAGE_ON_SECOND_CORE
+#include <pico/mutex.h>
+#endif
+
+// Path prefixes that can be given their own Cache-Control policy
+#ifndef SDSERVER_MAX_CACHE_CONTROL_RULES
+#define SDSERVER_MAX_CACHE_CONTROL_RULES 4
+#endif
+
+// Uploaded bytes written between syncs of the file being uploaded. 0 syncs
+// only when the file is complete.
+#ifndef SDSERVER_UPLOAD_SYNC_INTERVAL
+#define SDSERVER_UPLOAD_SYNC_INTERVAL 0
+#endif
+
+// Set to 0 to leave out tar archive downloads (?archive=tar) and extraction
+// (?extract=tar), which saves flash on builds that don't need them. The
+// query parameters are then ignored.
+#ifndef SDSERVER_ENABLE_ARCHIVES
+#define SDSERVER_ENABLE_ARCHIVES 1
+#endif
+
+// How often a followed file (GET /file?follow=1) is checked for growth once
+// everything written to it so far has been sent, and how long it may go
+// without growing before the stream is ended.
+#ifndef SDSERVER_FOLLOW_POLL_MS
+#define SDSERVER_FOLLOW_POLL_MS 500
+#endif
+
+#ifndef SDSERVER_FOLLOW_IDLE_TIMEOUT_MS
+#define SDSERVER_FOLLOW_IDLE_TIMEOUT_MS 60000
+#endif
 
 class SDServer {
 public:
@@ -43,25 +127,285 @@ public:
         size_t uploadStreamingBufferSize
     );
 
+    // Keeps HTTP/1.1 connections open between requests. An idle connection is
+    // closed after idleTimeoutMs, and after maxRequests responses. Pass
+    // maxRequests <= 1 to close every connection after its first response.
+    void setKeepAlive(unsigned long idleTimeoutMs, size_t maxRequests);
+
+    // Gathers uploaded data into whole 512-byte sectors before writing it to
+    // the card, so uploads become a few large aligned writes instead of one
+    // small write per network read. The size is rounded down to a multiple of
+    // 512. One upload at a time uses the buffer, any others write through.
+    void setUploadWriteBuffer(char* buffer, size_t size);
+
+    // Syncs a file being uploaded after every syncIntervalBytes written, in
+    // addition to when it is complete. Pass 0 to sync only on completion.
+    void setUploadSyncInterval(uint32_t syncIntervalBytes);
+
+    // Keeps rendered directory listings in buffer, so a repeat request is
+    // answered without walking the directory, or with an empty 304 when the
+    // browser already has the listing's ETag. Listings that don't fit in the
+    // buffer are streamed as before. Listings are invalidated by uploads; call
+    // invalidateListings() after changing the card's contents outside SDServer.
+    // That also closes the directories kept open for resolving paths, see
+    // SDSERVER_DIRECTORY_CACHE_ENTRIES, and empties the file cache.
+    void setListingCache(char* buffer, size_t size);
+    void invalidateListings();
+
+    // Keeps small files that are downloaded, and the first
+    // SDSERVER_FILE_CACHE_ENTRY_SIZE bytes of larger ones, in buffer, so files
+    // requested over and over are sent without reading the card. A cached file
+    // is only used while its size and modification time are unchanged, and
+    // uploads drop the cached files of the directory they write to.
+    void setFileCache(char* buffer, size_t size);
+
+    // Sends "Cache-Control: value" with every file whose path starts with
+    // pathPrefix, e.g. setCacheControl("/static/", "max-age=86400"). The
+    // longest matching prefix wins, and setting a prefix again replaces its
+    // value. Neither string is copied. Returns false when every rule is taken.
+    bool setCacheControl(const char* pathPrefix, const char* value);
+
+    // Streams one download or upload at a time through buffer, split into
+    // SDSERVER_PIPELINE_BLOCKS blocks, so the card is read (or written) while
+    // earlier blocks are still on their way over Wi-Fi. Other transfers use
+    // the working and upload streaming buffers as before.
+    void setPipelineBuffer(char* buffer, size_t size);
+
+    // Accepts at most one new client and advances every open connection by a
+    // bounded slice of work, then returns. Call it from loop() as often as possible.
     void handleClient();
+
+    // Moves the pipelined transfer's data between the card and the pipeline
+    // buffer. handleClient() does this itself unless
+    // SDSERVER_STORAGE_ON_SECOND_CORE is set, in which case call it from loop1().
+    void serviceStorage();
 private:
+    // Holds the card mutex for its lifetime when the card side runs on the
+    // second core, and does nothing otherwise.
+    class StorageLock {
+    public:
+        explicit StorageLock(SDServer& server, bool engaged = true);
+        ~StorageLock();
+    private:
+        SDServer* _server;
+    };
+
+    enum class PipelineDirection : uint8_t {
+        Download,
+        Upload
+    };
+
+    struct Connection {
+        enum class State : uint8_t {
+            Free,
+            ReadingRequestHead,
+            ReadingMultipartBody,
+            ReadingFileBody,
+            SendingFile,
+            SendingListing,
+            SendingJSONListing,
+            BuildingListing,
+            SendingCachedListing,
+            FollowingFile,
+            ComputingDigest,
+#if SDSERVER_ENABLE_ARCHIVES
+            SizingArchive,
+            SendingArchive,
+            ExtractingArchive
+#endif
+        };
+
+        bool isIdle() const { return state == State::ReadingRequestHead && request.bufferedLength() == 0 && requestCount != 0; }
+        bool isExtracting() const {
+#if SDSERVER_ENABLE_ARCHIVES
+            return state == State::ExtractingArchive;
+#else
+            return false;
+#endif
+        }
+
+        SDServer* server = nullptr;
+        WiFiClient client;
+        State state = State::Free;
+        HTTPRequestParser request;
+        bool keepAlive = false;
+        bool headOnly = false; // answering a HEAD request
+        bool gzipEncoded = false; // sending a .gz sidecar, or a listing through the deflater
+        bool multipartRanges = false; // sending a multipart/byteranges response
+        bool eventStream = false; // following a file as Server-Sent Events
+        bool eventLineOpen = false; // an event's data line has been started but not ended
+        bool sessionUpload = false; // writing into a resumable upload session
+        bool digesting = false; // keeping a CRC32C of the whole file being sent or written
+        bool verifyDigest = false; // the upload came with an X-Content-CRC32C to check
+        FsFile file; // file being sent, directory being listed, file being written or archive member being sent
+        multipart_parser parser;
+        uint64_t bodyRemaining = 0;
+        uint64_t sendRemaining = 0; // bytes left in the file range being sent
+        uint64_t uploadEnd = 0; // offset a write into an upload session should end at
+        uint32_t firstSector = 0; // where the file being sent starts on the card when it's contiguous, otherwise 0
+        size_t requestCount = 0;
+        size_t bufferPos = 0; // end of the multipart part header values, or of the names of members that failed to extract
+        size_t headerValuesBegin = 0;
+        size_t inputBegin = 0; // bytes received after the request head that haven't been consumed yet
+        size_t inputEnd = 0;
+        size_t rangeCursor = 0; // offset of the next range-spec within the Range header
+        uint32_t unsyncedBytes = 0; // written to the file being uploaded since its last sync
+        uint32_t digest = 0; // CRC32C of the file data read or written so far
+        uint32_t expectedDigest = 0;
+        uint16_t listingId = DirectoryListingCache::NONE; // cached listing being built or sent
+        uint16_t cachedFileId = FileCache::NONE; // file cache entry being filled or sent from
+        uint32_t pageEntries = 0; // entries on the JSON listing page so far
+        uint32_t pageLimit = 0;   // entries the JSON listing page may hold
+        unsigned long requestStart = 0; // micros() when the request head was complete
+        uint16_t status = 0;            // status code of the response being sent
+        bool requestOpen = false;       // a request whose response hasn't been counted yet
+        unsigned long lastActivity = 0;
+        unsigned long lastPoll = 0; // millis() when a followed file was last checked for growth
+        char buffer[SDSERVER_CONNECTION_BUFFER_SIZE];
+    };
+
     static int readHeaderValue(multipart_parser* p, const char* at, size_t length);
     static int readPartData(multipart_parser* p, const char* at, size_t length);
     static int onHeadersComplete(multipart_parser* p);
     static int onPartDataEnd(multipart_parser* p);
+#if SDSERVER_ENABLE_ARCHIVES
+    static int onArchiveMember(TarReader* reader, TarReader::Type type, uint64_t size);
+    static int onArchiveData(TarReader* reader, const char* at, size_t length);
+    static int onArchiveMemberEnd(TarReader* reader);
+#endif
+
+    void acceptClient();
+    void serviceConnection(Connection& connection);
+    void closeConnection(Connection& connection);
+    void finishResponse(Connection& connection);
+    bool readRequestHead(Connection& connection);
+    void handleRequest(Connection& connection);
+    void beginUpload(Connection& connection);
+    void beginFileUpload(Connection& connection);
+    bool layOutUploadPaths(Connection& connection, std::string_view suffix);
+    void handleUploadSession(Connection& connection);
+    void beginSessionWrite(Connection& connection);
+    void finishSessionWrite(Connection& connection);
+    void sendUploadOffset(Connection& connection, std::string_view statusLine, uint64_t offset);
+    std::string_view replaceWithUpload(const char* uploadPath, const char* targetPath);
+    void sendFileResponse(Connection& connection);
+    bool startNextRangePart(Connection& connection);
+#if SDSERVER_ENABLE_ARCHIVES
+    void beginExtract(Connection& connection);
+#endif
+    bool readUploadBody(Connection& connection);
+    bool consumeUploadBody(Connection& connection, const char* data, size_t length);
+    void endUploadBody(Connection& connection, bool malformed);
+#if SDSERVER_ENABLE_ARCHIVES
+    void recordExtractFailure(Connection& connection);
+    void finishExtract(Connection& connection, bool malformed);
+#endif
+    bool readFileBody(Connection& connection);
+    void finishFileUpload(Connection& connection);
+    void prepareUploadFile(Connection& connection, uint64_t sizeHint);
+    void writeUploadData(Connection& connection, const char* data, size_t length);
+    void syncUploadFile(Connection& connection);
+    void flushUploadData(Connection& connection);
+    void writeUploadFile(Connection& connection, const char* data, size_t length);
+    void endUploadFile(Connection& connection);
+    void discardUploadFile(Connection& connection);
+    bool sendFileData(Connection& connection);
+    int readFileData(Connection& connection, char* buffer, size_t length);
+    int readFileSectors(Connection& connection, char* buffer, size_t length);
+    void openGzipSidecar(Connection& connection);
+    void beginDigest(Connection& connection);
+    bool computeDigest(Connection& connection);
+    void sendDigestResponse(Connection& connection);
+    void storeDigest(const char* path, uint32_t crc);
+    void beginFollow(Connection& connection);
+    bool sendFollowData(Connection& connection);
+    bool writeFollowEvents(Connection& connection, size_t writable);
+    bool pollFollowedFile(Connection& connection);
+    void endFollow(Connection& connection);
+    const char* cacheControl(std::string_view path) const;
+    bool sendListingEntries(Connection& connection);
+    bool buildListingEntries(Connection& connection);
+    void sendCachedListingResponse(Connection& connection);
+    bool sendCachedListingData(Connection& connection);
+    void releaseListing(Connection& connection);
+    void releaseCachedFile(Connection& connection);
+    void invalidateDirectory(std::string_view directory);
+    bool claimPipeline(Connection& connection, PipelineDirection direction);
+    void releasePipeline(Connection& connection);
+    bool isPipelined(const Connection& connection) const;
+    bool sendPipelinedFileData(Connection& connection);
+    bool receivePipelinedBody(Connection& connection);
+    bool claimDeflater(Connection& connection);
+    void writeListing(Connection& connection, const char* data, size_t length);
 
-    void listFiles(const char* directoryPath, FsFile& directory, WiFiClient& client);
-    char* urlDecode(char* text);
+    void listFiles(Connection& connection);
+    void streamListing(Connection& connection);
+#if SDSERVER_ENABLE_METRICS
+    void sendMetrics(Connection& connection);
+#endif
+    void recordRequest(Connection& connection);
+    void beginJSONListing(Connection& connection);
+    bool sendJSONListingEntries(Connection& connection);
+#if SDSERVER_ENABLE_ARCHIVES
+    void beginArchive(Connection& connection);
+    bool sizeArchive(Connection& connection);
+    void sendArchiveResponse(Connection& connection);
+    bool sendArchiveData(Connection& connection);
+#endif
+    void releaseArchive(Connection& connection);
 
     multipart_parser_settings _multipartParserCallbacks;
+#if SDSERVER_ENABLE_ARCHIVES
+    TarReader::Callbacks _archiveCallbacks;
+#endif
     WiFiServer* _server = nullptr;
     SdFs* _fs = nullptr;
-    FsFile _fileBeingWritten;
     char* _workingBuffer;
     size_t _workingBufferSize;
     char* _uploadStreamingBuffer;
     size_t _uploadStreamingBufferSize;
-    size_t _headerBufferPos;
+    char* _uploadWriteBuffer = nullptr;
+    size_t _uploadWriteBufferSize = 0;
+    size_t _uploadWriteLength = 0;
+    Connection* _uploadWriteOwner = nullptr; // upload currently gathering into _uploadWriteBuffer
+    uint32_t _uploadSyncInterval = SDSERVER_UPLOAD_SYNC_INTERVAL;
+    unsigned long _keepAliveTimeout = SDSERVER_KEEP_ALIVE_TIMEOUT_MS;
+    size_t _keepAliveMaxRequests = SDSERVER_KEEP_ALIVE_MAX_REQUESTS;
+    struct CacheControlRule {
+        const char* pathPrefix;
+        const char* value;
+    };
+    CacheControlRule _cacheControlRules[SDSERVER_MAX_CACHE_CONTROL_RULES];
+    size_t _cacheControlRuleCount = 0;
+    DirectoryListingCache _listingCache;
+    DigestStore _digests;
+    DirectoryHandleCache _directories;
+    FileCache _fileCache;
+    GzipDeflater _deflater;
+    Connection* _deflaterOwner = nullptr; // listing being compressed
+#if SDSERVER_ENABLE_ARCHIVES
+    TarArchive _archive;
+    Connection* _archiveOwner = nullptr; // directory being sent as a tar archive
+    uint64_t _archiveSize = 0; // Content-Length of the archive, 0 when it's sent chunked
+    size_t _archivePadding = 0; // zero bytes to send before the next header
+    bool _archiveEnding = false; // the walk is over, the end-of-archive blocks are being sent
+    TarReader _tarReader; // archive being extracted, by _archiveOwner
+    uint64_t _extractMemberSize = 0; // size of the member being extracted
+    uint32_t _extractedMembers = 0;
+    uint32_t _skippedMembers = 0;
+    uint32_t _failedMembers = 0;
+#endif
+    TransferPipeline _pipeline;
+    Connection* volatile _pipelineOwner = nullptr; // transfer using the pipeline
+    PipelineDirection _pipelineDirection = PipelineDirection::Download;
+    uint64_t _pipelineReadRemaining = 0; // bytes of the download the card side has yet to read
+    std::atomic<bool> _pipelineFailed{false}; // the card side hit a read error or a malformed body
+#if SDSERVER_STORAGE_ON_SECOND_CORE
+    recursive_mutex_t _storageMutex;
+#endif
+    HTTPResponseWriter _response; // output of the connection being serviced, buffered in _workingBuffer
+    ServerMetrics _metrics;
+    Connection _connections[SDSERVER_MAX_CONNECTIONS];
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,144 @@
+/* MIT License
+
+Copyright (c) 2023 Kenny Riddile
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#include "ServerMetrics.h"
+
+#include "HTTPResponseWriter.h"
+
+#if SDSERVER_ENABLE_METRICS
+
+static const uint16_t STATUS_CODES[] = { 200, 201, 204, 206, 303, 304, 400, 403, 404, 405, 409, 411, 414, 416, 431, 500, 503 };
+static_assert(sizeof(STATUS_CODES) / sizeof(STATUS_CODES[0]) + 1 == 18, "STATUS_COUNT must match STATUS_CODES");
+
+static const char* const METHOD_NAMES[] = { "other", "GET", "HEAD", "POST", "PUT", "PATCH", "DELETE" };
+
+static const uint32_t BUCKET_BOUNDS[] = { 50, 100, 250, 500, 1000, 2500, 5000, 10000, 50000, 250000, 1000000 };
+static const char* const BUCKET_LABELS[] = { "0.00005", "0.0001", "0.00025", "0.0005", "0.001", "0.0025", "0.005", "0.01", "0.05", "0.25", "1", "+Inf" };
+static_assert(sizeof(BUCKET_BOUNDS) / sizeof(BUCKET_BOUNDS[0]) == ServerMetrics::BUCKET_COUNT, "BUCKET_COUNT must match BUCKET_BOUNDS");
+
+struct HistogramInfo {
+    const char* name;
+    const char* help;
+};
+
+static const HistogramInfo HISTOGRAMS[] = {
+    { "sdserver_request_duration_seconds", "Time from the end of a request head to the end of its response." },
+    { "sdserver_card_read_seconds", "Time spent in each read of file data from the SD card." },
+    { "sdserver_card_write_seconds", "Time spent in each write of uploaded data to the SD card." },
+    { "sdserver_socket_write_seconds", "Time spent in each write to a client socket." },
+    { "sdserver_upload_sync_seconds", "Time spent syncing or closing each file being uploaded." }
+};
+
+void ServerMetrics::recordRequest(HTTPRequestParser::Method method, uint16_t status) {
+    size_t statusIndex = 0;
+    while (statusIndex < STATUS_COUNT - 1 && STATUS_CODES[statusIndex] != status) {
+        ++statusIndex;
+    }
+    ++_requests[static_cast<size_t>(method)][statusIndex];
+}
+
+void ServerMetrics::recordDuration(Duration duration, uint32_t micros) {
+    Histogram& histogram = _histograms[static_cast<size_t>(duration)];
+    size_t bucket = 0;
+    while (bucket < BUCKET_COUNT && micros > BUCKET_BOUNDS[bucket]) {
+        ++bucket;
+    }
+    ++histogram.buckets[bucket];
+    histogram.sum += micros;
+}
+
+void ServerMetrics::write(HTTPResponseWriter& response) const {
+    response.println("# HELP sdserver_requests_total Responses sent, by request method and status code.");
+    response.println("# TYPE sdserver_requests_total counter");
+    for (size_t method = 0; method < METHOD_COUNT; ++method) {
+        for (size_t status = 0; status < STATUS_COUNT; ++status) {
+            if (_requests[method][status] == 0) continue;
+
+            response.print("sdserver_requests_total{method=\"");
+            response.print(METHOD_NAMES[method]);
+            response.print("\",code=\"");
+            if (status < STATUS_COUNT - 1) {
+                response.print(STATUS_CODES[status]);
+            } else {
+                response.print("other");
+            }
+            response.print("\"} ");
+            response.println(_requests[method][status]);
+        }
+    }
+
+    response.println("# HELP sdserver_received_bytes_total Bytes read from clients.");
+    response.println("# TYPE sdserver_received_bytes_total counter");
+    response.print("sdserver_received_bytes_total ");
+    response.println(_bytesReceived);
+    response.println("# HELP sdserver_sent_bytes_total Bytes written to clients.");
+    response.println("# TYPE sdserver_sent_bytes_total counter");
+    response.print("sdserver_sent_bytes_total ");
+    response.println(_bytesSent);
+    response.println("# HELP sdserver_multipart_errors_total Uploads whose multipart body could not be parsed.");
+    response.println("# TYPE sdserver_multipart_errors_total counter");
+    response.print("sdserver_multipart_errors_total ");
+    response.println(_multipartErrors);
+
+    for (size_t i = 0; i < static_cast<size_t>(Duration::Count); ++i) {
+        writeHistogram(response, static_cast<Duration>(i));
+    }
+}
+
+void ServerMetrics::writeHistogram(HTTPResponseWriter& response, Duration duration) const {
+    const Histogram& histogram = _histograms[static_cast<size_t>(duration)];
+    const HistogramInfo& info = HISTOGRAMS[static_cast<size_t>(duration)];
+    response.print("# HELP ");
+    response.print(info.name);
+    response.print(" ");
+    response.println(info.help);
+    response.print("# TYPE ");
+    response.print(info.name);
+    response.println(" histogram");
+
+    uint64_t count = 0;
+    for (size_t bucket = 0; bucket <= BUCKET_COUNT; ++bucket) {
+        count += histogram.buckets[bucket];
+        response.print(info.name);
+        response.print("_bucket{le=\"");
+        response.print(BUCKET_LABELS[bucket]);
+        response.print("\"} ");
+        response.println(count);
+    }
+
+    // Whole seconds and zero-padded microseconds, without floating point
+    char fraction[8] = ".000000";
+    uint32_t micros = histogram.sum % 1000000;
+    for (size_t i = 6; i > 0; --i, micros /= 10) {
+        fraction[i] = '0' + micros % 10;
+    }
+    response.print(info.name);
+    response.print("_sum ");
+    response.print(histogram.sum / 1000000);
+    response.println(fraction);
+    response.print(info.name);
+    response.print("_count ");
+    response.println(count);
+}
+
+#endif
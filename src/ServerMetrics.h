@@ -0,0 +1,103 @@
+/* MIT License
+
+Copyright (c) 2023 Kenny Riddile
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#ifndef SERVERMETRICS_H
+#define SERVERMETRICS_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "HTTPRequestParser.h"
+
+class HTTPResponseWriter;
+
+// Path the metrics are served on. A file or directory on the card with the
+// same path is hidden behind it.
+#ifndef SDSERVER_METRICS_PATH
+#define SDSERVER_METRICS_PATH "/metrics"
+#endif
+
+// Set to 0 to leave out metrics collection and the metrics endpoint. The
+// recording calls then compile to nothing.
+#ifndef SDSERVER_ENABLE_METRICS
+#define SDSERVER_ENABLE_METRICS 1
+#endif
+
+// Counters and latency histograms the server updates as it works, written
+// out in the Prometheus text format. Everything lives in fixed-size arrays,
+// so collecting costs no allocation and a few hundred bytes in total.
+//
+// Card timings are only recorded by the storage side and everything else by
+// the network side, so with SDSERVER_STORAGE_ON_SECOND_CORE each value still
+// has a single writer.
+class ServerMetrics {
+public:
+    enum class Duration : uint8_t {
+        Request,     // end of the request head to the end of the response
+        CardRead,
+        CardWrite,
+        SocketWrite,
+        UploadSync,  // syncing or closing a file being uploaded
+        Count
+    };
+
+    // Histogram buckets below +Inf, bounded by BUCKET_BOUNDS in ServerMetrics.cpp
+    static constexpr size_t BUCKET_COUNT = 11;
+
+#if SDSERVER_ENABLE_METRICS
+    void recordRequest(HTTPRequestParser::Method method, uint16_t status);
+    void recordDuration(Duration duration, uint32_t micros);
+    void addBytesReceived(size_t count) { _bytesReceived += count; }
+    void addBytesSent(size_t count) { _bytesSent += count; }
+    void recordMultipartError() { ++_multipartErrors; }
+
+    void write(HTTPResponseWriter& response) const;
+#else
+    void recordRequest(HTTPRequestParser::Method, uint16_t) {}
+    void recordDuration(Duration, uint32_t) {}
+    void addBytesReceived(size_t) {}
+    void addBytesSent(size_t) {}
+    void recordMultipartError() {}
+#endif
+
+#if SDSERVER_ENABLE_METRICS
+private:
+    static constexpr size_t METHOD_COUNT = static_cast<size_t>(HTTPRequestParser::Method::DELETE) + 1;
+    static constexpr size_t STATUS_COUNT = 18; // the statuses the server sends, plus one for any other
+
+    struct Histogram {
+        uint32_t buckets[BUCKET_COUNT + 1] = {}; // not cumulative, the last one is +Inf
+        uint64_t sum = 0;                        // microseconds
+    };
+
+    void writeHistogram(HTTPResponseWriter& response, Duration duration) const;
+
+    uint32_t _requests[METHOD_COUNT][STATUS_COUNT] = {};
+    uint64_t _bytesReceived = 0;
+    uint64_t _bytesSent = 0;
+    uint32_t _multipartErrors = 0;
+    Histogram _histograms[static_cast<size_t>(Duration::Count)];
+#endif
+};
+
+#endif
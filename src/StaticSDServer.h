@@ -0,0 +1,92 @@
+/* MIT License
+
+Copyright (c) 2023 Kenny Riddile
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#ifndef STATICSDSERVER_H
+#define STATICSDSERVER_H
+
+#include "SDServer.h"
+
+#include <array>
+#include <cstddef>
+
+// Buffer sizes for StaticSDServer. Derive from this and override the sizes
+// you want to change; a size of 0 leaves that optional buffer out.
+struct SDServerDefaultConfig {
+    static constexpr size_t workingBufferSize = 512;
+    static constexpr size_t uploadStreamingBufferSize = 64;
+    static constexpr size_t uploadWriteBufferSize = 0;
+    static constexpr size_t listingCacheSize = 0;
+    static constexpr size_t fileCacheSize = 0;
+    static constexpr size_t pipelineBufferSize = 0;
+};
+
+// An SDServer that owns its buffers, with their sizes fixed at compile time by
+// Config. The buffers live wherever the server object does, so a global
+// StaticSDServer puts all of the server's memory in .bss where the linker
+// accounts for it, and impossible sizes are caught by the compiler instead
+// of misbehaving at run time.
+template <typename Config = SDServerDefaultConfig>
+class StaticSDServer : public SDServer {
+public:
+    static_assert(Config::workingBufferSize >= 256,
+                  "the working buffer must hold a response's headers");
+    static_assert(Config::uploadStreamingBufferSize > 0,
+                  "the upload streaming buffer can't be empty");
+    static_assert(Config::uploadWriteBufferSize % 512 == 0,
+                  "the upload write buffer must be a whole number of 512-byte sectors");
+    static_assert(Config::pipelineBufferSize == 0 || Config::pipelineBufferSize >= SDSERVER_PIPELINE_BLOCKS * 512,
+                  "the pipeline buffer needs at least a sector per block");
+
+    void begin(WiFiServer* server, SdFs* fs) {
+        SDServer::begin(
+            server,
+            fs,
+            _workingBuffer.data(),
+            _workingBuffer.size(),
+            _uploadStreamingBuffer.data(),
+            _uploadStreamingBuffer.size()
+        );
+        if constexpr (Config::uploadWriteBufferSize != 0) {
+            setUploadWriteBuffer(_uploadWriteBuffer.data(), _uploadWriteBuffer.size());
+        }
+        if constexpr (Config::listingCacheSize != 0) {
+            setListingCache(_listingCache.data(), _listingCache.size());
+        }
+        if constexpr (Config::fileCacheSize != 0) {
+            setFileCache(_fileCache.data(), _fileCache.size());
+        }
+        if constexpr (Config::pipelineBufferSize != 0) {
+            setPipelineBuffer(_pipelineBuffer.data(), _pipelineBuffer.size());
+        }
+    }
+
+private:
+    std::array<char, Config::workingBufferSize> _workingBuffer;
+    std::array<char, Config::uploadStreamingBufferSize> _uploadStreamingBuffer;
+    std::array<char, Config::uploadWriteBufferSize> _uploadWriteBuffer;
+    std::array<char, Config::listingCacheSize> _listingCache;
+    std::array<char, Config::fileCacheSize> _fileCache;
+    std::array<char, Config::pipelineBufferSize> _pipelineBuffer;
+};
+
+#endif
@@ -0,0 +1,172 @@
+/* MIT License
+
+Copyright (c) 2023 Kenny Riddile
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#include "TarArchive.h"
+
+#include <algorithm>
+#include <cstring>
+
+static const size_t NO_SPLIT = SIZE_MAX;
+
+// Writes value as zero-padded octal filling a field of width bytes, the last
+// of which is a null terminator. Sizes too large for that are written in
+// base-256 instead, as GNU tar and every modern reader understand.
+static void formatNumber(char* field, size_t width, uint64_t value) {
+    size_t digits = width - 1;
+    if (digits * 3 < 64 && value >> (digits * 3) != 0) {
+        field[0] = static_cast<char>(0x80);
+        for (size_t i = width - 1; i > 0; --i, value >>= 8) {
+            field[i] = static_cast<char>(value & 0xFF);
+        }
+        return;
+    }
+    for (size_t i = digits; i > 0; --i, value >>= 3) {
+        field[i - 1] = '0' + (value & 7);
+    }
+    field[digits] = '\0';
+}
+
+// Seconds since 1970 for a FAT date and time, which are local time; tar
+// readers will show them as if they were UTC.
+static uint64_t unixTime(uint16_t fatDate, uint16_t fatTime) {
+    int year = 1980 + (fatDate >> 9);
+    unsigned month = (fatDate >> 5) & 0x0F;
+    unsigned day = fatDate & 0x1F;
+    if (month < 1 || month > 12 || day < 1) return 0;
+
+    // Days since 1970-01-01 in the proleptic Gregorian calendar
+    year -= month <= 2;
+    int era = year / 400;
+    unsigned yearOfEra = year - era * 400;
+    unsigned dayOfYear = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    unsigned dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+    uint64_t days = era * 146097 + dayOfEra - 719468;
+
+    return days * 86400 + (fatTime >> 11) * 3600 + ((fatTime >> 5) & 0x3F) * 60 + (fatTime & 0x1F) * 2;
+}
+
+void TarArchive::begin(FsFile& directory) {
+    end();
+    _directories[0] = directory;
+    directory.close();
+    _pathLengths[0] = 0;
+    _depth = 1;
+    rewind();
+}
+
+void TarArchive::rewind() {
+    while (_depth > 1) {
+        _directories[--_depth].close();
+    }
+    _directories[0].rewindDirectory();
+    _pathLength = 0;
+    _path[0] = '\0';
+}
+
+void TarArchive::end() {
+    while (_depth > 0) {
+        _directories[--_depth].close();
+    }
+}
+
+TarArchive::Entry TarArchive::next(FsFile& file) {
+    char name[256];
+    while (_depth != 0) {
+        _pathLength = _pathLengths[_depth - 1];
+        if (!(file = _directories[_depth - 1].openNextFile())) {
+            if (_depth == 1) break; // the archived directory itself stays open for rewind()
+            _directories[--_depth].close();
+            continue;
+        }
+
+        size_t nameLength = file.getName(name, sizeof(name));
+        bool directory = file.isDirectory();
+        if (nameLength == 0 || _pathLength + nameLength + directory > MAX_PATH ||
+            (directory && _depth > SDSERVER_ARCHIVE_MAX_DEPTH)) {
+            file.close();
+            continue;
+        }
+        memcpy(_path + _pathLength, name, nameLength);
+        _pathLength += nameLength;
+        if (directory) {
+            _path[_pathLength++] = '/';
+        }
+        _path[_pathLength] = '\0';
+        if (nameSplit() == NO_SPLIT) {
+            file.close();
+            continue;
+        }
+
+        if (!directory) return Entry::File;
+        _directories[_depth] = file;
+        _pathLengths[_depth++] = _pathLength;
+        return Entry::Directory;
+    }
+
+    _pathLength = 0;
+    _path[0] = '\0';
+    return Entry::None;
+}
+
+// Where the current path is split between the header's prefix and name
+// fields: 0 when it fits the name field alone, NO_SPLIT when it fits neither way.
+size_t TarArchive::nameSplit() const {
+    if (_pathLength <= 100) return 0;
+
+    // The '/' at the split is dropped, and a directory's trailing '/' can't be it
+    for (size_t split = std::min<size_t>(155, _pathLength - 2); split > 0; --split) {
+        if (_pathLength - split - 1 > 100) break;
+        if (_path[split] == '/') return split;
+    }
+
+    return NO_SPLIT;
+}
+
+void TarArchive::formatHeader(char* out, Entry entry, uint64_t size, uint16_t fatDate, uint16_t fatTime) const {
+    memset(out, 0, BLOCK_SIZE);
+    size_t split = nameSplit();
+    if (split == 0) {
+        memcpy(out, _path, _pathLength);
+    } else {
+        memcpy(out + 345, _path, split); // prefix
+        memcpy(out, _path + split + 1, _pathLength - split - 1);
+    }
+
+    bool directory = entry == Entry::Directory;
+    formatNumber(out + 100, 8, directory ? 0755 : 0644); // mode
+    formatNumber(out + 108, 8, 0);                       // uid
+    formatNumber(out + 116, 8, 0);                       // gid
+    formatNumber(out + 124, 12, directory ? 0 : size);
+    formatNumber(out + 136, 12, unixTime(fatDate, fatTime));
+    out[156] = directory ? '5' : '0';
+    memcpy(out + 257, "ustar", 6);
+    memcpy(out + 263, "00", 2);
+
+    // The checksum is taken with its own field filled with spaces
+    memset(out + 148, ' ', 8);
+    uint32_t checksum = 0;
+    for (size_t i = 0; i < BLOCK_SIZE; ++i) {
+        checksum += static_cast<uint8_t>(out[i]);
+    }
+    formatNumber(out + 148, 7, checksum);
+}
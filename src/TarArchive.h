@@ -0,0 +1,89 @@
+/* MIT License
+
+Copyright (c) 2023 Kenny Riddile
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#ifndef TARARCHIVE_H
+#define TARARCHIVE_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include <SdFat.h>
+
+// Directory levels below the archived directory that are included. Each
+// level keeps a directory open while its entries are walked.
+#ifndef SDSERVER_ARCHIVE_MAX_DEPTH
+#define SDSERVER_ARCHIVE_MAX_DEPTH 8
+#endif
+
+// Walks a directory tree depth-first and formats a ustar header for each
+// entry, so a tar archive of it can be streamed without holding more than one
+// header at a time. Member names are relative to the archived directory.
+// Entries whose path doesn't fit a ustar header, or that lie deeper than
+// SDSERVER_ARCHIVE_MAX_DEPTH, are left out.
+class TarArchive {
+public:
+    static const size_t BLOCK_SIZE = 512;
+
+    enum class Entry : uint8_t {
+        None, // the walk is over
+        Directory,
+        File
+    };
+
+    // Starts walking directory, which the archive takes over.
+    void begin(FsFile& directory);
+    // Starts the walk over from the top, for a second pass.
+    void rewind();
+    // Closes every directory.
+    void end();
+
+    // Moves to the next entry and opens it into file. The walk descends into
+    // a directory right away, file is just a second handle on it.
+    Entry next(FsFile& file);
+
+    // The ustar header for the current entry. fatDate and fatTime are its
+    // modification time as FAT stores it.
+    void formatHeader(char* out, Entry entry, uint64_t size, uint16_t fatDate, uint16_t fatTime) const;
+
+    // Header plus data blocks an entry takes up in the archive
+    static uint64_t entrySize(Entry entry, uint64_t size) {
+        return BLOCK_SIZE + (entry == Entry::File ? paddingSize(size) + size : 0);
+    }
+    // Zero bytes that fill out the last block of size bytes of data
+    static size_t paddingSize(uint64_t size) { return (BLOCK_SIZE - size % BLOCK_SIZE) % BLOCK_SIZE; }
+    // Two zero blocks end an archive
+    static const size_t END_SIZE = 2 * BLOCK_SIZE;
+
+private:
+    static const size_t MAX_PATH = 255; // ustar's 155-byte prefix, a '/', and the 100-byte name
+
+    size_t nameSplit() const;
+
+    FsFile _directories[SDSERVER_ARCHIVE_MAX_DEPTH + 1];
+    uint16_t _pathLengths[SDSERVER_ARCHIVE_MAX_DEPTH + 1]; // path length inside each open directory
+    size_t _depth = 0; // open directories
+    char _path[MAX_PATH + 2]; // current entry's path, with a trailing '/' for a directory
+    size_t _pathLength = 0;
+};
+
+#endif
@@ -0,0 +1,285 @@
+/* MIT License
+
+Copyright (c) 2023 Kenny Riddile
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#include "TarReader.h"
+
+#include <algorithm>
+#include <cstring>
+
+static const size_t BLOCK_SIZE = 512;
+
+void TarReader::begin(char* pathBuffer, const Callbacks* callbacks, void* data) {
+    _path = pathBuffer;
+    _path[0] = '\0';
+    _callbacks = callbacks;
+    _data = data;
+    _hasLongName = false;
+    beginHeader();
+}
+
+void TarReader::beginHeader() {
+    _state = State::Header;
+    _offset = 0;
+    _size = 0;
+    _checksum = 0;
+    _storedChecksum = 0;
+    _type = 0;
+    _ustar = true;
+    _blank = true;
+    _binarySize = false;
+}
+
+size_t TarReader::execute(const char* at, size_t length) {
+    size_t i = 0;
+    while (i < length) {
+        size_t count = 0;
+        switch (_state) {
+            case State::Header:
+                for (; i < length && _offset < BLOCK_SIZE; ++i, ++_offset) {
+                    uint8_t c = at[i];
+                    _blank = _blank && c == 0;
+                    _checksum += _offset >= 148 && _offset < 156 ? ' ' : c;
+                    if (_offset < 100) {
+                        if (!_hasLongName) _path[NAME_OFFSET + _offset] = c;
+                    } else if (_offset >= 124 && _offset < 136) {
+                        if (_offset == 124 && (c & 0x80)) {
+                            _binarySize = true;
+                        } else if (_binarySize) {
+                            _size = _size << 8 | c;
+                        } else if (c >= '0' && c <= '7') {
+                            _size = _size * 8 + (c - '0');
+                        }
+                    } else if (_offset >= 148 && _offset < 156) {
+                        if (c >= '0' && c <= '7') _storedChecksum = _storedChecksum * 8 + (c - '0');
+                    } else if (_offset == 156) {
+                        _type = c;
+                    } else if (_offset >= 257 && _offset < 263) {
+                        _ustar = _ustar && c == "ustar"[_offset - 257];
+                    } else if (_offset >= 345 && _offset < 500) {
+                        if (!_hasLongName) _path[_offset - 345] = c;
+                    }
+                }
+                if (_offset == BLOCK_SIZE && !finishHeader()) return i;
+                break;
+            case State::Data:
+                count = std::min<uint64_t>(_remaining, length - i);
+                if (_callbacks->onData(this, at + i, count) != 0) {
+                    _state = State::Error;
+                    return i;
+                }
+                i += count;
+                _remaining -= count;
+                if (_remaining == 0 && !endMember()) return i;
+                break;
+            case State::LongName:
+                count = std::min<uint64_t>(_remaining, length - i);
+                if (_longNameLength < PATH_BUFFER_SIZE - 1) {
+                    size_t stored = std::min(count, PATH_BUFFER_SIZE - 1 - _longNameLength);
+                    memcpy(_path + _longNameLength, at + i, stored);
+                    _longNameLength += stored;
+                }
+                i += count;
+                _remaining -= count;
+                if (_remaining == 0) {
+                    _path[_longNameLength] = '\0'; // the name's own terminator is usually stored too
+                    _hasLongName = true;
+                    skipPadding();
+                }
+                break;
+            case State::PaxHeader:
+                count = std::min<uint64_t>(_remaining, length - i);
+                for (size_t end = i + count; i < end; ++i) {
+                    readPaxRecordByte(at[i]);
+                }
+                _remaining -= count;
+                if (_remaining == 0) {
+                    if (_longNameLength != 0) {
+                        _path[_longNameLength] = '\0';
+                        _hasLongName = true;
+                    }
+                    skipPadding();
+                }
+                break;
+            case State::Skip:
+                count = std::min<uint64_t>(_remaining, length - i);
+                i += count;
+                _remaining -= count;
+                if (_remaining == 0) skipPadding();
+                break;
+            case State::Padding:
+                count = std::min<size_t>(_padding, length - i);
+                i += count;
+                _padding -= count;
+                if (_padding == 0) beginHeader();
+                break;
+            case State::End:
+                return length;
+            case State::Error:
+                return i;
+        }
+    }
+
+    return length;
+}
+
+bool TarReader::finishHeader() {
+    if (_blank) {
+        // A zero block marks the end of the archive, whatever follows is record padding
+        _state = State::End;
+        return true;
+    }
+    if (_checksum != _storedChecksum) {
+        _state = State::Error;
+        return false;
+    }
+
+    if (!_hasLongName) {
+        // Join the prefix and the name, which waits after the prefix field in _path
+        size_t nameLength = strnlen(_path + NAME_OFFSET, 100);
+        size_t pathLength = _ustar ? strnlen(_path, 155) : 0;
+        if (pathLength != 0) {
+            _path[pathLength++] = '/';
+        }
+        memmove(_path + pathLength, _path + NAME_OFFSET, nameLength);
+        _path[pathLength + nameLength] = '\0';
+    }
+    _remaining = _size;
+    _padding = (BLOCK_SIZE - _size % BLOCK_SIZE) % BLOCK_SIZE;
+
+    Type type;
+    switch (_type) {
+        case '0':
+        case '\0':
+        case '7':
+            type = Type::File;
+            break;
+        case '5':
+            type = Type::Directory;
+            break;
+        case 'L': // GNU long name for the next member
+            _longNameLength = 0;
+            _state = State::LongName;
+            if (_remaining == 0) skipPadding();
+            return true;
+        case 'x': // pax extended header for the next member
+            _longNameLength = 0;
+            _recordRemaining = 0;
+            _size = 0; // the records reuse _size and _offset
+            _offset = 0;
+            _state = State::PaxHeader;
+            if (_remaining == 0) skipPadding();
+            return true;
+        case 'g': // pax global header
+            _state = State::Skip;
+            if (_remaining == 0) skipPadding();
+            return true;
+        default:
+            type = Type::Other;
+            break;
+    }
+    _hasLongName = false;
+
+    if (_callbacks->onMember(this, type, type == Type::File ? _size : 0) != 0) {
+        _state = State::Error;
+        return false;
+    }
+    if (type == Type::File) {
+        _state = State::Data;
+        return _remaining != 0 || endMember();
+    }
+    // Directories and everything else end right away, any data is skipped
+    if (_callbacks->onMemberEnd(this) != 0) {
+        _state = State::Error;
+        return false;
+    }
+    _state = State::Skip;
+    if (_remaining == 0) skipPadding();
+
+    return true;
+}
+
+// pax records are "<length> <keyword>=<value>\n", the length counting the
+// whole record. Only the path keyword's value is kept.
+void TarReader::readPaxRecordByte(char c) {
+    if (_recordRemaining == 0) {
+        // The length, whose own digits and the space after them count towards it
+        static const uint64_t MAX_RECORD = 0x10000000;
+        if (c >= '0' && c <= '9') {
+            _size = std::min<uint64_t>(_size * 10 + (c - '0'), MAX_RECORD);
+            ++_offset;
+        } else if (c == ' ' && _size > _offset + 1u) {
+            _recordRemaining = _size - _offset - 1;
+            _keywordMatched = 0;
+            _inValue = false;
+        } else {
+            _size = 0; // not a record
+            _offset = 0;
+        }
+        return;
+    }
+
+    if (--_recordRemaining == 0) {
+        // The record's closing newline
+        if (_keywordMatched == 5) {
+            _longNameLength = _offset;
+        }
+        _size = 0;
+        _offset = 0;
+        return;
+    }
+    if (_inValue) {
+        if (_keywordMatched == 5) {
+            if (_offset < PATH_BUFFER_SIZE - 1) {
+                _path[_offset++] = c;
+            } else {
+                _keywordMatched = 6; // too long to keep, the header's own name will have to do
+            }
+        }
+    } else if (c == '=') {
+        _inValue = true;
+        _keywordMatched = _keywordMatched == 4 ? 5 : 0; // 5: the keyword was exactly "path"
+        _offset = 0;
+    } else if (_keywordMatched < 4 && c == "path"[_keywordMatched]) {
+        ++_keywordMatched;
+    } else {
+        _keywordMatched = 6; // some other keyword
+    }
+}
+
+bool TarReader::endMember() {
+    if (_callbacks->onMemberEnd(this) != 0) {
+        _state = State::Error;
+        return false;
+    }
+    skipPadding();
+
+    return true;
+}
+
+void TarReader::skipPadding() {
+    if (_padding != 0) {
+        _state = State::Padding;
+    } else {
+        beginHeader();
+    }
+}
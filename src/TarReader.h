@@ -0,0 +1,110 @@
+/* MIT License
+
+Copyright (c) 2023 Kenny Riddile
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#ifndef TARREADER_H
+#define TARREADER_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Parses a tar archive as it streams in, a few bytes at a time if need be.
+// Headers are picked apart byte by byte as they arrive rather than gathered
+// into a 512-byte block, so the only memory needed besides the reader itself
+// is room for one member path. ustar prefixes, GNU long names and pax path
+// records are understood; other pax records are skipped.
+class TarReader {
+public:
+    enum class Type : uint8_t {
+        File,
+        Directory,
+        Other // links, devices and the like, whose data is skipped
+    };
+
+    struct Callbacks {
+        // A member's header has been read. path() is its name.
+        int (*onMember)(TarReader* reader, Type type, uint64_t size);
+        int (*onData)(TarReader* reader, const char* at, size_t length);
+        int (*onMemberEnd)(TarReader* reader);
+    };
+
+    // Room path() needs: a 155-byte ustar prefix, a '/', a 100-byte name and
+    // a null terminator
+    static const size_t PATH_BUFFER_SIZE = 257;
+
+    void begin(char* pathBuffer, const Callbacks* callbacks, void* data);
+
+    // Consumes length bytes and returns how many were, which is fewer only
+    // when the archive is malformed or a callback returned non-zero. Anything
+    // after the end-of-archive marker is consumed and ignored.
+    size_t execute(const char* at, size_t length);
+
+    // Whether the end-of-archive marker has been read
+    bool finished() const { return _state == State::End; }
+    // Whether the archive ends cleanly here, between members
+    bool atMemberBoundary() const { return (_state == State::Header && _offset == 0) || _state == State::End; }
+
+    const char* path() const { return _path; }
+    void* data() const { return _data; }
+
+private:
+    enum class State : uint8_t {
+        Header,
+        Data,
+        LongName,
+        PaxHeader,
+        Skip,
+        Padding,
+        End,
+        Error
+    };
+
+    static const size_t NAME_OFFSET = 156; // where the name field waits in _path for the prefix
+
+    void beginHeader();
+    bool finishHeader();
+    bool endMember();
+    void skipPadding();
+    void readPaxRecordByte(char c);
+
+    const Callbacks* _callbacks = nullptr;
+    void* _data = nullptr;
+    char* _path = nullptr;
+    State _state = State::Header;
+    uint16_t _offset = 0;     // position within the current header block
+    uint16_t _padding = 0;    // bytes left of the current member's last block
+    uint64_t _remaining = 0;  // data bytes left in the current member
+    uint64_t _size = 0;       // size field of the header being read
+    uint32_t _checksum = 0;   // sum of the header's bytes, the checksum field counted as spaces
+    uint32_t _storedChecksum = 0;
+    char _type = 0;
+    bool _ustar = true;       // magic is POSIX "ustar\0", so the prefix field holds a path
+    bool _blank = true;       // every header byte so far was zero
+    bool _binarySize = false; // size field is GNU base-256
+    bool _hasLongName = false; // _path already holds a GNU long name for the next header
+    uint16_t _longNameLength = 0;
+    uint32_t _recordRemaining = 0; // bytes left in the pax record being read, 0 while reading its length
+    uint8_t _keywordMatched = 0;   // characters of "path" the pax record's keyword has matched so far
+    bool _inValue = false;         // past the '=' of the pax record
+};
+
+#endif
@@ -0,0 +1,72 @@
+/* MIT License
+
+Copyright (c) 2023 Kenny Riddile
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#include "TransferPipeline.h"
+
+void TransferPipeline::begin(char* buffer, size_t size) {
+    _buffer = buffer;
+    _blockSize = size / SDSERVER_PIPELINE_BLOCKS;
+    if (_blockSize >= 512) {
+        _blockSize = _blockSize / 512 * 512;
+    }
+    reset();
+}
+
+void TransferPipeline::reset() {
+    _produced.store(0);
+    _consumed.store(0);
+    _consumeOffset = 0;
+}
+
+char* TransferPipeline::producerBlock(size_t& capacity) {
+    uint32_t produced = _produced.load();
+    if (produced - _consumed.load() == SDSERVER_PIPELINE_BLOCKS) return nullptr;
+
+    capacity = _blockSize;
+    return _buffer + (produced % SDSERVER_PIPELINE_BLOCKS) * _blockSize;
+}
+
+void TransferPipeline::produce(size_t length) {
+    if (length == 0) return;
+
+    uint32_t produced = _produced.load();
+    _lengths[produced % SDSERVER_PIPELINE_BLOCKS] = length;
+    _produced.store(produced + 1); // publishes the length and the data
+}
+
+const char* TransferPipeline::consumerBlock(size_t& length) {
+    uint32_t consumed = _consumed.load();
+    if (consumed == _produced.load()) return nullptr;
+
+    size_t index = consumed % SDSERVER_PIPELINE_BLOCKS;
+    length = _lengths[index] - _consumeOffset;
+    return _buffer + index * _blockSize + _consumeOffset;
+}
+
+void TransferPipeline::consume(size_t length) {
+    uint32_t consumed = _consumed.load();
+    _consumeOffset += length;
+    if (_consumeOffset == _lengths[consumed % SDSERVER_PIPELINE_BLOCKS]) {
+        _consumeOffset = 0;
+        _consumed.store(consumed + 1);
+    }
+}
@@ -0,0 +1,77 @@
+/* MIT License
+
+Copyright (c) 2023 Kenny Riddile
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#ifndef TRANSFERPIPELINE_H
+#define TRANSFERPIPELINE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Blocks the pipeline buffer is split into. At least two, so one block can
+// be filled while another drains.
+#ifndef SDSERVER_PIPELINE_BLOCKS
+#define SDSERVER_PIPELINE_BLOCKS 4
+#endif
+
+// A ring of blocks carved out of a caller-provided buffer, passed from one
+// producer to one consumer. For a download the card side fills blocks and the
+// network side drains them, for an upload the other way around, so reading
+// or writing the card overlaps with the radio moving earlier blocks.
+//
+// Each side only ever writes its own counter, so the producer and consumer
+// may run on different cores without a lock.
+class TransferPipeline {
+public:
+    static_assert(SDSERVER_PIPELINE_BLOCKS >= 2, "SDSERVER_PIPELINE_BLOCKS must be at least 2");
+
+    // Blocks are made a multiple of 512 bytes long when the buffer allows it,
+    // so card reads into them stay whole sectors.
+    void begin(char* buffer, size_t size);
+    bool enabled() const { return _blockSize != 0; }
+    // Empties the ring. Neither side may be using it.
+    void reset();
+
+    // Producer: the next empty block and its capacity, or nullptr when every
+    // block is full. produce() hands length bytes of it to the consumer.
+    char* producerBlock(size_t& capacity);
+    void produce(size_t length);
+
+    // Consumer: the unconsumed part of the oldest full block, or nullptr when
+    // there is none. A block is returned to the producer once all of it has
+    // been consumed.
+    const char* consumerBlock(size_t& length);
+    void consume(size_t length);
+
+    // Whether everything produced has been consumed
+    bool empty() const { return _consumed.load() == _produced.load(); }
+
+private:
+    char* _buffer = nullptr;
+    size_t _blockSize = 0;
+    size_t _lengths[SDSERVER_PIPELINE_BLOCKS];
+    std::atomic<uint32_t> _produced{0}; // blocks handed to the consumer, only written by the producer
+    std::atomic<uint32_t> _consumed{0}; // blocks handed back, only written by the consumer
+    size_t _consumeOffset = 0;          // consumer's position within its current block
+};
+
+#endif
@@ -9,7 +9,9 @@
 #include <stdarg.h>
 #include <string.h>
 
-#include <SerialUSB.h>
+#ifdef SDSERVER_DEBUG
+#include <Arduino.h>
+#endif
 
 static void multipart_log(const char * format)
 {
@@ -66,6 +68,17 @@ void multipart_parser_init(multipart_parser* p, const char* boundary, const mult
   strcpy(p->multipart_boundary + 2, boundary);
   p->boundary_length = strlen(boundary) + 2;
 
+  // Part data ends at CR LF followed by the boundary. Every byte value shifts
+  // the search window by the whole delimiter length, except those that occur
+  // in the delimiter before its last byte.
+  size_t delimiter_length = p->boundary_length + 2;
+  memset(p->delimiter_skip, (unsigned char) delimiter_length, sizeof(p->delimiter_skip));
+  p->delimiter_skip[CR] = (unsigned char) (delimiter_length - 1);
+  p->delimiter_skip[LF] = (unsigned char) (delimiter_length - 2);
+  for (size_t j = 0; j + 1 < p->boundary_length; ++j) {
+    p->delimiter_skip[(unsigned char) p->multipart_boundary[j]] = (unsigned char) (p->boundary_length - 1 - j);
+  }
+
   p->index = 0;
   p->state = s_start;
   p->settings = settings;
@@ -79,6 +92,45 @@ void *multipart_parser_get_data(multipart_parser *p) {
     return p->data;
 }
 
+static int delimiter_matches(const multipart_parser* p, const char* at, size_t length) {
+  if (length && at[0] != CR) return 0;
+  if (length > 1 && at[1] != LF) return 0;
+  return length <= 2 || memcmp(at + 2, p->multipart_boundary, length - 2) == 0;
+}
+
+/* Returns the offset of the first byte at or after begin that could start the
+ * delimiter: either a complete delimiter, or a prefix of one that runs into
+ * the end of the buffer. Returns len when no such byte exists, meaning the
+ * whole range is part data. */
+static size_t find_delimiter_candidate(const multipart_parser* p, const char* buf, size_t begin, size_t len) {
+  const size_t delimiter_length = p->boundary_length + 2;
+  const unsigned char last = (unsigned char) p->multipart_boundary[p->boundary_length - 1];
+  size_t pos = begin;
+  while (pos + delimiter_length <= len) {
+    unsigned char c = (unsigned char) buf[pos + delimiter_length - 1];
+    if (c == last && delimiter_matches(p, buf + pos, delimiter_length - 1)) {
+      return pos;
+    }
+    pos += p->delimiter_skip[c];
+  }
+
+  // Every start position up to len - delimiter_length has been ruled out
+  if (len >= delimiter_length && pos < len - delimiter_length + 1) {
+    pos = len - delimiter_length + 1;
+  }
+  while (pos < len) {
+    const char* cr = (const char*) memchr(buf + pos, CR, len - pos);
+    if (!cr) break;
+    pos = cr - buf;
+    if (delimiter_matches(p, cr, len - pos)) {
+      return pos;
+    }
+    ++pos;
+  }
+
+  return len;
+}
+
 size_t multipart_parser_execute(multipart_parser* p, const char *buf, size_t len) {
   size_t i = 0;
   size_t mark = 0;
@@ -121,12 +173,17 @@ size_t multipart_parser_execute(multipart_parser* p, const char *buf, size_t len
       case s_header_field_start:
         multipart_log("s_header_field_start");
         mark = i;
+        p->index = 0;
         p->state = s_header_field;
 
       /* fallthrough */
       case s_header_field:
         multipart_log("s_header_field");
         if (c == CR) {
+          if (p->index != 0) {
+            multipart_log("header line without a colon");
+            return i; // and not the blank line ending the headers
+          }
           p->state = s_headers_almost_done;
           break;
         }
@@ -142,6 +199,7 @@ size_t multipart_parser_execute(multipart_parser* p, const char *buf, size_t len
           multipart_log("invalid character in header name");
           return i;
         }
+        p->index++;
         if (is_last)
             EMIT_DATA_CB(header_field, buf + mark, (i - mark) + 1);
         break;
@@ -193,15 +251,21 @@ size_t multipart_parser_execute(multipart_parser* p, const char *buf, size_t len
       /* fallthrough */
       case s_part_data:
         multipart_log("s_part_data");
-        if (c == CR) {
-        EMIT_DATA_CB(part_data, buf + mark, i - mark);
-        mark = i;
-        p->state = s_part_data_almost_boundary;
-        p->lookbehind[0] = CR;
-        break;
+        {
+          // Everything before the next possible delimiter is emitted as one run
+          size_t candidate = find_delimiter_candidate(p, buf, i, len);
+          if (candidate == len) {
+            EMIT_DATA_CB(part_data, buf + mark, len - mark);
+            return len;
+          }
+          if (candidate > mark) {
+            EMIT_DATA_CB(part_data, buf + mark, candidate - mark);
+          }
+          i = candidate;
+          mark = i;
+          p->state = s_part_data_almost_boundary;
+          p->lookbehind[0] = CR;
         }
-        if (is_last)
-        EMIT_DATA_CB(part_data, buf + mark, (i - mark) + 1);
         break;
 
       case s_part_data_almost_boundary:
@@ -214,22 +278,7 @@ size_t multipart_parser_execute(multipart_parser* p, const char *buf, size_t len
         }
         EMIT_DATA_CB(part_data, p->lookbehind, 1);
         p->state = s_part_data;
-
-        //  sckime edit  begin
-        if (i == 0)
-        {
-          mark = i; // The new buffer mark is the start, would otherwise be -1
-        }
-        else if (is_last)
-        {
-          mark = i; 
-          EMIT_DATA_CB(part_data, buf + mark, (i - mark) + 1); // No one will output this data otherwise.
-        }
-        else
-        //  sckime edit  end
-        {
-          mark = i --;
-        }
+        mark = i --; // scan this byte again as part data
         break;
 
       case s_part_data_boundary:
@@ -238,15 +287,7 @@ size_t multipart_parser_execute(multipart_parser* p, const char *buf, size_t len
           //EMIT_DATA_CB(part_data, p->lookbehind, 4 + p->index);
           EMIT_DATA_CB(part_data, p->lookbehind, 2 + p->index);
           p->state = s_part_data;
-          mark = i --;
-
-          // sckime edit begin
-          if (is_last)
-          {
-            mark = i;
-            EMIT_DATA_CB(part_data, buf + mark, (i - mark) + 1);  // No one will output this data otherwise.
-          }
-          //sckime edit end
+          mark = i --; // scan this byte again as part data
           break;
         }
         p->lookbehind[2 + p->index] = c;
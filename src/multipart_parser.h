@@ -29,6 +29,9 @@ typedef struct multipart_parser {
   // https://www.w3.org/Protocols/rfc1341/7_2_Multipart.html
   char multipart_boundary[73];
   char lookbehind[75];
+
+  // Boyer-Moore-Horspool shifts for the delimiter "\r\n" + multipart_boundary
+  unsigned char delimiter_skip[256];
 } multipart_parser;
 
 typedef int (*multipart_data_cb) (multipart_parser*, const char *at, size_t length);